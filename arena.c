@@ -0,0 +1,235 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/arena.h>
+#include <pthread.h>
+
+/* buffers start on a cache line */
+#define ARENA_ALIGN	64
+
+struct arena_spill {
+	struct arena_spill *next;
+};
+
+struct arena_buf {
+	void *b_mem;
+	uint8_t *b_base;
+	size_t b_size;
+	size_t b_used;
+	size_t b_spilled;
+	struct arena_spill *b_spill;
+};
+
+struct _arena {
+	const char *a_name;
+	struct arena_buf a_buf[2];
+	unsigned int a_cur;
+	size_t a_peak;
+	unsigned long a_frames;
+	unsigned long a_overflows;
+	size_t a_overflow_bytes;
+	struct _arena *a_next, **a_pprev;
+};
+
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct _arena *arenas;
+static __thread struct _arena *frame_arena;
+
+static int buf_new(struct arena_buf *b, size_t size)
+{
+	b->b_mem = malloc(size + ARENA_ALIGN - 1);
+	if ( NULL == b->b_mem )
+		return 0;
+
+	b->b_base = (uint8_t *)(((uintptr_t)b->b_mem + ARENA_ALIGN - 1) &
+				~(uintptr_t)(ARENA_ALIGN - 1));
+	b->b_size = size;
+	return 1;
+}
+
+static void buf_reset(struct arena_buf *b)
+{
+	struct arena_spill *s, *tmp;
+
+	for(s = b->b_spill; (tmp = s); free(tmp))
+		s = s->next;
+
+	b->b_spill = NULL;
+	b->b_used = 0;
+	b->b_spilled = 0;
+}
+
+static void buf_free(struct arena_buf *b)
+{
+	buf_reset(b);
+	free(b->b_mem);
+}
+
+arena_t arena_new(const char *name, size_t size)
+{
+	struct _arena *a;
+
+	a = calloc(1, sizeof(*a));
+	if ( NULL == a )
+		goto out;
+
+	if ( !buf_new(&a->a_buf[0], size) )
+		goto out_free;
+	if ( !buf_new(&a->a_buf[1], size) )
+		goto out_free_buf;
+
+	a->a_name = name;
+
+	pthread_mutex_lock(&arenas_lock);
+	a->a_next = arenas;
+	if ( arenas )
+		arenas->a_pprev = &a->a_next;
+	a->a_pprev = &arenas;
+	arenas = a;
+	pthread_mutex_unlock(&arenas_lock);
+
+	/* success */
+	goto out;
+
+out_free_buf:
+	buf_free(&a->a_buf[0]);
+out_free:
+	free(a);
+	a = NULL;
+out:
+	return a;
+}
+
+/* doesn't fit, so it gets its own allocation until the next flip */
+static void *spill(struct _arena *a, struct arena_buf *b,
+			size_t sz, size_t align)
+{
+	struct arena_spill *s;
+	uintptr_t ptr;
+
+	if ( align < sizeof(*s) )
+		align = sizeof(*s);
+
+	s = malloc(sizeof(*s) + sz + align - 1);
+	if ( NULL == s )
+		return NULL;
+
+	s->next = b->b_spill;
+	b->b_spill = s;
+	b->b_spilled += sz + align;
+
+	a->a_overflows++;
+	a->a_overflow_bytes += sz;
+
+	ptr = ((uintptr_t)(s + 1) + align - 1) & ~(uintptr_t)(align - 1);
+	return (void *)ptr;
+}
+
+/* align must be a power of two, zero means no alignment */
+void *arena_alloc(arena_t a, size_t sz, size_t align)
+{
+	struct arena_buf *b = &a->a_buf[a->a_cur];
+	uintptr_t ptr;
+	size_t ofs;
+
+	if ( align < 1 )
+		align = 1;
+	assert(0 == (align & (align - 1)));
+
+	ptr = ((uintptr_t)(b->b_base + b->b_used) + align - 1) &
+		~(uintptr_t)(align - 1);
+	ofs = ptr - (uintptr_t)b->b_base;
+	if ( ofs + sz > b->b_size )
+		return spill(a, b, sz, align);
+
+	b->b_used = ofs + sz;
+	return (void *)ptr;
+}
+
+/* whatever was spilled last time round this buffer is folded in to it */
+void arena_flip(arena_t a)
+{
+	struct arena_buf *b;
+	size_t used;
+
+	b = &a->a_buf[a->a_cur];
+	used = b->b_used + b->b_spilled;
+	if ( used > a->a_peak )
+		a->a_peak = used;
+
+	a->a_cur ^= 1;
+	a->a_frames++;
+
+	b = &a->a_buf[a->a_cur];
+	if ( b->b_spill ) {
+		struct arena_buf tmp;
+		size_t size = b->b_used + b->b_spilled;
+
+		memset(&tmp, 0, sizeof(tmp));
+		if ( size < a->a_peak )
+			size = a->a_peak;
+		if ( buf_new(&tmp, size) ) {
+			buf_free(b);
+			*b = tmp;
+		}
+	}
+
+	buf_reset(b);
+}
+
+void arena_stats(arena_t a, struct arena_stats *st)
+{
+	const struct arena_buf *b = &a->a_buf[a->a_cur];
+
+	st->name = a->a_name;
+	st->size = b->b_size;
+	st->used = b->b_used + b->b_spilled;
+	st->peak = (st->used > a->a_peak) ? st->used : a->a_peak;
+	st->frames = a->a_frames;
+	st->overflows = a->a_overflows;
+	st->overflow_bytes = a->a_overflow_bytes;
+}
+
+/* the numbers for arenas in use by another thread may be a little off */
+void arena_stats_all(arena_stats_cb_t cb, void *priv)
+{
+	struct arena_stats st;
+	struct _arena *a;
+
+	pthread_mutex_lock(&arenas_lock);
+	for(a = arenas; a; a = a->a_next) {
+		arena_stats(a, &st);
+		(*cb)(priv, &st);
+	}
+	pthread_mutex_unlock(&arenas_lock);
+}
+
+void arena_free(arena_t a)
+{
+	if ( NULL == a )
+		return;
+
+	pthread_mutex_lock(&arenas_lock);
+	*a->a_pprev = a->a_next;
+	if ( a->a_next )
+		a->a_next->a_pprev = a->a_pprev;
+	pthread_mutex_unlock(&arenas_lock);
+
+	buf_free(&a->a_buf[0]);
+	buf_free(&a->a_buf[1]);
+	free(a);
+}
+
+void frame_arena_set(arena_t a)
+{
+	frame_arena = a;
+}
+
+void *frame_alloc(size_t sz, size_t align)
+{
+	if ( NULL == frame_arena )
+		return NULL;
+	return arena_alloc(frame_arena, sz, align);
+}
@@ -256,6 +256,14 @@ void asset_file_render_begin(asset_file_t f, renderer_t r, light_t l)
 	}
 }
 
+void asset_file_render_free(struct _asset_file *f)
+{
+	glDeleteBuffers(1, &f->f_vbo_geom);
+	glDeleteBuffers(1, &f->f_ibo_geom);
+	glDeleteBuffers(1, &f->f_vbo_shadow);
+	glDeleteBuffers(1, &f->f_ibo_shadow);
+}
+
 void asset_file_render_end(asset_file_t f)
 {
 	glDisableClientState(GL_VERTEX_ARRAY);
@@ -77,4 +77,7 @@ struct _asset {
 	unsigned int a_num_shadow_idx;
 };
 
+/* drop whatever the renderer has uploaded for the file */
+void asset_file_render_free(struct _asset_file *f);
+
 #endif /* _PUNANI_ASSETFILE_H */
@@ -52,14 +52,20 @@ struct _chopper {
 	float oldf_velocity;
 	float oldfselocity;
 
+	/* mirrors the entity's altitude for the console */
+	float height;
+
 	cvar_ns_t cvars;
 };
 
 void chopper_get_pos(chopper_t c, float lerp, vec3_t out)
 {
-	out[0] = c->ent.e_oldorigin[0] + c->ent.e_move[0] * lerp;
-	out[1] = c->ent.e_oldorigin[1] + c->ent.e_move[1] * lerp;
-	out[2] = c->ent.e_oldorigin[2] + c->ent.e_move[2] * lerp;
+	const float *o = entity_oldorigin(&c->ent);
+	const float *m = entity_move(&c->ent);
+
+	out[0] = o[0] + m[0] * lerp;
+	out[1] = o[1] + m[1] * lerp;
+	out[2] = o[2] + m[2] * lerp;
 }
 
 static void linear_velocity_think(int ctrl, int *vel_throttle_time,
@@ -152,6 +158,7 @@ static void e_dtor(struct _entity *e)
 static void e_think(struct _entity *e)
 {
 	struct _chopper *c = (struct _chopper *)e;
+	float *angles = entity_angles(e), *move = entity_move(e);
 	int tctrl = 0;
 	int rctrl = 0;
 	int sctrl = 0;
@@ -188,25 +195,24 @@ static void e_think(struct _entity *e)
 				ALTITUDE_INCREMENTS, ALTITUDE_UNIT);
 
 
-	c->ent.e_angles[0] = (c->f_velocity * 5.0) / (180.0 / M_PI);
-	c->ent.e_angles[1] += c->rot_velocity;
-	c->ent.e_angles[2] = (((3.0 * c->f_velocity) *
+	angles[0] = (c->f_velocity * 5.0) / (180.0 / M_PI);
+	angles[1] += c->rot_velocity;
+	angles[2] = (((3.0 * c->f_velocity) *
 				(-c->rot_velocity * M_PI * 2.0)) +
 				(c->s_velocity * 3.0)) / (180.0 / M_PI);
 
-	c->ent.e_move[0] = (c->f_velocity * sin(c->ent.e_angles[1])) +
-				(c->s_velocity * sin(c->ent.e_angles[1]- M_PI_2));
-	c->ent.e_move[1] = c->alt_velocity;
-	c->ent.e_move[2] = (c->f_velocity * cos(c->ent.e_angles[1])) +
-				(c->s_velocity * cos(c->ent.e_angles[1] - M_PI_2));
+	move[0] = (c->f_velocity * sin(angles[1])) +
+				(c->s_velocity * sin(angles[1]- M_PI_2));
+	move[1] = c->alt_velocity;
+	move[2] = (c->f_velocity * cos(angles[1])) +
+				(c->s_velocity * cos(angles[1] - M_PI_2));
+
+	c->height = entity_origin(e)[1];
 }
 
 static void e_render(struct _entity *e, renderer_t r, float lerp, light_t l)
 {
 	struct _chopper *c = (struct _chopper *)e;
-	vec3_t pos;
-
-	chopper_get_pos(c, lerp, pos);
 
 	asset_file_dirty_shadows(c->asset);
 	asset_file_render_begin(c->asset, r, l);
@@ -223,7 +229,7 @@ static void e_render(struct _entity *e, renderer_t r, float lerp, light_t l)
 static void e_collide_world(struct _entity *e, const vec3_t hit)
 {
 	struct _chopper *c = (struct _chopper *)e;
-	v_zero(e->e_move);
+	v_zero(entity_move(e));
 	c->f_velocity = 0;
 	c->s_velocity = 0;
 	c->alt_velocity = 0;
@@ -300,9 +306,10 @@ static chopper_t get_chopper(const char *file, const vec3_t pos, float heading)
 
 	c->cvars = cvar_ns_new("chopper");
 
+	/* read only, it's only a copy of the altitude for the console */
 	cvar_register_float(c->cvars, "height",
-				CVAR_FLAG_SAVE_NOTDEFAULT,
-				&c->ent.e_origin[1]);
+				CVAR_FLAG_SAVE_NEVER,
+				&c->height);
 	cvar_register_float(c->cvars, "rot_max",
 				CVAR_FLAG_SAVE_NOTDEFAULT,
 				&rotation_max);
@@ -312,12 +319,17 @@ static chopper_t get_chopper(const char *file, const vec3_t pos, float heading)
 
 	cvar_ns_load(c->cvars);
 
-	entity_spawn(&c->ent, &e_ops, pos, NULL, angles);
+	if ( !entity_spawn(&c->ent, &e_ops, pos, NULL, angles) )
+		goto out_free_cvars;
 	entity_link(&c->ent);
+	c->height = pos[1];
 
 	/* success */
 	goto out;
 
+out_free_cvars:
+	cvar_ns_free(c->cvars);
+	asset_put(c->rotor);
 out_free_fuselage:
 	asset_put(c->fuselage);
 out_free_rotor:
@@ -354,7 +366,7 @@ void chopper_fire(chopper_t c, unsigned int time)
 	if ( pitch < M_PI / 2.0 )
 		pitch = M_PI / 2.0;
 
-	missile_spawn(c->ent.e_origin, c->ent.e_angles);
+	missile_spawn(&c->ent, entity_origin(&c->ent), entity_angles(&c->ent));
 	c->last_fire = time;
 }
 
@@ -386,3 +398,13 @@ void chopper_control_release_all(chopper_t c)
 	c->input = 0;
 }
 
+unsigned int chopper_input(chopper_t c)
+{
+	return c->input;
+}
+
+void chopper_set_input(chopper_t c, unsigned int input)
+{
+	c->input = input & ((1 << CHOPPER_NUM_CONTROLS) - 1);
+}
+
@@ -1,9 +1,12 @@
 #include <punani/console.h>
 #include <punani/cmd.h>
 #include <punani/cvar.h>
+#include <punani/arena.h>
 #include <string.h>
 #include <ctype.h>
 
+#include "hgang.h"
+
 #define CMD_MAX_PARAMS 20
 
 typedef struct _cmd_listener {
@@ -11,6 +14,36 @@ typedef struct _cmd_listener {
 	cmd_parse_callback_t *cb;
 } cmd_listener_t;
 
+static void hgang_print(void *priv, const struct hgang_stats *st)
+{
+	con_printf("%-16s %6zu %6u %8lu %8lu %8lu\n",
+			(st->name) ? st->name : "(anonymous)",
+			st->obj_size, st->slabs,
+			st->live, st->free, st->peak);
+}
+
+static void cmd_hgang_list(size_t paramc, char **paramv)
+{
+	con_printf("%-16s %6s %6s %8s %8s %8s\n",
+			"name", "size", "slabs", "live", "free", "peak");
+	hgang_stats_all(hgang_print, NULL);
+}
+
+static void arena_print(void *priv, const struct arena_stats *st)
+{
+	con_printf("%-16s %8zu %8zu %8zu %8lu %8lu %8zu\n",
+			st->name, st->size, st->used, st->peak,
+			st->frames, st->overflows, st->overflow_bytes);
+}
+
+static void cmd_arena_list(size_t paramc, char **paramv)
+{
+	con_printf("%-16s %8s %8s %8s %8s %8s %8s\n",
+			"name", "size", "used", "peak",
+			"frames", "spills", "spilled");
+	arena_stats_all(arena_print, NULL);
+}
+
 static cmd_listener_t cmds[] = {
 	{
 		.cmd_name = "cvar_list",
@@ -20,6 +53,14 @@ static cmd_listener_t cmds[] = {
 		.cmd_name = "set",
 		.cb = cmd_set,
 	},
+	{
+		.cmd_name = "hgang_list",
+		.cb = cmd_hgang_list,
+	},
+	{
+		.cmd_name = "arena_list",
+		.cb = cmd_arena_list,
+	},
 };
 
 
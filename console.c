@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 #include <SDL.h>
 #include <punani/punani.h>
 #include <punani/punani_gl.h>
@@ -22,6 +23,9 @@ static void con_do_input(char *input);
 
 static unsigned int con_display_lines = 10;
 
+/* the log is written from the tick thread too */
+static pthread_mutex_t con_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct _console {
 	/* one of CONSOLE_VISIBLE or CONSOLE_HIDDEN */
 	int  state;
@@ -101,6 +105,7 @@ void con_printf(const char *fmt, ...)
 		buf[CONSOLE_LINE_MAX_LEN - 2] = '\n';
 	}
 	
+	pthread_mutex_lock(&con_lock);
 	ptr = buf;
 	nl = strchr(ptr, '\n');
 
@@ -115,6 +120,7 @@ void con_printf(const char *fmt, ...)
 	}
 	
 	snprintf(con_default->lines[con_default->line], CONSOLE_LINE_MAX_LEN, "%s%s", con_default->lines[con_default->line], ptr);
+	pthread_mutex_unlock(&con_lock);
 }
 
 /* splice some characters out of the current input line. current input line ends up consisting of line[s0_start]..line[s0_end] + line[s1_start]..line[CONSOLE_LINE_MAX_LEN]. */
@@ -330,6 +336,7 @@ void con_render(renderer_t r)
 			glEnable(GL_TEXTURE_2D);
 		}
 
+		pthread_mutex_lock(&con_lock);
 		offs = (con_default->lines_size % CONSOLE_MAX_LINES) - num_lines;
 		for(i = 0; i < num_lines; i++, offs++) {
 			if (offs < 0 && con_default->lines_size < CONSOLE_MAX_LINES) {
@@ -339,6 +346,7 @@ void con_render(renderer_t r)
 				font_print(con_default->font, 0, border_top + i * pitchy, con_default->lines[offs % CONSOLE_MAX_LINES]);
 			}
 		}
+		pthread_mutex_unlock(&con_lock);
 
 		/* offset the input line if it's wider than the screen can show. we also keep a buffer of 3 characters at the "other side" of it, so that inplace editing is a bit more sensible. */
 		/* todo: blatantly should be able to move the character "within" the buffer within a current line when offset, and only scroll when at the left- or right- edges. */
@@ -0,0 +1,257 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/vec.h>
+#include <punani/chopper.h>
+#include <punani/console.h>
+#include <punani/blob.h>
+#include <punani/rng.h>
+#include <punani/demo.h>
+
+#include "demofile.h"
+
+struct _demo {
+	FILE *d_file;
+	uint8_t *d_buf;
+	size_t d_sz;
+	const struct demo_ev *d_ev;
+	unsigned int d_num_ev;
+	unsigned int d_cur;
+	unsigned int d_num_ticks;
+	unsigned int d_tick;
+	uint32_t d_seed;
+	unsigned int d_input;
+	int d_fire;
+	int d_err;
+
+	uint32_t *d_times;
+	unsigned int d_num_times;
+	unsigned int d_max_times;
+};
+
+demo_t demo_record(const char *fn, uint32_t seed)
+{
+	struct _demo *d;
+	struct demo_hdr hdr;
+
+	d = calloc(1, sizeof(*d));
+	if ( NULL == d )
+		goto out;
+
+	d->d_file = fopen(fn, "wb");
+	if ( NULL == d->d_file ) {
+		con_printf("demo: %s: %s\n", fn, strerror(errno));
+		goto out_free;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.h_magic = DEMOFILE_MAGIC;
+	hdr.h_version = DEMOFILE_VERSION;
+	hdr.h_seed = seed;
+	if ( fwrite(&hdr, sizeof(hdr), 1, d->d_file) != 1 ) {
+		con_printf("demo: %s: %s\n", fn, strerror(errno));
+		goto out_close;
+	}
+
+	/* force an event on the first tick */
+	d->d_input = ~0U;
+	d->d_seed = seed;
+	rng_seed(seed);
+	goto out;
+
+out_close:
+	fclose(d->d_file);
+out_free:
+	free(d);
+	d = NULL;
+out:
+	return d;
+}
+
+demo_t demo_play(const char *fn)
+{
+	const struct demo_hdr *hdr;
+	struct _demo *d;
+
+	d = calloc(1, sizeof(*d));
+	if ( NULL == d )
+		goto out;
+
+	d->d_buf = blob_from_file(fn, &d->d_sz);
+	if ( NULL == d->d_buf )
+		goto out_free;
+
+	hdr = (const struct demo_hdr *)d->d_buf;
+	if ( d->d_sz < sizeof(*hdr) ||
+			hdr->h_magic != DEMOFILE_MAGIC ||
+			hdr->h_version != DEMOFILE_VERSION ) {
+		con_printf("demo: %s: not a demo file\n", fn);
+		goto out_free_buf;
+	}
+
+	d->d_ev = (const struct demo_ev *)(d->d_buf + sizeof(*hdr));
+	d->d_num_ev = (d->d_sz - sizeof(*hdr)) / sizeof(*d->d_ev);
+	d->d_num_ticks = hdr->h_num_ticks;
+
+	/* recording was cut short, play as far as it got */
+	if ( !d->d_num_ticks && d->d_num_ev )
+		d->d_num_ticks = d->d_ev[d->d_num_ev - 1].e_tick + 1;
+
+	d->d_seed = hdr->h_seed;
+	rng_seed(d->d_seed);
+	goto out;
+
+out_free_buf:
+	blob_free(d->d_buf, d->d_sz);
+out_free:
+	free(d);
+	d = NULL;
+out:
+	return d;
+}
+
+int demo_playing(demo_t d)
+{
+	return NULL == d->d_file;
+}
+
+unsigned int demo_num_ticks(demo_t d)
+{
+	return d->d_num_ticks;
+}
+
+static void record_tick(struct _demo *d, chopper_t apache)
+{
+	struct demo_ev ev;
+	unsigned int input;
+
+	input = chopper_input(apache);
+	if ( input != d->d_input || d->d_fire ) {
+		ev.e_tick = d->d_tick;
+		ev.e_input = input;
+		ev.e_flags = (d->d_fire) ? DEMO_EV_FIRE : 0;
+		ev.e_pad = 0;
+		if ( fwrite(&ev, sizeof(ev), 1, d->d_file) != 1 && !d->d_err ) {
+			con_printf("demo: write: %s\n", strerror(errno));
+			d->d_err = 1;
+		}
+		d->d_input = input;
+		d->d_fire = 0;
+	}
+
+	d->d_tick++;
+}
+
+static int play_tick(struct _demo *d, chopper_t apache, unsigned int time)
+{
+	const struct demo_ev *ev;
+
+	if ( d->d_tick >= d->d_num_ticks )
+		return 0;
+
+	while(d->d_cur < d->d_num_ev && d->d_ev[d->d_cur].e_tick <= d->d_tick) {
+		ev = &d->d_ev[d->d_cur++];
+		chopper_set_input(apache, ev->e_input);
+		if ( ev->e_flags & DEMO_EV_FIRE )
+			chopper_fire(apache, time);
+	}
+
+	d->d_tick++;
+	return 1;
+}
+
+int demo_tick(demo_t d, chopper_t apache, unsigned int time)
+{
+	if ( demo_playing(d) )
+		return play_tick(d, apache, time);
+
+	record_tick(d, apache);
+	return 1;
+}
+
+void demo_fire(demo_t d)
+{
+	d->d_fire = 1;
+}
+
+void demo_frame_time(demo_t d, uint64_t usec)
+{
+	if ( d->d_num_times >= d->d_max_times ) {
+		uint32_t *new;
+		unsigned int max;
+
+		max = (d->d_max_times) ? d->d_max_times * 2 : 1024;
+		new = realloc(d->d_times, max * sizeof(*new));
+		if ( NULL == new )
+			return;
+
+		d->d_times = new;
+		d->d_max_times = max;
+	}
+
+	d->d_times[d->d_num_times++] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+}
+
+static int time_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* nearest rank */
+static uint32_t percentile(const uint32_t *t, unsigned int num, unsigned int p)
+{
+	unsigned int rank;
+
+	rank = (num * p + 99) / 100;
+	return t[(rank) ? rank - 1 : 0];
+}
+
+static void print_times(struct _demo *d)
+{
+	uint32_t *t = d->d_times;
+	unsigned int n = d->d_num_times;
+	uint64_t total = 0;
+	unsigned int i;
+
+	if ( !n )
+		return;
+
+	qsort(t, n, sizeof(*t), time_cmp);
+	for(i = 0; i < n; i++)
+		total += t[i];
+
+	con_printf("demo: %u frames, usec mean %"PRIu64" p50 %u p90 %u "
+			"p99 %u max %u\n", n, total / n,
+			percentile(t, n, 50), percentile(t, n, 90),
+			percentile(t, n, 99), t[n - 1]);
+}
+
+void demo_close(demo_t d)
+{
+	if ( NULL == d )
+		return;
+
+	print_times(d);
+
+	if ( d->d_file ) {
+		struct demo_hdr hdr;
+
+		/* only now do we know how long it is */
+		hdr.h_magic = DEMOFILE_MAGIC;
+		hdr.h_version = DEMOFILE_VERSION;
+		hdr.h_seed = d->d_seed;
+		hdr.h_num_ticks = d->d_tick;
+		if ( fseek(d->d_file, 0, SEEK_SET) ||
+				fwrite(&hdr, sizeof(hdr), 1, d->d_file) != 1 )
+			con_printf("demo: header: %s\n", strerror(errno));
+		fclose(d->d_file);
+	}else{
+		blob_free(d->d_buf, d->d_sz);
+	}
+
+	free(d->d_times);
+	free(d);
+}
@@ -0,0 +1,36 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_DEMOFILE_H
+#define _PUNANI_DEMOFILE_H
+
+/* Demo file format:
+ * [ hdr ]
+ * [ events ]
+ *
+ * An event is only written on ticks where the controls changed or the
+ * chopper fired, the controls are held until the next one. h_num_ticks is
+ * filled in when recording finishes, zero means it was cut short.
+*/
+
+#define DEMOFILE_MAGIC		0x55d4de30
+#define DEMOFILE_VERSION	1
+
+struct demo_hdr {
+	uint32_t h_magic;
+	uint32_t h_version;
+	uint32_t h_seed;
+	uint32_t h_num_ticks;
+}__attribute__((packed));
+
+#define DEMO_EV_FIRE	(1 << 0)
+
+struct demo_ev {
+	uint32_t e_tick;
+	uint16_t e_input;
+	uint8_t e_flags;
+	uint8_t e_pad;
+}__attribute__((packed));
+
+#endif /* _PUNANI_DEMOFILE_H */
@@ -10,6 +10,8 @@
 #include "dessert-stroke.h"
 #include "game-modes.h"
 
+#include <unistd.h>
+
 static const struct game_ops *game_modes[DS_NUM_STATES] = {
 	[GAME_STATE_STOPPED] = NULL,
 	[DS_STATE_LOBBY] = &lobby_ops,
@@ -30,11 +32,37 @@ static void mode_exit(struct _game *g, int code)
 	}
 }
 
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-r demo | -p demo]\n", cmd);
+}
+
 int main(int argc, char **argv)
 {
+	static struct ds_opts opts;
 	game_t g;
+	int c;
+
+	while( (c = getopt(argc, argv, "r:p:h")) != -1 ) {
+		switch(c) {
+		case 'r':
+			opts.demo_record = optarg;
+			break;
+		case 'p':
+			opts.demo_play = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( opts.demo_record && opts.demo_play ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
 
-	g = game_new(game_modes, DS_NUM_STATES, mode_exit, NULL);
+	g = game_new(game_modes, DS_NUM_STATES, mode_exit, &opts);
 	if ( NULL == g )
 		return EXIT_FAILURE;
 
@@ -5,6 +5,12 @@
 #define DS_STATE_ON	2
 #define DS_NUM_STATES	3
 
+/* from the command line, shared by every mode */
+struct ds_opts {
+	const char *demo_record;
+	const char *demo_play;
+};
+
 extern const struct game_ops lobby_ops;
 extern const struct game_ops world_ops;
 
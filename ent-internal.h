@@ -5,23 +5,61 @@
 #ifndef _ENTITY_INTERNAL_H
 #define _ENTITY_INTERNAL_H
 
-#include "list.h"
+/* Entity state which every pass touches lives in dense arrays, one per
+ * component, indexed by e_idx. Unlinking an entity moves the last one in
+ * to its place, so e_idx is only valid while linked and pointers in to
+ * the arrays must not be kept across a call which links or unlinks.
+*/
+#define ENT_IDX_NONE	(~0U)
 
 struct _entity {
-	struct list_head e_list;
-	struct list_head e_group;
 	const struct entity_ops *e_ops;
-	vec3_t e_origin;
-	vec3_t e_lerp;
-	vec3_t e_move;
-	vec3_t e_angles;
-	vec3_t e_oldangles;
-	vec3_t e_oldorigin;
-	vec3_t e_oldlerp;
+	entity_handle_t e_handle;
+	entity_handle_t e_owner; /* never collides with this one */
+	unsigned int e_idx;
 	unsigned int e_ref;
 	int collide;
 };
 
+struct entity_store {
+	struct _entity **s_owner;
+	uint8_t *s_type;
+	uint8_t *s_dead;
+	vec3_t *s_origin;
+	vec3_t *s_move;
+	vec3_t *s_angles;
+	vec3_t *s_oldorigin;
+	vec3_t *s_oldangles;
+	unsigned int s_num;
+	unsigned int s_max;
+};
+
+extern struct entity_store entities;
+
+/* What the render thread gets of an entity. The entity itself is only
+ * there for its ops and whatever else doesn't change after spawning.
+*/
+struct ent_view {
+	struct _entity *v_ent;
+	vec3_t v_oldorigin;
+	vec3_t v_move;
+	vec3_t v_oldangles;
+	vec3_t v_angles;
+	float v_radius;
+
+	/* filled in by entity_cull_all() */
+	vec3_t v_lerp;
+	vec3_t v_lerpangles;
+};
+
+struct _entity_snap {
+	struct ent_view *s_view;
+	unsigned int *s_vis;
+	unsigned int s_num;
+	unsigned int s_num_vis;
+	unsigned int s_max;
+};
+
 /* Mask to extract type from flags */
 #define ENT_TYPE_BITS	1
 #define ENT_TYPE_MASK	((1 << ENT_TYPE_BITS) - 1)
@@ -29,6 +67,7 @@ struct _entity {
 #define ENT_HELI	1
 
 struct entity_ops {
+	/* called from the render thread, with the transform applied */
 	void (*e_render)(struct _entity *ent, renderer_t r,
 				float lerp, light_t l);
 	void (*e_think)(struct _entity *e);
@@ -37,6 +76,9 @@ struct entity_ops {
 	/* for projectiles */
 	void (*e_collide_world)(struct _entity *ent, const vec3_t hit);
 
+	/* swept bounds overlap, called for each entity with this set */
+	void (*e_collide_entity)(struct _entity *ent, struct _entity *other);
+
 	/* for vehicles */
 	unsigned int (*e_num_meshes)(struct _entity *ent);
 	asset_t (*e_mesh)(struct _entity *ent, unsigned int i);
@@ -45,8 +87,8 @@ struct entity_ops {
 };
 
 void entity_unref(struct _entity *ent);
-void entity_render(struct _entity *ent, renderer_t r, float lerp, light_t l);
-void entity_spawn(struct _entity *ent, const struct entity_ops *ops,
+float entity_radius(struct _entity *ent);
+int entity_spawn(struct _entity *ent, const struct entity_ops *ops,
 			const vec3_t origin, const vec3_t move,
 			const vec3_t angles);
 
@@ -55,4 +97,35 @@ static inline void entity_ref(struct _entity *ent)
 	ent->e_ref++;
 }
 
+/* false once unlinked, even if removal from the store is deferred */
+static inline int entity_linked(const struct _entity *ent)
+{
+	return ent->e_idx != ENT_IDX_NONE && !entities.s_dead[ent->e_idx];
+}
+
+static inline float *entity_origin(struct _entity *ent)
+{
+	return entities.s_origin[ent->e_idx];
+}
+
+static inline float *entity_move(struct _entity *ent)
+{
+	return entities.s_move[ent->e_idx];
+}
+
+static inline float *entity_angles(struct _entity *ent)
+{
+	return entities.s_angles[ent->e_idx];
+}
+
+static inline float *entity_oldorigin(struct _entity *ent)
+{
+	return entities.s_oldorigin[ent->e_idx];
+}
+
+static inline float *entity_oldangles(struct _entity *ent)
+{
+	return entities.s_oldangles[ent->e_idx];
+}
+
 #endif /* _ENTITY_INTERNAL_H */
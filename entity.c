@@ -3,34 +3,220 @@
  * Released under the terms of GPLv3
 */
 #include <punani/punani.h>
-#include <punani/punani_gl.h>
 #include <punani/renderer.h>
 #include <punani/light.h>
 #include <punani/vec.h>
 #include <punani/map.h>
 #include <punani/entity.h>
 #include <punani/asset.h>
+#include <punani/job.h>
 #include "ent-internal.h"
 
-static LIST_HEAD(ents);
-static LIST_HEAD(projectiles);
-static LIST_HEAD(helis);
+struct entity_store entities;
 
-void entity_link(entity_t ent)
+/* handles index in to this table, which maps them to a store index and
+ * catches stale handles by generation. Free slots are chained through
+ * sl_idx.
+*/
+#define ENT_SLOT_BITS	20
+#define ENT_SLOT_MASK	((1U << ENT_SLOT_BITS) - 1)
+#define ENT_GEN_MASK	(~0U >> ENT_SLOT_BITS)
+
+struct ent_slot {
+	unsigned int sl_idx;
+	unsigned int sl_gen;
+};
+
+static struct ent_slot *slots;
+static unsigned int num_slots, max_slots, free_slot = ENT_IDX_NONE;
+
+/* unlinks during a pass over the store are only marked dead, and get
+ * compacted out once the pass is over
+*/
+static int in_pass;
+
+/* projectiles moved this tick, collided against the map in one batch */
+static struct _entity **proj;
+static struct map_line *proj_lines;
+static struct map_line_hit *proj_hits;
+static unsigned int num_proj, max_proj;
+
+/* Heli map hits found by the parallel collide pass. Each worker queues
+ * them in its own buffer, and since workers claim chunks in increasing
+ * order each buffer is sorted by store index. Merging them replays the
+ * callbacks in store order, the same as the serial pass.
+*/
+struct ent_cmd {
+	unsigned int idx;
+};
+
+struct ent_cmdbuf {
+	struct ent_cmd *cmd;
+	unsigned int num, max, pos;
+};
+
+static struct ent_cmdbuf *cmdbufs;
+static unsigned int num_cmdbufs;
+
+/* Entity vs. entity broadphase, sweep and prune along x over the
+ * swept bounds of each entity. Boxes are kept in last tick's order so
+ * the insertion sort only has to fix up what moved past a neighbour.
+*/
+struct sap_box {
+	entity_handle_t h;
+	unsigned int idx;
+	vec3_t mins;
+	vec3_t maxs;
+};
+
+static struct sap_box *sap;
+static unsigned int num_sap, max_sap;
+static uint8_t *sap_seen;
+static unsigned int max_seen;
+
+/* entities per job, smaller stores are done serially */
+#define ENT_JOB_CHUNK	64
+
+static int grow(void *ptr, size_t size, unsigned int max)
 {
-	list_add_tail(&ent->e_list, &ents);
-	switch(ent->e_ops->e_flags & ENT_TYPE_MASK) {
-	case ENT_PROJECTILE:
-		list_add_tail(&ent->e_group, &projectiles);
-		break;
-	case ENT_HELI:
-		list_add_tail(&ent->e_group, &helis);
-		break;
-	default:
-		abort();
-		break;
+	void **p = ptr, *new;
+
+	new = realloc(*p, size * max);
+	if ( NULL == new )
+		return 0;
+
+	*p = new;
+	return 1;
+}
+
+static int store_grow(struct entity_store *st)
+{
+	unsigned int max;
+
+	max = (st->s_max) ? st->s_max * 2 : 64;
+	if ( max > ENT_SLOT_MASK )
+		return 0;
+
+	/* arrays already grown just have some slack until next time */
+	if ( !grow(&st->s_owner, sizeof(*st->s_owner), max) ||
+			!grow(&st->s_type, sizeof(*st->s_type), max) ||
+			!grow(&st->s_dead, sizeof(*st->s_dead), max) ||
+			!grow(&st->s_origin, sizeof(*st->s_origin), max) ||
+			!grow(&st->s_move, sizeof(*st->s_move), max) ||
+			!grow(&st->s_angles, sizeof(*st->s_angles), max) ||
+			!grow(&st->s_oldorigin, sizeof(*st->s_oldorigin), max) ||
+			!grow(&st->s_oldangles, sizeof(*st->s_oldangles), max) )
+		return 0;
+
+	st->s_max = max;
+	return 1;
+}
+
+static int slot_alloc(unsigned int idx)
+{
+	unsigned int i;
+
+	if ( free_slot == ENT_IDX_NONE ) {
+		if ( num_slots >= max_slots ) {
+			unsigned int max;
+
+			max = (max_slots) ? max_slots * 2 : 64;
+			if ( max > ENT_SLOT_MASK + 1 ||
+					!grow(&slots, sizeof(*slots), max) )
+				return -1;
+			max_slots = max;
+		}
+		i = num_slots++;
+		slots[i].sl_gen = 1;
+	}else{
+		i = free_slot;
+		free_slot = slots[i].sl_idx;
+	}
+
+	slots[i].sl_idx = idx;
+	return i;
+}
+
+/* bump the generation straight away so that handles to the entity stop
+ * resolving as soon as it's gone, zero is never a valid handle
+*/
+static void slot_free(entity_handle_t h)
+{
+	unsigned int i = h & ENT_SLOT_MASK;
+
+	slots[i].sl_gen = (slots[i].sl_gen + 1) & ENT_GEN_MASK;
+	if ( !slots[i].sl_gen )
+		slots[i].sl_gen = 1;
+	slots[i].sl_idx = free_slot;
+	free_slot = i;
+}
+
+entity_handle_t entity_handle(entity_t ent)
+{
+	return ent->e_handle;
+}
+
+entity_t entity_get(entity_handle_t h)
+{
+	unsigned int i = h & ENT_SLOT_MASK;
+	struct _entity *ent;
+
+	if ( i >= num_slots || slots[i].sl_gen != (h >> ENT_SLOT_BITS) )
+		return NULL;
+
+	ent = entities.s_owner[slots[i].sl_idx];
+	if ( !entity_linked(ent) )
+		return NULL;
+
+	return ent;
+}
+
+/* move the last entity in to the hole left by idx */
+static void store_remove(unsigned int idx)
+{
+	struct entity_store *st = &entities;
+	struct _entity *ent = st->s_owner[idx];
+	unsigned int last = --st->s_num;
+
+	slot_free(ent->e_handle);
+	ent->e_idx = ENT_IDX_NONE;
+	ent->e_handle = 0;
+
+	if ( idx != last ) {
+		struct _entity *moved = st->s_owner[last];
+
+		st->s_owner[idx] = moved;
+		st->s_type[idx] = st->s_type[last];
+		st->s_dead[idx] = st->s_dead[last];
+		v_copy(st->s_origin[idx], st->s_origin[last]);
+		v_copy(st->s_move[idx], st->s_move[last]);
+		v_copy(st->s_angles[idx], st->s_angles[last]);
+		v_copy(st->s_oldorigin[idx], st->s_oldorigin[last]);
+		v_copy(st->s_oldangles[idx], st->s_oldangles[last]);
+
+		moved->e_idx = idx;
+		slots[moved->e_handle & ENT_SLOT_MASK].sl_idx = idx;
 	}
-	ent->e_ref++;
+
+	entity_unref(ent);
+}
+
+/* drop everything unlinked during the last pass */
+static void store_compact(void)
+{
+	unsigned int i = 0;
+
+	while(i < entities.s_num) {
+		if ( entities.s_dead[i] )
+			store_remove(i);
+		else
+			i++;
+	}
+}
+
+void entity_link(entity_t ent)
+{
+	entities.s_dead[ent->e_idx] = 0;
 }
 
 void entity_unref(entity_t ent)
@@ -43,27 +229,57 @@ void entity_unref(entity_t ent)
 
 void entity_unlink(struct _entity *ent)
 {
-	list_del(&ent->e_list);
-	list_del(&ent->e_group);
-	entity_unref(ent);
+	if ( !entity_linked(ent) )
+		return;
+
+	entities.s_dead[ent->e_idx] = 1;
+	if ( !in_pass )
+		store_remove(ent->e_idx);
 }
 
-void entity_spawn(struct _entity *ent, const struct entity_ops *ops,
+/* Takes a slot in the store, which holds a reference, the entity stays
+ * inert until entity_link(). Fails if memory is exhausted.
+*/
+int entity_spawn(struct _entity *ent, const struct entity_ops *ops,
 			const vec3_t origin, const vec3_t move,
 			const vec3_t angles)
 {
+	struct entity_store *st = &entities;
+	unsigned int idx;
+	int slot;
+
+	if ( st->s_num >= st->s_max && !store_grow(st) )
+		return 0;
+
+	idx = st->s_num;
+	slot = slot_alloc(idx);
+	if ( slot < 0 )
+		return 0;
+
+	st->s_num++;
+
 	memset(ent, 0, sizeof(*ent));
 	ent->e_ops = ops;
-	v_copy(ent->e_origin, origin);
-	v_copy(ent->e_lerp, origin);
-	v_copy(ent->e_oldorigin, origin);
-	v_copy(ent->e_oldlerp, origin);
+	ent->e_idx = idx;
+	ent->e_handle = (slots[slot].sl_gen << ENT_SLOT_BITS) | slot;
+	ent->e_ref = 1;
+
+	st->s_owner[idx] = ent;
+	st->s_type[idx] = ops->e_flags & ENT_TYPE_MASK;
+	st->s_dead[idx] = 1;
+	v_copy(st->s_origin[idx], origin);
+	v_copy(st->s_oldorigin[idx], origin);
+	v_zero(st->s_move[idx]);
+	v_zero(st->s_angles[idx]);
+	v_zero(st->s_oldangles[idx]);
 	if ( move )
-		v_copy(ent->e_move, move);
+		v_copy(st->s_move[idx], move);
 	if ( angles ) {
-		v_copy(ent->e_angles, angles);
-		v_copy(ent->e_oldangles, angles);
+		v_copy(st->s_angles[idx], angles);
+		v_copy(st->s_oldangles[idx], angles);
 	}
+
+	return 1;
 }
 
 static void collide_projectile(struct _entity *ent, map_t map)
@@ -71,12 +287,66 @@ static void collide_projectile(struct _entity *ent, map_t map)
 	vec3_t hit;
 
 	if ( ent->e_ops->e_collide_world &&
-		map_collide_line(map, ent->e_oldorigin,
-			ent->e_origin, hit) ) {
+		map_collide_line(map, entity_oldorigin(ent),
+			entity_origin(ent), hit) ) {
 		(*ent->e_ops->e_collide_world)(ent, hit);
 	}
 }
 
+static int proj_add(struct _entity *ent)
+{
+	if ( num_proj >= max_proj ) {
+		unsigned int max;
+		void *new;
+
+		max = (max_proj) ? max_proj * 2 : 64;
+
+		new = realloc(proj, max * sizeof(*proj));
+		if ( NULL == new )
+			return 0;
+		proj = new;
+
+		new = realloc(proj_lines, max * sizeof(*proj_lines));
+		if ( NULL == new )
+			return 0;
+		proj_lines = new;
+
+		new = realloc(proj_hits, max * sizeof(*proj_hits));
+		if ( NULL == new )
+			return 0;
+		proj_hits = new;
+
+		max_proj = max;
+	}
+
+	/* hold a ref until the batch is done with it */
+	entity_ref(ent);
+	proj[num_proj] = ent;
+	v_copy(proj_lines[num_proj].a, entity_oldorigin(ent));
+	v_copy(proj_lines[num_proj].b, entity_origin(ent));
+	num_proj++;
+	return 1;
+}
+
+static void collide_projectiles(map_t map)
+{
+	unsigned int i;
+
+	map_collide_lines(map, proj_lines, num_proj, proj_hits);
+
+	for(i = 0; i < num_proj; i++) {
+		struct _entity *ent = proj[i];
+
+		/* something else may have removed it in the meantime */
+		if ( proj_hits[i].collided && entity_linked(ent) )
+			(*ent->e_ops->e_collide_world)(ent, proj_hits[i].hit);
+
+		entity_unref(ent);
+	}
+
+	num_proj = 0;
+}
+
 struct shim {
 	float time;
 	int hit;
@@ -108,266 +378,437 @@ static int cb(const struct map_hit *hit, void *priv)
 	return 1;
 }
 
-static void collide_heli(struct _entity *ent, map_t map)
+float entity_radius(struct _entity *ent)
+{
+	unsigned int i, num_mesh;
+	float ret = 0.0;
+
+	num_mesh = (*ent->e_ops->e_num_meshes)(ent);
+	for(i = 0; i < num_mesh; i++) {
+		asset_t a;
+
+		a = (*ent->e_ops->e_mesh)(ent, i);
+		ret = f_max(ret, asset_radius(a));
+	}
+
+	return ret;
+}
+
+/* world units left between a heli and whatever it ran in to, so that
+ * it is not already touching at the start of the next sweep
+*/
+#define COLLIDE_SKIN 0.05
+
+/* returns true, with the heli backed out, if it ran in to the map */
+static int collide_heli(struct _entity *ent, map_t map)
 {
 	unsigned int i, num_mesh;
 	struct shim shim;
-	vec3_t mins, maxs;
+	vec3_t mins, maxs, fixup;
+	float *move, len, time;
 
+	shim.hit = 0;
+	shim.time = 1.0;
+
+	/* earliest time of impact over all of the meshes */
 	num_mesh = (*ent->e_ops->e_num_meshes)(ent);
-	ent->collide = 0;
 	for(i = 0; i < num_mesh; i++) {
 		struct obb obb;
+		vec3_t centre;
 		asset_t a;
 
 		a = (*ent->e_ops->e_mesh)(ent, i);
-		shim.hit = 0;
-		shim.time = 1.0;
 
 		asset_mins(a, mins);
 		asset_maxs(a, maxs);
 		obb_from_aabb(&obb, mins, maxs);
 #if 1
-		basis_rotateY(obb.rot, ent->e_angles[1]);
-		basis_rotateX(obb.rot, ent->e_angles[0]);
-		basis_rotateZ(obb.rot, ent->e_angles[2]);
+		basis_rotateY(obb.rot, entity_angles(ent)[1]);
+		basis_rotateX(obb.rot, entity_angles(ent)[0]);
+		basis_rotateZ(obb.rot, entity_angles(ent)[2]);
 #endif
-		//v_add(obb.origin, obb.origin, ent->e_origin);
-		v_copy(obb.origin, ent->e_oldorigin);
-		v_copy(obb.vel, ent->e_move);
+		/* mesh centre is in model space */
+		basis_transform((const float (*)[3])obb.rot, centre,
+				obb.origin);
+		v_add(obb.origin, entity_oldorigin(ent), centre);
+		v_copy(obb.vel, entity_move(ent));
 
 		map_sweep(map, &obb, cb, &shim);
-		if ( shim.hit ) {
-			vec3_t fixup;
+	}
 
-			v_copy(fixup, ent->e_move);
-			v_scale(fixup, 1.0 - shim.time);
-			v_sub(ent->e_origin, ent->e_origin, fixup);
+	ent->collide = 0;
+	if ( !shim.hit )
+		return 0;
 
-			v_sub(fixup, ent->e_angles, ent->e_oldangles);
-			v_scale(fixup, 1.0 - shim.time);
-			v_sub(ent->e_angles, ent->e_angles, fixup);
+	/* back out to just short of the time of impact */
+	move = entity_move(ent);
+	time = shim.time;
+	len = v_len(move);
+	if ( len > 0.0 )
+		time = f_max(0.0, time - COLLIDE_SKIN / len);
 
-			(*ent->e_ops->e_collide_world)(ent, NULL);
-			ent->collide = 1;
+	v_copy(fixup, move);
+	v_scale(fixup, 1.0 - time);
+	v_sub(entity_origin(ent), entity_origin(ent), fixup);
+
+	v_sub(fixup, entity_angles(ent), entity_oldangles(ent));
+	v_scale(fixup, 1.0 - time);
+	v_sub(entity_angles(ent), entity_angles(ent), fixup);
+
+	ent->collide = 1;
+	return 1;
+}
+
+static int heli_collides(unsigned int idx)
+{
+	struct entity_store *st = &entities;
+
+	return !st->s_dead[idx] && st->s_type[idx] == ENT_HELI &&
+		st->s_owner[idx]->e_ops->e_collide_world;
+}
+
+/* make sure no worker can run out of command buffer during a pass */
+static int cmd_prepare(unsigned int num)
+{
+	unsigned int i, nr = job_num_workers();
+
+	if ( nr < 2 || num <= ENT_JOB_CHUNK )
+		return 0;
+
+	if ( num_cmdbufs < nr ) {
+		if ( !grow(&cmdbufs, sizeof(*cmdbufs), nr) )
+			return 0;
+		memset(cmdbufs + num_cmdbufs, 0,
+			(nr - num_cmdbufs) * sizeof(*cmdbufs));
+		num_cmdbufs = nr;
+	}
+
+	for(i = 0; i < nr; i++) {
+		struct ent_cmdbuf *buf = cmdbufs + i;
+
+		if ( buf->max < num ) {
+			if ( !grow(&buf->cmd, sizeof(*buf->cmd), num) )
+				return 0;
+			buf->max = num;
 		}
+		buf->num = buf->pos = 0;
 	}
+
+	return 1;
 }
 
-static void entity_think(struct _entity *ent, map_t map)
+static void cmd_apply(void)
 {
-	v_copy(ent->e_oldorigin, ent->e_origin);
-	v_copy(ent->e_oldangles, ent->e_angles);
-
-	if ( ent->e_ops->e_think )
-		(*ent->e_ops->e_think)(ent);
+	struct entity_store *st = &entities;
+
+	for(;;) {
+		struct ent_cmdbuf *min = NULL;
+		struct ent_cmd *cmd;
+		unsigned int i;
+
+		for(i = 0; i < num_cmdbufs; i++) {
+			struct ent_cmdbuf *buf = cmdbufs + i;
+			if ( buf->pos >= buf->num )
+				continue;
+			if ( NULL == min ||
+				buf->cmd[buf->pos].idx < min->cmd[min->pos].idx )
+				min = buf;
+		}
 
-	v_add(ent->e_origin, ent->e_origin, ent->e_move);
+		if ( NULL == min )
+			break;
 
-	switch(ent->e_ops->e_flags & ENT_TYPE_MASK) {
-	case ENT_PROJECTILE:
-		collide_projectile(ent, map);
-		break;
-	case ENT_HELI:
-		collide_heli(ent, map);
-		break;
-	default:
-		break;
+		cmd = &min->cmd[min->pos++];
+		if ( !st->s_dead[cmd->idx] ) {
+			struct _entity *ent = st->s_owner[cmd->idx];
+			(*ent->e_ops->e_collide_world)(ent, NULL);
+		}
 	}
 }
 
-void entity_think_all(map_t map)
+static void integrate_job(void *priv, unsigned int begin,
+				unsigned int end, unsigned int worker)
 {
-	entity_t ent, tmp;
+	struct entity_store *st = &entities;
+	unsigned int i;
 
-	list_for_each_entry_safe(ent, tmp, &ents, e_list) {
-		entity_think(ent, map);
+	for(i = begin; i < end; i++) {
+		if ( !st->s_dead[i] )
+			v_add(st->s_origin[i], st->s_origin[i], st->s_move[i]);
 	}
 }
 
-static void obb_vert(struct obb *obb, float x, float y, float z)
+/* only reads the map and writes to the heli being collided, anything
+ * else has to go through the command buffer
+*/
+static void collide_job(void *priv, unsigned int begin,
+				unsigned int end, unsigned int worker)
 {
-	vec3_t vec, tmp = {x, y, z};
-	basis_transform((const float (*)[3])obb->rot, vec, tmp);
-	glVertex3f(vec[0], vec[1], vec[2]);
+	struct entity_store *st = &entities;
+	struct ent_cmdbuf *buf = cmdbufs + worker;
+	map_t map = priv;
+	unsigned int i;
+
+	for(i = begin; i < end; i++) {
+		if ( heli_collides(i) && collide_heli(st->s_owner[i], map) )
+			buf->cmd[buf->num++].idx = i;
+	}
 }
 
-static void draw_obb(struct _entity *ent, renderer_t r, vec3_t angles)
+static void sap_bounds(struct sap_box *b)
 {
-	unsigned int i, num_mesh;
-	vec3_t mins, maxs;
-	struct obb obb;
+	struct _entity *ent = entities.s_owner[b->idx];
+	const float *a = entities.s_oldorigin[b->idx];
+	const float *o = entities.s_origin[b->idx];
+	unsigned int i;
+	float r = 0.0;
+
+	if ( ent->e_ops->e_num_meshes )
+		r = entity_radius(ent);
+
+	for(i = 0; i < 3; i++) {
+		b->mins[i] = f_min(a[i], o[i]) - r;
+		b->maxs[i] = f_max(a[i], o[i]) + r;
+	}
+}
 
-	renderer_wireframe(r, 1);
-	glEnable(GL_DEPTH_TEST);
+static int sap_update(void)
+{
+	struct entity_store *st = &entities;
+	unsigned int i, j, n;
 
-	num_mesh = (*ent->e_ops->e_num_meshes)(ent);
-	for(i = 0; i < num_mesh; i++) {
-		asset_t a;
+	if ( max_seen < st->s_num ) {
+		if ( !grow(&sap_seen, sizeof(*sap_seen), st->s_max) )
+			return 0;
+		max_seen = st->s_max;
+	}
+	memset(sap_seen, 0, st->s_num);
 
-		a = (*ent->e_ops->e_mesh)(ent, i);
-		asset_mins(a, mins);
-		asset_maxs(a, maxs);
-		obb_from_aabb(&obb, mins, maxs);
+	/* keep survivors from last tick in order, picking up new indices */
+	for(i = n = 0; i < num_sap; i++) {
+		struct _entity *ent = entity_get(sap[i].h);
+		if ( NULL == ent )
+			continue;
+		sap[n].h = sap[i].h;
+		sap[n].idx = ent->e_idx;
+		sap_seen[ent->e_idx] = 1;
+		n++;
+	}
+	num_sap = n;
 
-#if 1
-		basis_rotateZ(obb.rot, -angles[2]);
-		basis_rotateX(obb.rot, -angles[0]);
-		basis_rotateY(obb.rot, angles[1]);
-#endif
-		//obb_build_aabb(&obb, mins, maxs);
+	if ( max_sap < st->s_num ) {
+		if ( !grow(&sap, sizeof(*sap), st->s_max) )
+			return 0;
+		max_sap = st->s_max;
+	}
 
-		continue;
-		if ( ent->collide ) {
-			glColor4f(1.0, 0.0, 0.0, 1.0);
-		}else{
-			glColor4f(0.0, 1.0, 0.0, 1.0);
+	for(i = 0; i < st->s_num; i++) {
+		if ( sap_seen[i] || st->s_dead[i] )
 			continue;
-		}
-		glBegin(GL_QUADS);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] - obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] - obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] + obb.dim[2]);
-		obb_vert(&obb, obb.origin[0] + obb.dim[0],
-				obb.origin[1] + obb.dim[1],
-				obb.origin[2] - obb.dim[2]);
+		sap[num_sap].h = st->s_owner[i]->e_handle;
+		sap[num_sap].idx = i;
+		num_sap++;
+	}
 
-#if 0
-		glColor4f(0.0, 1.0, 0.0, 1.0);
-		glVertex3f(mins[0], mins[1], mins[2]);
-		glVertex3f(maxs[0], mins[1], mins[2]);
-		glVertex3f(maxs[0], maxs[1], mins[2]);
-		glVertex3f(mins[0], maxs[1], mins[2]);
-
-		glVertex3f(mins[0], mins[1], mins[2]);
-		glVertex3f(mins[0], mins[1], maxs[2]);
-		glVertex3f(mins[0], maxs[1], maxs[2]);
-		glVertex3f(mins[0], maxs[1], mins[2]);
-
-		glVertex3f(mins[0], mins[1], maxs[2]);
-		glVertex3f(maxs[0], mins[1], maxs[2]);
-		glVertex3f(maxs[0], maxs[1], maxs[2]);
-		glVertex3f(mins[0], maxs[1], maxs[2]);
-
-		glVertex3f(maxs[0], mins[1], mins[2]);
-		glVertex3f(maxs[0], mins[1], maxs[2]);
-		glVertex3f(maxs[0], maxs[1], maxs[2]);
-		glVertex3f(maxs[0], maxs[1], mins[2]);
-#endif
-		glEnd();
+	for(i = 0; i < num_sap; i++)
+		sap_bounds(&sap[i]);
+
+	for(i = 1; i < num_sap; i++) {
+		struct sap_box tmp = sap[i];
+
+		for(j = i; j && sap[j - 1].mins[0] > tmp.mins[0]; j--)
+			sap[j] = sap[j - 1];
+		sap[j] = tmp;
 	}
 
-	renderer_wireframe(r, 0);
+	return 1;
 }
 
-void entity_render(struct _entity *ent, renderer_t r, float lerp, light_t l)
+/* a missile doesn't hit whoever launched it, or anything else they did */
+static int sap_ignore(struct _entity *a, struct _entity *b)
 {
-	vec3_t a;
+	if ( NULL == a->e_ops->e_collide_entity &&
+			NULL == b->e_ops->e_collide_entity )
+		return 1;
+	if ( a->e_owner && a->e_owner == b->e_handle )
+		return 1;
+	if ( b->e_owner && b->e_owner == a->e_handle )
+		return 1;
+	if ( a->e_owner && a->e_owner == b->e_owner )
+		return 1;
+	return 0;
+}
 
-	if ( NULL == ent->e_ops->e_render )
+static void sap_pair(struct _entity *a, struct _entity *b)
+{
+	if ( a->e_ops->e_collide_entity )
+		(*a->e_ops->e_collide_entity)(a, b);
+	if ( b->e_ops->e_collide_entity && entity_linked(b) )
+		(*b->e_ops->e_collide_entity)(b, a);
+}
+
+/* only runs during a pass, so callbacks which unlink don't disturb the
+ * store indices
+*/
+static void collide_entities(void)
+{
+	struct entity_store *st = &entities;
+	unsigned int i, j;
+
+	if ( !sap_update() )
 		return;
 
-	v_copy(ent->e_oldlerp, ent->e_lerp);
-	ent->e_lerp[0] = ent->e_oldorigin[0] + ent->e_move[0] * lerp;
-	ent->e_lerp[1] = ent->e_oldorigin[1] + ent->e_move[1] * lerp;
-	ent->e_lerp[2] = ent->e_oldorigin[2] + ent->e_move[2] * lerp;
-
-	v_sub(a, ent->e_angles, ent->e_oldangles);
-	v_scale(a, lerp);
-	v_add(a, a, ent->e_oldangles);
-
-	glPushMatrix();
-	renderer_translate(r, ent->e_lerp[0], ent->e_lerp[1], ent->e_lerp[2]);
-	renderer_rotate(r, a[1] * (180.0 / M_PI), 0, 1, 0);
-	renderer_rotate(r, a[0] * (180.0 / M_PI), 1, 0, 0);
-	renderer_rotate(r, a[2] * (180.0 / M_PI), 0, 0, 1);
-	(*ent->e_ops->e_render)(ent, r, lerp, l);
-	glPopMatrix();
-
-	glPushMatrix();
-	if ( (ent->e_ops->e_flags & ENT_TYPE_MASK) == ENT_HELI ) {
-		renderer_translate(r, ent->e_lerp[0], ent->e_lerp[1], ent->e_lerp[2]);
-		draw_obb(ent, r, a);
+	for(i = 0; i < num_sap; i++) {
+		const struct sap_box *a = &sap[i];
+
+		for(j = i + 1; j < num_sap; j++) {
+			const struct sap_box *b = &sap[j];
+			struct _entity *ea, *eb;
+
+			if ( b->mins[0] > a->maxs[0] )
+				break;
+
+			if ( b->mins[1] > a->maxs[1] ||
+					b->maxs[1] < a->mins[1] ||
+					b->mins[2] > a->maxs[2] ||
+					b->maxs[2] < a->mins[2] )
+				continue;
+
+			/* one of them may have been unlinked by now */
+			if ( st->s_dead[a->idx] )
+				break;
+			if ( st->s_dead[b->idx] )
+				continue;
+
+			ea = st->s_owner[a->idx];
+			eb = st->s_owner[b->idx];
+			if ( !sap_ignore(ea, eb) )
+				sap_pair(ea, eb);
+		}
+	}
+}
+
+/* Each stage is a pass over the whole store. Entities spawned during a
+ * tick join in on the next one, and anything unlinked is skipped for
+ * the rest of the tick and then compacted away. The map is locked
+ * against paging for as long as we're colliding with it.
+ *
+ * Collisions happen in the same order whether or not the job system is
+ * used: helis against the map in store order, then entities against
+ * each other, then projectiles against the map in one batch.
+*/
+void entity_think_all(map_t map)
+{
+	struct entity_store *st = &entities;
+	unsigned int i, num = st->s_num;
+
+	in_pass = 1;
+
+	memcpy(st->s_oldorigin, st->s_origin, num * sizeof(*st->s_origin));
+	memcpy(st->s_oldangles, st->s_angles, num * sizeof(*st->s_angles));
+
+	for(i = 0; i < num; i++) {
+		struct _entity *ent = st->s_owner[i];
+		if ( !st->s_dead[i] && ent->e_ops->e_think )
+			(*ent->e_ops->e_think)(ent);
+	}
+
+	map_lock(map);
+	map_sweep_begin(map);
+
+	/* big enough to be worth farming out to the job system */
+	if ( cmd_prepare(num) ) {
+		job_run(num, ENT_JOB_CHUNK, integrate_job, NULL);
+		job_run(num, ENT_JOB_CHUNK, collide_job, map);
+		cmd_apply();
+	}else{
+		integrate_job(NULL, 0, num, 0);
+
+		for(i = 0; i < num; i++) {
+			struct _entity *ent = st->s_owner[i];
+			if ( heli_collides(i) && collide_heli(ent, map) )
+				(*ent->e_ops->e_collide_world)(ent, NULL);
+		}
+	}
+
+	for(i = 0; i < num; i++) {
+		struct _entity *ent = st->s_owner[i];
+
+		if ( st->s_dead[i] || st->s_type[i] != ENT_PROJECTILE ||
+				NULL == ent->e_ops->e_collide_world )
+			continue;
+		if ( !proj_add(ent) )
+			collide_projectile(ent, map);
 	}
-	glPopMatrix();
+
+	collide_entities();
+
+	in_pass = 0;
+	store_compact();
+
+	collide_projectiles(map);
+	map_unlock(map);
+}
+
+entity_snap_t entity_snap_new(void)
+{
+	return calloc(1, sizeof(struct _entity_snap));
+}
+
+static void snap_release(struct _entity_snap *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_num; i++)
+		entity_unref(s->s_view[i].v_ent);
+
+	s->s_num = 0;
+	s->s_num_vis = 0;
 }
 
-void entity_render_all(renderer_t r, float lerp, light_t l)
+/* Copy out every entity there is to render. The snapshot holds a
+ * reference to each, dropped the next time it's taken, so whoever
+ * renders it must be done with it by then.
+*/
+void entity_snap(entity_snap_t s)
 {
-	entity_t ent, tmp;
+	struct entity_store *st = &entities;
+	unsigned int i;
+
+	snap_release(s);
+
+	if ( st->s_num > s->s_max ) {
+		if ( !grow(&s->s_view, sizeof(*s->s_view), st->s_max) ||
+				!grow(&s->s_vis, sizeof(*s->s_vis), st->s_max) )
+			return;
+		s->s_max = st->s_max;
+	}
+
+	for(i = 0; i < st->s_num; i++) {
+		struct _entity *ent = st->s_owner[i];
+		struct ent_view *v;
 
-	list_for_each_entry_safe(ent, tmp, &ents, e_list) {
-		entity_render(ent, r, lerp, l);
+		if ( st->s_dead[i] || NULL == ent->e_ops->e_render )
+			continue;
+
+		v = &s->s_view[s->s_num++];
+		entity_ref(ent);
+		v->v_ent = ent;
+		v_copy(v->v_oldorigin, st->s_oldorigin[i]);
+		v_copy(v->v_move, st->s_move[i]);
+		v_copy(v->v_oldangles, st->s_oldangles[i]);
+		v_copy(v->v_angles, st->s_angles[i]);
+		v->v_radius = (ent->e_ops->e_num_meshes) ?
+				entity_radius(ent) : 0.0;
+	}
+}
+
+void entity_snap_free(entity_snap_t s)
+{
+	if ( s ) {
+		snap_release(s);
+		free(s->s_view);
+		free(s->s_vis);
+		free(s);
 	}
 }
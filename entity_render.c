@@ -0,0 +1,223 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/punani_gl.h>
+#include <punani/renderer.h>
+#include <punani/light.h>
+#include <punani/vec.h>
+#include <punani/map.h>
+#include <punani/entity.h>
+#include <punani/asset.h>
+#include "ent-internal.h"
+
+static void obb_vert(struct obb *obb, float x, float y, float z)
+{
+	vec3_t vec, tmp = {x, y, z};
+	basis_transform((const float (*)[3])obb->rot, vec, tmp);
+	glVertex3f(vec[0], vec[1], vec[2]);
+}
+
+static void draw_obb(struct _entity *ent, renderer_t r, vec3_t angles)
+{
+	unsigned int i, num_mesh;
+	vec3_t mins, maxs;
+	struct obb obb;
+
+	renderer_wireframe(r, 1);
+	glEnable(GL_DEPTH_TEST);
+
+	num_mesh = (*ent->e_ops->e_num_meshes)(ent);
+	for(i = 0; i < num_mesh; i++) {
+		asset_t a;
+
+		a = (*ent->e_ops->e_mesh)(ent, i);
+		asset_mins(a, mins);
+		asset_maxs(a, maxs);
+		obb_from_aabb(&obb, mins, maxs);
+
+#if 1
+		basis_rotateZ(obb.rot, -angles[2]);
+		basis_rotateX(obb.rot, -angles[0]);
+		basis_rotateY(obb.rot, angles[1]);
+#endif
+		//obb_build_aabb(&obb, mins, maxs);
+
+		continue;
+		if ( ent->collide ) {
+			glColor4f(1.0, 0.0, 0.0, 1.0);
+		}else{
+			glColor4f(0.0, 1.0, 0.0, 1.0);
+			continue;
+		}
+		glBegin(GL_QUADS);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] - obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] - obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] + obb.dim[2]);
+		obb_vert(&obb, obb.origin[0] + obb.dim[0],
+				obb.origin[1] + obb.dim[1],
+				obb.origin[2] - obb.dim[2]);
+
+#if 0
+		glColor4f(0.0, 1.0, 0.0, 1.0);
+		glVertex3f(mins[0], mins[1], mins[2]);
+		glVertex3f(maxs[0], mins[1], mins[2]);
+		glVertex3f(maxs[0], maxs[1], mins[2]);
+		glVertex3f(mins[0], maxs[1], mins[2]);
+
+		glVertex3f(mins[0], mins[1], mins[2]);
+		glVertex3f(mins[0], mins[1], maxs[2]);
+		glVertex3f(mins[0], maxs[1], maxs[2]);
+		glVertex3f(mins[0], maxs[1], mins[2]);
+
+		glVertex3f(mins[0], mins[1], maxs[2]);
+		glVertex3f(maxs[0], mins[1], maxs[2]);
+		glVertex3f(maxs[0], maxs[1], maxs[2]);
+		glVertex3f(mins[0], maxs[1], maxs[2]);
+
+		glVertex3f(maxs[0], mins[1], mins[2]);
+		glVertex3f(maxs[0], mins[1], maxs[2]);
+		glVertex3f(maxs[0], maxs[1], maxs[2]);
+		glVertex3f(maxs[0], maxs[1], mins[2]);
+#endif
+		glEnd();
+	}
+
+	renderer_wireframe(r, 0);
+}
+
+
+/* interpolate every entity and build the list of visible ones, must be
+ * called after map_cull() and before any entity_render_all() in a frame
+*/
+void entity_cull_all(entity_snap_t s, map_t map, float lerp)
+{
+	unsigned int i;
+
+	s->s_num_vis = 0;
+
+	for(i = 0; i < s->s_num; i++) {
+		struct ent_view *v = &s->s_view[i];
+		float *out = v->v_lerp, *a = v->v_lerpangles;
+
+		out[0] = v->v_oldorigin[0] + v->v_move[0] * lerp;
+		out[1] = v->v_oldorigin[1] + v->v_move[1] * lerp;
+		out[2] = v->v_oldorigin[2] + v->v_move[2] * lerp;
+
+		v_sub(a, v->v_angles, v->v_oldangles);
+		v_scale(a, lerp);
+		v_add(a, a, v->v_oldangles);
+
+		/* things without a mesh (eg. projectile trails) have no
+		 * bounds so we can't cull them
+		*/
+		if ( v->v_ent->e_ops->e_num_meshes &&
+			!map_sphere_visible(map, v->v_lerp, v->v_radius) )
+			continue;
+
+		s->s_vis[s->s_num_vis++] = i;
+	}
+}
+
+static void entity_render(struct ent_view *v, renderer_t r,
+				float lerp, light_t l)
+{
+	struct _entity *ent = v->v_ent;
+	float *a = v->v_lerpangles;
+	float *pos = v->v_lerp;
+
+	renderer_push_matrix(r);
+	renderer_translate(r, pos[0], pos[1], pos[2]);
+	renderer_rotate(r, a[1] * (180.0 / M_PI), 0, 1, 0);
+	renderer_rotate(r, a[0] * (180.0 / M_PI), 1, 0, 0);
+	renderer_rotate(r, a[2] * (180.0 / M_PI), 0, 0, 1);
+	(*ent->e_ops->e_render)(ent, r, lerp, l);
+	renderer_pop_matrix(r);
+
+	renderer_push_matrix(r);
+	if ( (ent->e_ops->e_flags & ENT_TYPE_MASK) == ENT_HELI ) {
+		renderer_translate(r, pos[0], pos[1], pos[2]);
+		draw_obb(ent, r, a);
+	}
+	renderer_pop_matrix(r);
+}
+
+void entity_render_all(entity_snap_t s, renderer_t r, float lerp, light_t l)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_num_vis; i++)
+		entity_render(&s->s_view[s->s_vis[i]], r, lerp, l);
+}
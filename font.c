@@ -8,6 +8,7 @@
 #include <punani/punani_gl.h>
 #include <punani/tex.h>
 #include <punani/font.h>
+#include <punani/arena.h>
 
 #include <stdarg.h>
 
@@ -87,14 +88,28 @@ void font_print(font_t f, unsigned int x, unsigned int y, const char *str)
 	glPopMatrix();
 }
 
+/* the string goes in the frame arena if we're rendering a frame */
 void font_printf(font_t f, unsigned int x, unsigned int y, const char *fmt, ...)
 {
 	static char *abuf;
 	static size_t abuflen;
+	char *buf;
 	int len;
 	va_list va;
 	char *new;
 
+	va_start(va, fmt);
+	len = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+
+	if ( len >= 0 && (buf = frame_alloc(len + 1, 1)) ) {
+		va_start(va, fmt);
+		vsnprintf(buf, len + 1, fmt, va);
+		va_end(va);
+		font_print(f, x, y, buf);
+		return;
+	}
+
 again:
 	va_start(va, fmt);
 
@@ -15,9 +15,17 @@ struct game_ops {
 	void *(*ctor)(renderer_t r, void *priv);
 	void (*dtor)(void *);
 
-	/* time */
+	/* time, snap is NULL unless the mode has the snapshot hooks below */
 	void (*new_frame)(void *);
-	void (*render)(void *, float lerp);
+	void (*render)(void *, void *snap, float lerp);
+
+	/* Optional. A mode which can copy out everything render needs after
+	 * a tick may have new_frame and the input hooks called on another
+	 * thread to render. snapshot() is called right after new_frame.
+	*/
+	void *(*snap_new)(void *);
+	void (*snap_free)(void *, void *snap);
+	void (*snapshot)(void *, void *snap);
 
 	/* input */
 	void (*grabbed)(void *);
@@ -8,11 +8,36 @@
 #include <punani/tex.h>
 #include <punani/console.h>
 #include <punani/cvar.h>
-
+#include <punani/job.h>
+#include <punani/tribuf.h>
+#include <punani/arena.h>
+#include <pthread.h>
 
 #include "game-modes.h"
 #include "render-internal.h"
 
+/* input held for the simulation thread */
+#define GAME_EV_KEY	0
+#define GAME_EV_BUTTON	1
+#define GAME_EV_MOTION	2
+#define GAME_EV_GRABBED	3
+
+/* per-frame scratch space, grows if it's ever not enough */
+#define GAME_ARENA_SIZE	(64U << 10)
+
+struct game_ev {
+	unsigned int e_type;
+	int e_a;
+	int e_b;
+	int e_xrel;
+	int e_yrel;
+};
+
+struct game_snap {
+	void *s_snap;
+	uint64_t s_time; /* of the tick it was taken after */
+};
+
 struct _game {
 	renderer_t g_render;
 	void *g_priv;
@@ -24,31 +49,110 @@ struct _game {
 	void *g_common;
 	texture_t con_back;
 	font_t con_font;
+
+	/* snapshots, if the mode has them */
+	struct game_snap g_snap[3];
+	tribuf_t g_snaps;
+	uint64_t g_tick_time;
+
+	/* one each for the simulation and render threads, snapshots can
+	 * be held on to for any number of ticks so mustn't point in to
+	 * the tick arena
+	*/
+	arena_t g_tick_arena;
+	arena_t g_render_arena;
+
+	/* simulation thread, the game lock is held for the length of a tick
+	 * so input and mode exits go through their own lock, g_ev_run is
+	 * only touched by whoever is ticking.
+	*/
+	pthread_mutex_t g_lock;
+	pthread_mutex_t g_ev_lock;
+	struct game_ev *g_ev;
+	struct game_ev *g_ev_run;
+	unsigned int g_num_ev;
+	unsigned int g_max_ev;
+	unsigned int g_max_ev_run;
+	int g_threaded;
+	int g_exit_pending;
+	int g_exit_code;
 };
 
+static void snaps_free(struct _game *g)
+{
+	unsigned int i;
+
+	if ( NULL == g->g_snaps )
+		return;
+
+	for(i = 0; i < 3; i++) {
+		(*g->g_ops->snap_free)(g->g_priv, g->g_snap[i].s_snap);
+		g->g_snap[i].s_snap = NULL;
+	}
+
+	tribuf_free(g->g_snaps);
+	g->g_snaps = NULL;
+}
+
+static int snaps_new(struct _game *g, const struct game_ops *ops,
+			void *priv, void **snap, tribuf_t *snaps)
+{
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		snap[i] = (*ops->snap_new)(priv);
+		if ( NULL == snap[i] )
+			goto err;
+	}
+
+	*snaps = tribuf_new(&g->g_snap[0], &g->g_snap[1], &g->g_snap[2]);
+	if ( NULL == *snaps )
+		goto err;
+
+	return 1;
+err:
+	while(i--)
+		(*ops->snap_free)(priv, snap[i]);
+	return 0;
+}
+
 int game_set_state(struct _game *g, unsigned int state)
 {
 	const struct game_ops *ops;
+	void *priv = NULL, *snap[3] = {NULL, NULL, NULL};
+	tribuf_t snaps = NULL;
+	unsigned int i;
+
 	assert(state < g->g_num_modes);
+	assert(!g->g_threaded);
 
 	ops = g->g_modes[state];
 	if ( ops ) {
-		void *priv;
 		priv = (*ops->ctor)(g->g_render, g->g_common);
 		if ( NULL == priv ) {
 			return 0;
 		}
-		if ( g->g_ops && g->g_priv ) {
-			(*g->g_ops->dtor)(g->g_priv);
-		}
-		g->g_priv = priv;
-	}else{
-		if ( g->g_ops && g->g_priv ) {
-			(*g->g_ops->dtor)(g->g_priv);
+		if ( ops->snapshot && !snaps_new(g, ops, priv, snap, &snaps) ) {
+			(*ops->dtor)(priv);
+			return 0;
 		}
-		g->g_priv = NULL;
 	}
 
+	if ( g->g_ops && g->g_priv ) {
+		snaps_free(g);
+		(*g->g_ops->dtor)(g->g_priv);
+	}
+
+	for(i = 0; i < 3; i++) {
+		g->g_snap[i].s_snap = snap[i];
+		g->g_snap[i].s_time = 0;
+	}
+	g->g_snaps = snaps;
+
+	/* anything still queued was meant for the old mode */
+	g->g_num_ev = 0;
+
+	g->g_priv = priv;
 	g->g_ops = ops;
 	g->g_state = state;
 	return 1;
@@ -70,17 +174,34 @@ struct _game *game_new(const struct game_ops * const *modes,
 	g->g_num_modes = num_modes;
 	g->g_efn = efn;
 	g->g_common = priv;
+	pthread_mutex_init(&g->g_lock, NULL);
+	pthread_mutex_init(&g->g_ev_lock, NULL);
+
+	g->g_tick_arena = arena_new("tick", GAME_ARENA_SIZE);
+	if ( NULL == g->g_tick_arena )
+		goto out_free;
+
+	g->g_render_arena = arena_new("render", GAME_ARENA_SIZE);
+	if ( NULL == g->g_render_arena )
+		goto out_free_tick;
 
 	g->g_render = renderer_new(g);
 	if ( NULL == g->g_render )
-		goto out_free;
+		goto out_free_arena;
 
 	con_init();
+	job_init();
 
 	/* success */
 	goto out;
 
+out_free_arena:
+	arena_free(g->g_render_arena);
+out_free_tick:
+	arena_free(g->g_tick_arena);
 out_free:
+	pthread_mutex_destroy(&g->g_ev_lock);
+	pthread_mutex_destroy(&g->g_lock);
 	free(g);
 	g = NULL;
 out:
@@ -114,77 +235,279 @@ void game_exit(game_t g)
 void game_free(game_t g)
 {
 	if ( g ) {
+		job_exit();
 		renderer_free(g->g_render);
 		font_free(g->con_font);
 		texture_put(g->con_back);
 		con_free();
+		arena_free(g->g_render_arena);
+		arena_free(g->g_tick_arena);
+		pthread_mutex_destroy(&g->g_ev_lock);
+		pthread_mutex_destroy(&g->g_lock);
+		free(g->g_ev_run);
+		free(g->g_ev);
 		free(g);
 	}
 }
 
+static void input_dispatch(struct _game *g, const struct game_ev *ev)
+{
+	const struct game_ops *ops = g->g_ops;
+
+	if ( NULL == ops )
+		return;
+
+	switch(ev->e_type) {
+	case GAME_EV_KEY:
+		if ( ops->keypress )
+			(*ops->keypress)(g->g_priv, ev->e_a, ev->e_b);
+		break;
+	case GAME_EV_BUTTON:
+		if ( ops->mousebutton )
+			(*ops->mousebutton)(g->g_priv, ev->e_a, ev->e_b);
+		break;
+	case GAME_EV_MOTION:
+		if ( ops->mousemove )
+			(*ops->mousemove)(g->g_priv, ev->e_a, ev->e_b,
+						ev->e_xrel, ev->e_yrel);
+		break;
+	case GAME_EV_GRABBED:
+		if ( ops->grabbed )
+			(*ops->grabbed)(g->g_priv);
+		break;
+	default:
+		abort();
+	}
+}
+
+static void input_flush(struct _game *g)
+{
+	struct game_ev *ev;
+	unsigned int i, num, max;
+
+	pthread_mutex_lock(&g->g_ev_lock);
+	ev = g->g_ev;
+	num = g->g_num_ev;
+	max = g->g_max_ev;
+	g->g_ev = g->g_ev_run;
+	g->g_max_ev = g->g_max_ev_run;
+	g->g_num_ev = 0;
+	g->g_ev_run = ev;
+	g->g_max_ev_run = max;
+	pthread_mutex_unlock(&g->g_ev_lock);
+
+	for(i = 0; i < num; i++)
+		input_dispatch(g, &ev[i]);
+}
+
+/* straight to the mode, or held for the next tick if that's on the
+ * simulation thread
+*/
+static void input_post(struct _game *g, const struct game_ev *ev)
+{
+	if ( !g->g_threaded ) {
+		input_dispatch(g, ev);
+		return;
+	}
+
+	pthread_mutex_lock(&g->g_ev_lock);
+	if ( g->g_num_ev >= g->g_max_ev ) {
+		struct game_ev *new;
+		unsigned int max;
+
+		max = (g->g_max_ev) ? g->g_max_ev * 2 : 32;
+		new = realloc(g->g_ev, max * sizeof(*new));
+		if ( NULL == new )
+			goto out;
+
+		g->g_ev = new;
+		g->g_max_ev = max;
+	}
+
+	g->g_ev[g->g_num_ev++] = *ev;
+out:
+	pthread_mutex_unlock(&g->g_ev_lock);
+}
+
 /* one tick has elapsed in game time. the game tick interval
  * is clamped to real time so we can increment the emulation
- * as accurately as possible to wall time
+ * as accurately as possible to wall time. time is when the tick
+ * fell due.
 */
-void game_new_frame(game_t g)
+void game_tick(game_t g, uint64_t time)
 {
-	if ( g->g_ops && g->g_ops->new_frame )
+	struct game_snap *s;
+
+	arena_flip(g->g_tick_arena);
+	frame_arena_set(g->g_tick_arena);
+
+	input_flush(g);
+	g->g_tick_time = time;
+
+	if ( NULL == g->g_ops )
+		goto out;
+
+	if ( g->g_ops->new_frame )
 		(*g->g_ops->new_frame)(g->g_priv);
+
+	if ( g->g_snaps ) {
+		s = tribuf_back(g->g_snaps);
+		(*g->g_ops->snapshot)(g->g_priv, s->s_snap);
+		s->s_time = time;
+		tribuf_publish(g->g_snaps);
+	}
+out:
+	frame_arena_set(NULL);
 }
 
-/* lerp is a value clamped between 0 and 1 which indicates how far between
- * game ticks we are. render times may fluctuate but we are called to
- * render as fast as possible
+/* Renders the last tick published, lerp is a value clamped between 0
+ * and 1 which indicates how far between that and the next tick we are.
+ * render times may fluctuate but we are called to render as fast as
+ * possible
 */
-void game_render(game_t g, float lerp)
+void game_render(game_t g, uint64_t now, uint64_t step)
 {
-	if ( g->g_ops && g->g_ops->render )
-		(*g->g_ops->render)(g->g_priv, lerp);
+	struct game_snap *s = NULL;
+	uint64_t time = g->g_tick_time;
+	float lerp;
+
+	arena_flip(g->g_render_arena);
+	frame_arena_set(g->g_render_arena);
 
+	if ( g->g_snaps ) {
+		s = tribuf_front(g->g_snaps);
+		if ( NULL == s )
+			goto out;
+		time = s->s_time;
+	}
+
+	lerp = (now > time) ? (float)(now - time) / (float)step : 0.0;
+	if ( lerp > 1.0 )
+		lerp = 1.0;
+
+	if ( g->g_ops && g->g_ops->render )
+		(*g->g_ops->render)(g->g_priv, (s) ? s->s_snap : NULL, lerp);
+out:
 	con_render(g->g_render);
+	frame_arena_set(NULL);
+}
+
+int game_can_thread(game_t g)
+{
+	return NULL != g->g_snaps;
+}
+
+/* only once the simulation thread has stopped, or before it starts */
+void game_set_threaded(game_t g, int threaded)
+{
+	g->g_threaded = threaded;
+	if ( !threaded )
+		input_flush(g);
+}
+
+void game_lock(game_t g)
+{
+	pthread_mutex_lock(&g->g_lock);
+}
+
+void game_unlock(game_t g)
+{
+	pthread_mutex_unlock(&g->g_lock);
 }
 
 void game_keypress(game_t g, int key, int down, const SDL_KeyboardEvent event)
 {
-	/* let the console have first dibs - we might be typing into it or hitting the key to show it. */
-	if (con_keypress(key, down, event)) {
-		/* notify other listeners that console has keyboard focus */
-		if ( g->g_ops && g->g_ops->grabbed ) {
-			(*g->g_ops->grabbed)(g->g_priv);
-			return;
-		}
-	}
+	struct game_ev ev;
+	int grabbed;
+
+	/* let the console have first dibs - we might be typing into it or
+	 * hitting the key to show it. commands mustn't run mid-tick.
+	*/
+	if ( g->g_threaded )
+		game_lock(g);
+	grabbed = con_keypress(key, down, event);
+	if ( g->g_threaded )
+		game_unlock(g);
+
+	memset(&ev, 0, sizeof(ev));
 
-	if ( NULL == g->g_ops || NULL == g->g_ops->keypress )
+	/* notify other listeners that console has keyboard focus */
+	if ( grabbed && g->g_ops && g->g_ops->grabbed ) {
+		ev.e_type = GAME_EV_GRABBED;
+		input_post(g, &ev);
 		return;
-	(*g->g_ops->keypress)(g->g_priv, key, down);
+	}
+
+	ev.e_type = GAME_EV_KEY;
+	ev.e_a = key;
+	ev.e_b = down;
+	input_post(g, &ev);
 }
 
 void game_mousebutton(game_t g, int button, int down)
 {
-	if ( NULL == g->g_ops || NULL == g->g_ops->mousebutton )
-		return;
-	(*g->g_ops->mousebutton)(g->g_priv, button, down);
+	struct game_ev ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.e_type = GAME_EV_BUTTON;
+	ev.e_a = button;
+	ev.e_b = down;
+	input_post(g, &ev);
 }
 
 void game_mousemove(game_t g, unsigned int x, unsigned int y,
 				int xrel, int yrel)
 {
-	if ( NULL == g->g_ops || NULL == g->g_ops->mousemove )
-		return;
-	(*g->g_ops->mousemove)(g->g_priv, x, y, xrel, yrel);
+	struct game_ev ev;
+
+	ev.e_type = GAME_EV_MOTION;
+	ev.e_a = x;
+	ev.e_b = y;
+	ev.e_xrel = xrel;
+	ev.e_yrel = yrel;
+	input_post(g, &ev);
 }
 
+/* Mode changes happen from the main loop, where nothing else can be
+ * running in the mode, see game_exit_finish()
+*/
 void game_mode_exit(void *priv, int code)
 {
 	struct _game *g = priv;
 
-	if ( code == GAME_MODE_QUIT ) {
+	pthread_mutex_lock(&g->g_ev_lock);
+	if ( !g->g_exit_pending ) {
+		g->g_exit_pending = 1;
+		g->g_exit_code = code;
+	}
+	pthread_mutex_unlock(&g->g_ev_lock);
+}
+
+int game_exit_pending(game_t g)
+{
+	int ret;
+
+	pthread_mutex_lock(&g->g_ev_lock);
+	ret = g->g_exit_pending;
+	pthread_mutex_unlock(&g->g_ev_lock);
+
+	return ret;
+}
+
+void game_exit_finish(game_t g)
+{
+	assert(!g->g_threaded);
+
+	if ( !g->g_exit_pending )
+		return;
+
+	g->g_exit_pending = 0;
+	if ( g->g_exit_code == GAME_MODE_QUIT ) {
 		game_exit(g);
 		return;
 	}
 
-	(*g->g_efn)(g, code);
+	(*g->g_efn)(g, g->g_exit_code);
 }
 
 int game_main(game_t g)
@@ -0,0 +1,500 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/vec.h>
+#include <punani/renderer.h>
+#include <punani/light.h>
+#include <punani/map.h>
+#include <punani/chopper.h>
+#include <punani/particles.h>
+#include <punani/entity.h>
+#include <punani/missile.h>
+#include <punani/timer.h>
+#include <punani/job.h>
+#include <punani/rng.h>
+#include <punani/demo.h>
+#include <punani/tex.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "hgang.h"
+
+/* Runs the game simulation with no window, GL or input devices. The
+ * chopper is flown from a script or a recorded demo so that runs are
+ * repeatable, which makes this the core of a dedicated server as well
+ * as a benchmark.
+*/
+#define CHOPPER_HEIGHT	55.0
+
+/* one line per event: <tick> <control> [0|1], or <tick> fire */
+struct script_ev {
+	unsigned int tick;
+	int ctrl; /* -1 for fire */
+	int down;
+};
+
+struct script {
+	struct script_ev *ev;
+	unsigned int num;
+	unsigned int max;
+	unsigned int cur;
+};
+
+static const char * const ctrl_names[] = {
+	[CHOPPER_THROTTLE] = "throttle",
+	[CHOPPER_BRAKE] = "brake",
+	[CHOPPER_ROTATE_LEFT] = "rotate_left",
+	[CHOPPER_ROTATE_RIGHT] = "rotate_right",
+	[CHOPPER_STRAFE_LEFT] = "strafe_left",
+	[CHOPPER_STRAFE_RIGHT] = "strafe_right",
+	[CHOPPER_ALTITUDE_INC] = "alt_inc",
+	[CHOPPER_ALTITUDE_DEC] = "alt_dec",
+};
+#define NUM_CTRLS (sizeof(ctrl_names)/sizeof(*ctrl_names))
+
+void con_printf(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+static int ctrl_lookup(const char *name)
+{
+	unsigned int i;
+
+	if ( !strcmp(name, "fire") )
+		return -1;
+
+	for(i = 0; i < NUM_CTRLS; i++) {
+		if ( !strcmp(name, ctrl_names[i]) )
+			return i;
+	}
+
+	return -2;
+}
+
+static int script_add(struct script *s, unsigned int tick, int ctrl, int down)
+{
+	if ( s->num >= s->max ) {
+		struct script_ev *new;
+		unsigned int max;
+
+		max = (s->max) ? s->max * 2 : 64;
+		new = realloc(s->ev, max * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+
+		s->ev = new;
+		s->max = max;
+	}
+
+	s->ev[s->num].tick = tick;
+	s->ev[s->num].ctrl = ctrl;
+	s->ev[s->num].down = down;
+	s->num++;
+	return 1;
+}
+
+static int script_load(struct script *s, const char *fn)
+{
+	unsigned int line = 0, last = 0;
+	char buf[256];
+	FILE *f;
+
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		con_printf("headless: %s: %s\n", fn, strerror(errno));
+		return 0;
+	}
+
+	while( fgets(buf, sizeof(buf), f) ) {
+		char name[32];
+		unsigned int tick;
+		int n, ctrl, down = 1;
+
+		line++;
+		if ( buf[0] == '#' || buf[0] == '\n' )
+			continue;
+
+		n = sscanf(buf, "%u %31s %d", &tick, name, &down);
+		if ( n < 2 ) {
+			con_printf("headless: %s:%u: parse error\n", fn, line);
+			goto err;
+		}
+
+		ctrl = ctrl_lookup(name);
+		if ( ctrl < -1 ) {
+			con_printf("headless: %s:%u: unknown control: %s\n",
+					fn, line, name);
+			goto err;
+		}
+
+		if ( tick < last ) {
+			con_printf("headless: %s:%u: out of order\n", fn, line);
+			goto err;
+		}
+		last = tick;
+
+		if ( !script_add(s, tick, ctrl, down) )
+			goto err;
+	}
+
+	fclose(f);
+	return 1;
+err:
+	fclose(f);
+	return 0;
+}
+
+static void script_run(struct script *s, chopper_t apache,
+			unsigned int tick, demo_t demo)
+{
+	while(s->cur < s->num && s->ev[s->cur].tick <= tick) {
+		const struct script_ev *ev = &s->ev[s->cur++];
+
+		if ( ev->ctrl < 0 ) {
+			chopper_fire(apache, tick);
+			if ( demo )
+				demo_fire(demo);
+		}else{
+			chopper_control(apache, ev->ctrl, ev->down);
+		}
+	}
+}
+
+/* keep the map paged in around the chopper */
+static void page_map(map_t map, chopper_t apache)
+{
+	vec3_t pos, move;
+
+	chopper_get_pos(apache, 0.0, move);
+	chopper_get_pos(apache, 1.0, pos);
+	v_sub(move, pos, move);
+	map_page(map, pos, move);
+}
+
+/* Keep about num particles alive, a trail's worth are emitted each tick
+ * to replace those which die, and time only the ticking.
+*/
+static int particle_bench(unsigned int num, unsigned int ticks)
+{
+	const vec3_t begin = {0.0, 0.0, 0.0};
+	vec3_t end = {0.0, 0.0, 0.0};
+	uint64_t usec = 0, now;
+	unsigned int i, total = 0;
+	texture_t sprite;
+	particles_t p;
+
+	sprite = png_get_by_name("data/smoke.png");
+	p = particles_new(sprite, PARTICLES_PRIO_NORMAL);
+	texture_put(sprite);
+	if ( NULL == p )
+		return 0;
+
+	/* particles emitted every 0.3 units and live for 40 ticks */
+	end[0] = num * 0.3 / 40;
+
+	for(i = 0; i < ticks; i++) {
+		particles_emit(p, begin, end);
+		total += particles_count(p);
+
+		now = timer_usec();
+		particles_think_all();
+		usec += timer_usec() - now;
+	}
+
+	printf("%u particles x %u ticks in %.3f s: %.2f ns/particle\n",
+		(ticks) ? total / ticks : 0, ticks, usec / 1000000.0,
+		(total) ? usec * 1000.0 / total : 0.0);
+	particles_unref(p);
+	return 1;
+}
+
+/* Exercise the hgang paths which nothing else in the game uses yet: an
+ * aligned pool with a fixed slab size, filled, reset and filled again,
+ * and the same shared between the job workers.
+*/
+#define CHECK_OBJ_SIZE	40
+#define CHECK_ALIGN	32
+#define CHECK_SLAB	64
+#define CHECK_NUM	(CHECK_SLAB * 16)
+
+struct alloc_check {
+	hgang_t pool;
+	void **obj;
+	unsigned int bad;
+};
+
+static int check_obj(void *obj)
+{
+	return obj && !((uintptr_t)obj & (CHECK_ALIGN - 1));
+}
+
+static void check_alloc_job(void *priv, unsigned int begin,
+				unsigned int end, unsigned int worker)
+{
+	struct alloc_check *c = priv;
+	unsigned int i;
+
+	for(i = begin; i < end; i++) {
+		c->obj[i] = hgang_alloc(c->pool);
+		if ( !check_obj(c->obj[i]) ) {
+			__sync_add_and_fetch(&c->bad, 1);
+			continue;
+		}
+		memset(c->obj[i], 0, CHECK_OBJ_SIZE);
+		*(unsigned int *)c->obj[i] = i;
+	}
+}
+
+static void check_return_job(void *priv, unsigned int begin,
+				unsigned int end, unsigned int worker)
+{
+	struct alloc_check *c = priv;
+	unsigned int i;
+
+	for(i = begin; i < end; i++) {
+		if ( NULL == c->obj[i] )
+			continue;
+		if ( *(unsigned int *)c->obj[i] != i )
+			__sync_add_and_fetch(&c->bad, 1);
+		hgang_return(c->pool, c->obj[i]);
+	}
+}
+
+static int fill_check(struct alloc_check *c, const char *what)
+{
+	struct hgang_stats st;
+	unsigned int i;
+
+	for(i = 0; i < CHECK_NUM; i++) {
+		c->obj[i] = hgang_alloc(c->pool);
+		if ( !check_obj(c->obj[i]) ) {
+			con_printf("alloc_check: %s: bad object %p\n",
+					what, c->obj[i]);
+			return 0;
+		}
+	}
+
+	hgang_stats(c->pool, &st);
+	if ( st.live != CHECK_NUM || st.slabs != CHECK_NUM / CHECK_SLAB ) {
+		con_printf("alloc_check: %s: %lu live in %u slabs\n",
+				what, st.live, st.slabs);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int alloc_check(void)
+{
+	struct alloc_check c;
+	struct hgang_stats st;
+	int ret = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.obj = calloc(CHECK_NUM, sizeof(*c.obj));
+	if ( NULL == c.obj )
+		goto out;
+
+	c.pool = hgang_new_aligned(CHECK_OBJ_SIZE, CHECK_ALIGN, CHECK_SLAB, 0);
+	if ( NULL == c.pool )
+		goto out_free;
+
+	/* a reset pool must be refilled from the slabs it already has */
+	if ( !fill_check(&c, "aligned") )
+		goto out_free_pool;
+	hgang_reset(c.pool);
+	if ( !fill_check(&c, "reset") )
+		goto out_free_pool;
+	hgang_free(c.pool);
+
+	c.pool = hgang_new_aligned(CHECK_OBJ_SIZE, CHECK_ALIGN, CHECK_SLAB,
+					HGANG_CONCURRENT);
+	if ( NULL == c.pool )
+		goto out_free;
+
+	job_run(CHECK_NUM, CHECK_SLAB / 4, check_alloc_job, &c);
+	job_run(CHECK_NUM, CHECK_SLAB / 4, check_return_job, &c);
+
+	/* magazines hang on to some, but every slab is whole */
+	hgang_stats(c.pool, &st);
+	if ( c.bad || st.live ||
+			st.free != (unsigned long)st.slabs * CHECK_SLAB ) {
+		con_printf("alloc_check: concurrent: %u bad, %lu live, "
+				"%lu free in %u slabs\n",
+				c.bad, st.live, st.free, st.slabs);
+		goto out_free_pool;
+	}
+
+	printf("alloc_check: ok\n");
+	ret = 1;
+
+out_free_pool:
+	hgang_free(c.pool);
+out_free:
+	free(c.obj);
+out:
+	return ret;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-n ticks] [-s script] [-m map] "
+			"[-r demo | -p demo] [-P particles] [-A]\n", cmd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *map_name = "data/maps/level1";
+	const char *record = NULL, *play = NULL;
+	struct script script;
+	unsigned int i, ticks = 1000;
+	uint64_t begin, usec, now;
+	demo_t demo = NULL;
+	unsigned int bench = 0;
+	int check = 0;
+	int ticks_set = 0;
+	renderer_t r;
+	map_t map;
+	chopper_t apache;
+	vec3_t spawn;
+	int c, ret = EXIT_FAILURE;
+
+	memset(&script, 0, sizeof(script));
+
+	while( (c = getopt(argc, argv, "n:s:m:r:p:P:Ah")) != -1 ) {
+		switch(c) {
+		case 'n':
+			ticks = strtoul(optarg, NULL, 0);
+			ticks_set = 1;
+			break;
+		case 's':
+			if ( !script_load(&script, optarg) )
+				goto out;
+			break;
+		case 'm':
+			map_name = optarg;
+			break;
+		case 'r':
+			record = optarg;
+			break;
+		case 'p':
+			play = optarg;
+			break;
+		case 'P':
+			bench = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			check = 1;
+			break;
+		default:
+			usage(argv[0]);
+			goto out;
+		}
+	}
+
+	if ( record && play ) {
+		usage(argv[0]);
+		goto out;
+	}
+
+	if ( bench ) {
+		if ( particle_bench(bench, ticks) )
+			ret = EXIT_SUCCESS;
+		particles_free_all();
+		goto out;
+	}
+
+	if ( check ) {
+		job_init();
+		if ( alloc_check() )
+			ret = EXIT_SUCCESS;
+		job_exit();
+		goto out;
+	}
+
+	if ( play ) {
+		demo = demo_play(play);
+		if ( NULL == demo )
+			goto out;
+		if ( !ticks_set )
+			ticks = demo_num_ticks(demo);
+	}else if ( record ) {
+		demo = demo_record(record, rng_get_seed());
+		if ( NULL == demo )
+			goto out;
+	}
+
+	job_init();
+
+	r = renderer_new(NULL);
+	if ( NULL == r )
+		goto out_jobs;
+
+	map = map_load(r, map_name);
+	if ( NULL == map )
+		goto out_free_render;
+
+	if ( !missile_init() )
+		goto out_free_map;
+
+	spawn[0] = 0.0;
+	spawn[1] = CHOPPER_HEIGHT;
+	spawn[2] = 0.0;
+	apache = chopper_comanche(spawn, 0.785);
+	if ( NULL == apache )
+		goto out_free_missiles;
+
+	page_map(map, apache);
+
+	begin = now = timer_usec();
+	for(i = 0; i < ticks; i++) {
+		uint64_t prev = now;
+
+		if ( demo && demo_playing(demo) ) {
+			if ( !demo_tick(demo, apache, i) )
+				break;
+		}else{
+			script_run(&script, apache, i, demo);
+			if ( demo )
+				demo_tick(demo, apache, i);
+		}
+		page_map(map, apache);
+		map_put_released(map);
+		entity_think_all(map);
+		particles_think_all();
+
+		now = timer_usec();
+		if ( demo )
+			demo_frame_time(demo, now - prev);
+	}
+	usec = now - begin;
+
+	printf("%u ticks in %.3f s: %.1f ticks/sec\n", i,
+		usec / 1000000.0,
+		(usec) ? i * 1000000.0 / usec : 0.0);
+	chopper_get_pos(apache, 1.0, spawn);
+	printf("chopper at %f %f %f\n", spawn[0], spawn[1], spawn[2]);
+	ret = EXIT_SUCCESS;
+
+	chopper_free(apache);
+out_free_missiles:
+	missile_exit();
+out_free_map:
+	map_free(map);
+	particles_free_all();
+out_free_render:
+	renderer_free(r);
+out_jobs:
+	job_exit();
+out:
+	demo_close(demo);
+	free(script.ev);
+	return ret;
+}
@@ -4,32 +4,98 @@
 * Released under the terms of the GNU GPL version 2
 */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include "hgang.h"
 
-#if MPOOL_POISON
-#define POISON(ptr, len) memset(ptr, MPOOL_POISON_PATTERN, len)
+/* Concurrent hgangs give each thread a magazine of free objects so that
+ * the common case touches nothing shared. Magazines are filled from and
+ * spilled to a lock-free depot, a stack of batches of HGANG_MAG_BATCH
+ * free objects. Objects in a batch are chained through their first word,
+ * batches through their second. The depot head carries a generation in
+ * its top bits against ABA.
+*/
+#define HGANG_MAG_BATCH		16
+#define HGANG_MAX_THREADS	64
+
+#if UINTPTR_MAX > 0xffffffffU
+#define DEPOT_PTR_BITS		48
 #else
-#define POISON(ptr, len) do { } while(0);
+#define DEPOT_PTR_BITS		32
 #endif
+#define DEPOT_PTR_MASK		((1ULL << DEPOT_PTR_BITS) - 1)
+
+#define OBJ_NEXT(obj)		(((void **)(obj))[0])
+#define BATCH_NEXT(obj)		(((void **)(obj))[1])
+
+struct hgang_mag {
+	unsigned int m_num;
+	unsigned long m_allocs;
+	unsigned long m_returns;
+	void *m_obj[HGANG_MAG_BATCH * 2];
+} __attribute__((aligned(64)));
+
+/* 0 until a thread first uses a concurrent hgang */
+static __thread unsigned int hgang_tid;
+static unsigned int hgang_num_tids;
+
+/* With HGANG_POISON, free objects are filled with a pattern which is
+ * checked when they're handed out again, apart from the words used to
+ * link them. Setting HGANG_POISON in the environment turns it on for
+ * every hgang.
+*/
+#define POISON(h, ptr, len) \
+	do { \
+		if ( (h)->flags & HGANG_POISON ) \
+			memset(ptr, HGANG_POISON_PATTERN, len); \
+	} while(0)
+
+/* every live hgang, for hgang_stats_all() */
+static struct _hgang *registry;
+static int registry_lock;
 
 /** hgang descriptor.
  * \ingroup g_hgang
 */
 struct _hgang {
-	/** Object size. */
+	/** Object size, a multiple of align. */
 	size_t obj_size;
+	/** Alignment of objects, a power of two. */
+	size_t align;
 	/** Pointer to next available object */
 	uint8_t *next_obj;
 	/** Size of each block including hgang_hdr overhead. */
 	size_t slab_size;
 	/** List of blocks. */
 	struct _hgang_hdr *slabs;
+	/** Blocks kept by hgang_reset() for reuse. */
+	struct _hgang_hdr *spare;
 	/** List of free'd objects. */
 	void *free;
+	/** HGANG_* flags passed to hgang_new() */
+	unsigned int flags;
+	/** Per-thread magazines, indexed by hgang_tid - 1 */
+	struct hgang_mag **mags;
+	/** Shared stack of batches of free objects, see DEPOT_PTR_BITS */
+	uint64_t depot;
+
+	/** Name for hgang_stats(), may be NULL */
+	const char *name;
+	/** Registry links */
+	struct _hgang *reg_next, **reg_pprev;
+
+	/** Counters, live and num_free are for non-concurrent hgangs,
+	 * concurrent ones add up the magazines and these instead.
+	 */
+	unsigned long live;
+	unsigned long peak;
+	unsigned long num_free;
+	unsigned long allocs;
+	unsigned long returns;
+	unsigned int num_slabs;
 };
 
 
@@ -48,9 +114,10 @@ struct _hgang_hdr {
 	uint8_t data[0];
 };
 
-static uint8_t *first_byte(struct _hgang_hdr *hdr)
+static uint8_t *first_byte(struct _hgang *h, struct _hgang_hdr *hdr)
 {
-	return (uint8_t *)hdr + sizeof(*hdr);
+	uintptr_t ptr = (uintptr_t)hdr + sizeof(*hdr);
+	return (uint8_t *)((ptr + h->align - 1) & ~(uintptr_t)(h->align - 1));
 }
 
 static uint8_t *last_byte(struct _hgang *h, struct _hgang_hdr *hdr)
@@ -60,43 +127,110 @@ static uint8_t *last_byte(struct _hgang *h, struct _hgang_hdr *hdr)
 
 static int obj_in_slab(struct _hgang *h, struct _hgang_hdr *hdr, void *obj)
 {
-	return ((uint8_t *)obj >= first_byte(hdr) &&
+	return ((uint8_t *)obj >= first_byte(h, hdr) &&
 		(uint8_t *)obj + h->obj_size <= last_byte(h, hdr));
 }
 
-/** Initialise an hgang.
+static void reg_lock(void)
+{
+	while( __sync_lock_test_and_set(&registry_lock, 1) )
+		/* spin */;
+}
+
+static void reg_unlock(void)
+{
+	__sync_lock_release(&registry_lock);
+}
+
+/* free objects may use this much of themselves to link the lists */
+static size_t link_size(struct _hgang *h)
+{
+	return (h->flags & HGANG_CONCURRENT) ? 2 * sizeof(void *) :
+						sizeof(void *);
+}
+
+/* the pattern is intact if nothing touched the object while free, objects
+ * with no room past the links can't be checked
+*/
+static int can_check(struct _hgang *h)
+{
+	return h->obj_size > link_size(h);
+}
+
+static int poisoned(struct _hgang *h, void *obj)
+{
+	const uint8_t *p = obj;
+	size_t i;
+
+	for(i = link_size(h); i < h->obj_size; i++) {
+		if ( p[i] != HGANG_POISON_PATTERN )
+			return 0;
+	}
+
+	return 1;
+}
+
+static void poison_fail(struct _hgang *h, void *obj, const char *what)
+{
+	fprintf(stderr, "hgang: %s: object %p %s\n",
+		(h->name) ? h->name : "(anonymous)", obj, what);
+	abort();
+}
+
+/** Initialise an hgang with aligned objects.
  * \ingroup g_hgang
  *
- * @param h an hgang structure to use
  * @param obj_size size of objects to allocate
+ * @param align alignment of objects, a power of two
  * @param slab_size size of slabs in number of objects (set to zero for auto)
+ * @param flags HGANG_CONCURRENT if objects are allocated and returned
+ * from more than one thread
  *
  * Creates a new empty memory pool descriptor with the passed values
- * set. The resultant hgang has no alignment requirement set.
+ * set. Objects are padded out to a multiple of align.
  *
- * @return zero on error, non-zero for success
- * (may only return 0 if the obj_size is 0).
+ * @return NULL on error
  */
-hgang_t hgang_new(size_t obj_size, unsigned slab_size)
+hgang_t hgang_new_aligned(size_t obj_size, size_t align,
+				unsigned slab_size, unsigned flags)
 {
 	struct _hgang *h;
 
 	/* quick sanity checks */
 	if ( obj_size == 0 )
 		return NULL;
+	if ( align == 0 || (align & (align - 1)) )
+		return NULL;
 
-	h = malloc(sizeof(*h));
+	h = calloc(1, sizeof(*h));
 	if ( NULL == h )
 		return NULL;
 
+	if ( getenv("HGANG_POISON") )
+		flags |= HGANG_POISON;
+
+	h->flags = flags;
+	if ( flags & HGANG_CONCURRENT ) {
+		h->mags = calloc(HGANG_MAX_THREADS, sizeof(*h->mags));
+		if ( NULL == h->mags ) {
+			free(h);
+			return NULL;
+		}
+
+		/* batches are linked through the second word */
+		if ( obj_size < 2 * sizeof(void *) )
+			obj_size = 2 * sizeof(void *);
+	}
+
 	if ( obj_size < sizeof(void *) )
 		obj_size = sizeof(void *);
 
-	h->obj_size = obj_size;
+	h->obj_size = (obj_size + align - 1) & ~(align - 1);
+	h->align = align;
 
 	if ( slab_size ) {
 		h->slab_size = sizeof(struct _hgang_hdr) + 
-				(slab_size * obj_size);
+				(slab_size * h->obj_size);
 	}else{
 		/* XXX: totally arbitrary... */
 		if ( h->obj_size < 8192 ) {
@@ -108,12 +242,43 @@ hgang_t hgang_new(size_t obj_size, unsigned slab_size)
 		}
 	}
 
+	/* room to line up the first object */
+	h->slab_size += align - 1;
+
 	h->slabs = NULL;
 	h->free = NULL;
 
+	reg_lock();
+	h->reg_next = registry;
+	if ( registry )
+		registry->reg_pprev = &h->reg_next;
+	h->reg_pprev = &registry;
+	registry = h;
+	reg_unlock();
+
 	return h;
 }
 
+/** Initialise an hgang.
+ * \ingroup g_hgang
+ *
+ * The same as hgang_new_aligned() with no alignment requirement.
+ */
+hgang_t hgang_new(size_t obj_size, unsigned slab_size, unsigned flags)
+{
+	return hgang_new_aligned(obj_size, 1, slab_size, flags);
+}
+
+/** Name an hgang for hgang_stats().
+ * \ingroup g_hgang
+ *
+ * The string isn't copied, so must outlive the hgang.
+ */
+void hgang_set_name(hgang_t h, const char *name)
+{
+	h->name = name;
+}
+
 /** Slow path for hgang allocations.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
@@ -127,16 +292,22 @@ hgang_t hgang_new(size_t obj_size, unsigned slab_size)
 static void *hgang_alloc_slow(struct _hgang *h)
 {
 	struct _hgang_hdr *hdr;
-	void *ptr, *ret;
+	uint8_t *ret;
 
-	hdr = ptr = malloc(h->slab_size);
-	if ( hdr == NULL )
-		return NULL;
+	if ( h->spare ) {
+		hdr = h->spare;
+		h->spare = hdr->next;
+	}else{
+		hdr = malloc(h->slab_size);
+		if ( hdr == NULL )
+			return NULL;
+		h->num_slabs++;
+	}
 
-	POISON(ptr, h->slab_size);
+	POISON(h, hdr, h->slab_size);
 
 	/* Set first object */
-	ret = ptr + sizeof(*hdr);
+	ret = first_byte(h, hdr);
 	h->next_obj = ret + h->obj_size;
 
 	/* prepend to slab list */
@@ -146,6 +317,190 @@ static void *hgang_alloc_slow(struct _hgang *h)
 	return ret;
 }
 
+static void *depot_ptr(uint64_t head)
+{
+	return (void *)(uintptr_t)(head & DEPOT_PTR_MASK);
+}
+
+static uint64_t depot_head(void *ptr, uint64_t old)
+{
+	uint64_t gen = (old >> DEPOT_PTR_BITS) + 1;
+	return (gen << DEPOT_PTR_BITS) | (uintptr_t)ptr;
+}
+
+/** Push a chain of batches, first to last, on to the depot.
+ * \ingroup g_hgang
+ */
+static void depot_push(struct _hgang *h, void *first, void *last)
+{
+	uint64_t old, new;
+
+	do {
+		old = *(volatile uint64_t *)&h->depot;
+		BATCH_NEXT(last) = depot_ptr(old);
+		new = depot_head(first, old);
+	} while( !__sync_bool_compare_and_swap(&h->depot, old, new) );
+}
+
+/** Pop one batch from the depot.
+ * \ingroup g_hgang
+ *
+ * The batch may be handed out and overwritten by another thread while
+ * we read its link, but slabs are never freed while the hgang is in use
+ * and the generation makes sure the stale link isn't installed.
+ */
+static void *depot_pop(struct _hgang *h)
+{
+	uint64_t old, new;
+	void *batch;
+
+	do {
+		old = *(volatile uint64_t *)&h->depot;
+		batch = depot_ptr(old);
+		if ( NULL == batch )
+			return NULL;
+		new = depot_head(*(void * volatile *)&BATCH_NEXT(batch), old);
+	} while( !__sync_bool_compare_and_swap(&h->depot, old, new) );
+
+	return batch;
+}
+
+/** Carve a new slab in to batches and push all but the first.
+ * \ingroup g_hgang
+ */
+static void *slab_batches(struct _hgang *h)
+{
+	struct _hgang_hdr *hdr, *old;
+	void *first = NULL, *last = NULL, *ret = NULL;
+	uint8_t *obj, *prev = NULL;
+	unsigned int n = 0;
+
+	/* nothing is ever pushed to the spares while the hgang is shared,
+	 * so popping them can't suffer from ABA
+	*/
+	do {
+		hdr = *(struct _hgang_hdr * volatile *)&h->spare;
+	} while( hdr && !__sync_bool_compare_and_swap(&h->spare, hdr,
+							hdr->next) );
+
+	if ( NULL == hdr ) {
+		hdr = malloc(h->slab_size);
+		if ( NULL == hdr )
+			return NULL;
+		__sync_add_and_fetch(&h->num_slabs, 1);
+	}
+
+	POISON(h, hdr, h->slab_size);
+
+	for(obj = first_byte(h, hdr); obj_in_slab(h, hdr, obj);
+			obj += h->obj_size) {
+		if ( n++ % HGANG_MAG_BATCH ) {
+			OBJ_NEXT(prev) = obj;
+		}else if ( NULL == ret ) {
+			ret = obj;
+		}else{
+			if ( last )
+				BATCH_NEXT(last) = obj;
+			else
+				first = obj;
+			last = obj;
+		}
+		OBJ_NEXT(obj) = NULL;
+		prev = obj;
+	}
+
+	/* slabs are only ever added to while the hgang is shared */
+	do {
+		old = *(struct _hgang_hdr * volatile *)&h->slabs;
+		hdr->next = old;
+	} while( !__sync_bool_compare_and_swap(&h->slabs, old, hdr) );
+
+	if ( first )
+		depot_push(h, first, last);
+
+	return ret;
+}
+
+/** This thread's magazine, NULL if there are too many threads.
+ * \ingroup g_hgang
+ */
+static struct hgang_mag *mag_get(struct _hgang *h)
+{
+	struct hgang_mag *m;
+
+	if ( !hgang_tid )
+		hgang_tid = __sync_add_and_fetch(&hgang_num_tids, 1);
+	if ( hgang_tid > HGANG_MAX_THREADS )
+		return NULL;
+
+	m = h->mags[hgang_tid - 1];
+	if ( NULL == m ) {
+		m = calloc(1, sizeof(*m));
+		h->mags[hgang_tid - 1] = m;
+	}
+
+	return m;
+}
+
+static void *concurrent_alloc(struct _hgang *h)
+{
+	struct hgang_mag *m = mag_get(h);
+	void *batch, *obj;
+
+	if ( m && m->m_num ) {
+		m->m_allocs++;
+		return m->m_obj[--m->m_num];
+	}
+
+	batch = depot_pop(h);
+	if ( NULL == batch ) {
+		batch = slab_batches(h);
+		if ( NULL == batch )
+			return NULL;
+	}
+
+	/* keep the rest of the batch, if we can */
+	if ( m ) {
+		m->m_allocs++;
+		for(obj = OBJ_NEXT(batch); obj; obj = OBJ_NEXT(obj))
+			m->m_obj[m->m_num++] = obj;
+	}else{
+		__sync_add_and_fetch(&h->allocs, 1);
+		if ( OBJ_NEXT(batch) )
+			depot_push(h, OBJ_NEXT(batch), OBJ_NEXT(batch));
+	}
+
+	return batch;
+}
+
+static void concurrent_return(struct _hgang *h, void *obj)
+{
+	struct hgang_mag *m = mag_get(h);
+	unsigned int i;
+
+	if ( NULL == m ) {
+		__sync_add_and_fetch(&h->returns, 1);
+		OBJ_NEXT(obj) = NULL;
+		depot_push(h, obj, obj);
+		return;
+	}
+	m->m_returns++;
+
+	/* full, spill the older half as a batch */
+	if ( m->m_num == HGANG_MAG_BATCH * 2 ) {
+		for(i = 0; i < HGANG_MAG_BATCH - 1; i++)
+			OBJ_NEXT(m->m_obj[i]) = m->m_obj[i + 1];
+		OBJ_NEXT(m->m_obj[i]) = NULL;
+		depot_push(h, m->m_obj[0], m->m_obj[0]);
+
+		memmove(m->m_obj, m->m_obj + HGANG_MAG_BATCH,
+			HGANG_MAG_BATCH * sizeof(*m->m_obj));
+		m->m_num = HGANG_MAG_BATCH;
+	}
+
+	m->m_obj[m->m_num++] = obj;
+}
+
 /** Allocate an object from an hgang.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
@@ -155,12 +510,16 @@ static void *hgang_alloc_slow(struct _hgang *h)
  *
  * @return a new object
  */
-void *hgang_alloc(hgang_t h)
+static void *do_alloc(struct _hgang *h)
 {
+	if ( h->flags & HGANG_CONCURRENT )
+		return concurrent_alloc(h);
+
 	/* Try a free'd object first */
 	if ( h->free ) {
 		void *ret = h->free;
 		h->free = *(void **)h->free;
+		h->num_free--;
 		return ret;
 	}
 
@@ -178,6 +537,27 @@ void *hgang_alloc(hgang_t h)
 	return hgang_alloc_slow(h);
 }
 
+void *hgang_alloc(hgang_t h)
+{
+	void *ret;
+
+	ret = do_alloc(h);
+	if ( NULL == ret )
+		return NULL;
+
+	/* scribble over it too, so a return can tell it's not free */
+	if ( h->flags & HGANG_POISON ) {
+		if ( can_check(h) && !poisoned(h, ret) )
+			poison_fail(h, ret, "written to after return");
+		memset(ret, (uint8_t)~HGANG_POISON_PATTERN, h->obj_size);
+	}
+
+	if ( !(h->flags & HGANG_CONCURRENT) && ++h->live > h->peak )
+		h->peak = h->live;
+
+	return ret;
+}
+
 /** Destroy an hgang object.
  * \ingroup g_hgang
  * @param h a valid hgang structure returned from hgang_init()
@@ -192,12 +572,28 @@ void hgang_free(hgang_t h)
 	if ( NULL == h )
 		return;
 
+	reg_lock();
+	*h->reg_pprev = h->reg_next;
+	if ( h->reg_next )
+		h->reg_next->reg_pprev = h->reg_pprev;
+	reg_unlock();
+
+	if ( h->mags ) {
+		unsigned int i;
+
+		for(i = 0; i < HGANG_MAX_THREADS; i++)
+			free(h->mags[i]);
+		free(h->mags);
+	}
+
 	for(hdr = h->slabs; (f = hdr); free(f)) {
 		hdr = hdr->next;
-		POISON(f, h->slab_size);
+		POISON(h, f, h->slab_size);
 	}
 
-	POISON(h, sizeof(*h));
+	for(hdr = h->spare; (f = hdr); free(f))
+		hdr = hdr->next;
+
 	free(h);
 }
 
@@ -215,9 +611,65 @@ void hgang_return(hgang_t h, void *obj)
 	if ( obj == NULL )
 		return;
 	assert(h->obj_size >= sizeof(void *));
-	POISON(obj, h->obj_size);
+
+	if ( h->flags & HGANG_POISON ) {
+		if ( can_check(h) && poisoned(h, obj) )
+			poison_fail(h, obj, "returned twice");
+		memset(obj, HGANG_POISON_PATTERN, h->obj_size);
+	}
+
+	if ( h->flags & HGANG_CONCURRENT ) {
+		concurrent_return(h, obj);
+		return;
+	}
+
 	*(void **)obj = h->free;
 	h->free = obj;
+	h->num_free++;
+	h->live--;
+}
+
+/** Return every object at once.
+ * \ingroup g_hgang
+ * @param h hgang object to reset
+ *
+ * All objects are dropped, but the slabs are kept to be handed out
+ * again before any more are allocated. Takes time proportional to the
+ * number of slabs rather than objects. For concurrent hgangs no other
+ * thread may be using h at the same time.
+ */
+void hgang_reset(hgang_t h)
+{
+	struct _hgang_hdr *tail;
+
+	if ( h->slabs ) {
+		for(tail = h->slabs; tail->next; tail = tail->next)
+			/* nothing */;
+		tail->next = h->spare;
+		h->spare = h->slabs;
+		h->slabs = NULL;
+	}
+
+	h->next_obj = NULL;
+	h->free = NULL;
+	h->num_free = 0;
+	h->live = 0;
+
+	if ( h->flags & HGANG_CONCURRENT ) {
+		unsigned int i;
+
+		for(i = 0; i < HGANG_MAX_THREADS; i++) {
+			struct hgang_mag *m = h->mags[i];
+			if ( NULL == m )
+				continue;
+			m->m_num = 0;
+			m->m_allocs = m->m_returns = 0;
+		}
+
+		/* keep the generation going */
+		h->depot = depot_head(NULL, h->depot);
+		h->allocs = h->returns = 0;
+	}
 }
 
 /** Allocate an object initialized to zero.
@@ -260,18 +712,20 @@ int hgang_foreach(hgang_t h, hgang_cb_t cb, void *priv)
 	if ( NULL == h->slabs )
 		return 1;
 
-	assert(NULL != h->free);
-
+	/* concurrent hgangs carve up whole slabs as soon as they're made */
 	hdr = h->slabs;
-	for(obj = first_byte(hdr);
-			(uint8_t *)obj + h->obj_size <= h->next_obj; 
-			obj += h->obj_size) {
-		if ( !(*cb)(priv, obj) )
-			return 0;
+	if ( !(h->flags & HGANG_CONCURRENT) ) {
+		for(obj = first_byte(h, hdr);
+				(uint8_t *)obj + h->obj_size <= h->next_obj; 
+				obj += h->obj_size) {
+			if ( !(*cb)(priv, obj) )
+				return 0;
+		}
+		hdr = hdr->next;
 	}
 
-	for(hdr = hdr->next; hdr; hdr = hdr->next) {
-		for(obj = first_byte(hdr);
+	for(; hdr; hdr = hdr->next) {
+		for(obj = first_byte(h, hdr);
 				obj_in_slab(h, hdr, obj);
 				obj += h->obj_size) {
 			if ( !(*cb)(priv, obj) )
@@ -281,3 +735,63 @@ int hgang_foreach(hgang_t h, hgang_cb_t cb, void *priv)
 
 	return 1;
 }
+
+/** Get allocator statistics.
+ * \ingroup g_hgang
+ *
+ * For concurrent hgangs the numbers are only a snapshot, and the peak is
+ * only the highest count seen by a call to this function.
+ */
+void hgang_stats(hgang_t h, struct hgang_stats *st)
+{
+	st->name = h->name;
+	st->obj_size = h->obj_size;
+	st->slab_size = h->slab_size;
+	st->slabs = h->num_slabs;
+
+	if ( h->flags & HGANG_CONCURRENT ) {
+		unsigned long allocs = h->allocs, returns = h->returns;
+		unsigned long total;
+		unsigned int i;
+
+		for(i = 0; i < HGANG_MAX_THREADS; i++) {
+			struct hgang_mag *m = h->mags[i];
+			if ( NULL == m )
+				continue;
+			allocs += m->m_allocs;
+			returns += m->m_returns;
+		}
+
+		total = (unsigned long)h->num_slabs *
+			((h->slab_size - sizeof(struct _hgang_hdr) -
+				(h->align - 1)) / h->obj_size);
+		st->live = allocs - returns;
+		st->free = total - st->live;
+		if ( st->live > h->peak )
+			h->peak = st->live;
+		st->peak = h->peak;
+	}else{
+		st->live = h->live;
+		st->free = h->num_free;
+		st->peak = h->peak;
+	}
+}
+
+/** Call a function with the statistics of every live hgang.
+ * \ingroup g_hgang
+ *
+ * The registry is locked while cb runs, so it mustn't create or destroy
+ * any hgangs.
+ */
+void hgang_stats_all(hgang_stats_cb_t cb, void *priv)
+{
+	struct hgang_stats st;
+	struct _hgang *h;
+
+	reg_lock();
+	for(h = registry; h; h = h->reg_next) {
+		hgang_stats(h, &st);
+		(*cb)(priv, &st);
+	}
+	reg_unlock();
+}
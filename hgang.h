@@ -8,12 +8,29 @@
 
 typedef struct _hgang *hgang_t;
 
-#define HGANG_POISON		1
 #define HGANG_POISON_PATTERN	0xa5
 
+/* flags for hgang_new() */
+#define HGANG_CONCURRENT	(1U << 0) /* alloc/return from any thread */
+#define HGANG_POISON		(1U << 1) /* catch use after return */
+
+struct hgang_stats {
+	const char *name;
+	size_t obj_size;
+	size_t slab_size;
+	unsigned int slabs;
+	unsigned long live;
+	unsigned long free;
+	unsigned long peak;
+};
+
 typedef int(*hgang_cb_t)(void *priv, void *obj);
+typedef void(*hgang_stats_cb_t)(void *priv, const struct hgang_stats *st);
 
-hgang_t hgang_new(size_t obj_size, unsigned slab_size);
+hgang_t hgang_new(size_t obj_size, unsigned slab_size, unsigned flags);
+hgang_t hgang_new_aligned(size_t obj_size, size_t align,
+				unsigned slab_size, unsigned flags);
+void hgang_reset(hgang_t h);
 void hgang_free(hgang_t h);
 void * hgang_alloc(hgang_t h);
 void *hgang_alloc0(hgang_t h);
@@ -23,4 +40,8 @@ int hgang_foreach(hgang_t h, hgang_cb_t cb, void *priv);
 
 size_t hgang_object_size(hgang_t h);
 
+void hgang_set_name(hgang_t h, const char *name);
+void hgang_stats(hgang_t h, struct hgang_stats *st);
+void hgang_stats_all(hgang_stats_cb_t cb, void *priv);
+
 #endif /* _HGANG_HEADER_INCLUDED_ */
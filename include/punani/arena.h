@@ -0,0 +1,44 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_ARENA_H
+#define _PUNANI_ARENA_H
+
+/* Bump allocator for data which only lives for a frame. There are two
+ * buffers and arena_flip() swaps them, emptying the new one, so whatever
+ * was allocated in the last frame can still be read in this one. Nothing
+ * is ever freed on its own.
+ *
+ * When a buffer runs out, allocations spill over to malloc and the buffer
+ * is grown to fit at its next flip, so it settles at the biggest frame.
+*/
+typedef struct _arena *arena_t;
+
+struct arena_stats {
+	const char *name;
+	size_t size; /* of each buffer */
+	size_t used; /* in the current buffer */
+	size_t peak; /* most used in one frame, overflow included */
+	unsigned long frames;
+	unsigned long overflows; /* allocations which didn't fit */
+	size_t overflow_bytes;
+};
+
+typedef void(*arena_stats_cb_t)(void *priv, const struct arena_stats *st);
+
+arena_t arena_new(const char *name, size_t size);
+void *arena_alloc(arena_t a, size_t sz, size_t align);
+void arena_flip(arena_t a);
+void arena_stats(arena_t a, struct arena_stats *st);
+void arena_stats_all(arena_stats_cb_t cb, void *priv);
+void arena_free(arena_t a);
+
+/* The arena for the frame the calling thread is in, game_tick() and
+ * game_render() set it for the length of the frame. frame_alloc() returns
+ * NULL outside of a frame.
+*/
+void frame_arena_set(arena_t a);
+void *frame_alloc(size_t sz, size_t align);
+
+#endif /* _PUNANI_ARENA_H */
@@ -15,11 +15,17 @@ typedef struct _chopper *chopper_t;
 #define CHOPPER_STRAFE_RIGHT		5
 #define CHOPPER_ALTITUDE_INC		6
 #define CHOPPER_ALTITUDE_DEC		7
+#define CHOPPER_NUM_CONTROLS		8
 
 chopper_t chopper_comanche(const vec3_t pos, float h);
 void chopper_get_pos(chopper_t chopper, float lerp, vec3_t out);
 void chopper_control(chopper_t chopper, unsigned int ctrl, int down);
 void chopper_control_release_all(chopper_t chopper);
+
+/* bitmask of (1 << CHOPPER_*) for the controls held down */
+unsigned int chopper_input(chopper_t chopper);
+void chopper_set_input(chopper_t chopper, unsigned int input);
+
 void chopper_fire(chopper_t chopper, unsigned int time);
 void chopper_free(chopper_t chopper);
 
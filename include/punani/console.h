@@ -9,6 +9,7 @@
 #include <punani/renderer.h>
 #include <punani/font.h>
 #include <punani/tex.h>
+#include <SDL.h>
 
 typedef struct _console *console_t;
 
@@ -0,0 +1,27 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_DEMO_H
+#define _PUNANI_DEMO_H
+
+typedef struct _demo *demo_t;
+
+/* recording re-seeds the rng, playback puts back the recorded seed */
+demo_t demo_record(const char *fn, uint32_t seed);
+demo_t demo_play(const char *fn);
+int demo_playing(demo_t d);
+unsigned int demo_num_ticks(demo_t d);
+
+/* Call once per tick before the simulation runs. When recording, the
+ * chopper's controls and any fire since the last tick are logged, when
+ * playing back they are applied instead. Returns zero at end of playback.
+*/
+int demo_tick(demo_t d, chopper_t apache, unsigned int time);
+void demo_fire(demo_t d);
+
+/* frame timings, summarised on close */
+void demo_frame_time(demo_t d, uint64_t usec);
+void demo_close(demo_t d);
+
+#endif /* _PUNANI_DEMO_H */
@@ -7,9 +7,25 @@
 
 typedef struct _entity *entity_t;
 
+/* stays valid across compaction of the entity store, entity_get()
+ * returns NULL once the entity it named has been unlinked
+*/
+typedef uint32_t entity_handle_t;
+
+entity_handle_t entity_handle(entity_t ent);
+entity_t entity_get(entity_handle_t h);
+
 void entity_link(entity_t ent);
 void entity_unlink(entity_t ent);
 void entity_think_all(map_t map);
-void entity_render_all(renderer_t r, float lerp, light_t l);
+
+/* copies of entity state for rendering on another thread to ticks */
+typedef struct _entity_snap *entity_snap_t;
+
+entity_snap_t entity_snap_new(void);
+void entity_snap(entity_snap_t s);
+void entity_snap_free(entity_snap_t s);
+void entity_cull_all(entity_snap_t s, map_t map, float lerp);
+void entity_render_all(entity_snap_t s, renderer_t r, float lerp, light_t l);
 
 #endif /* _PUNANI_ENTITY_H */
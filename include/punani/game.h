@@ -25,8 +25,19 @@ int game_set_state(game_t g, unsigned int state);
 void game_exit(game_t g);
 
 /* time */
-void game_new_frame(game_t g);
-void game_render(game_t g, float lerp);
+void game_tick(game_t g, uint64_t time);
+void game_render(game_t g, uint64_t now, uint64_t step);
+
+/* Simulation thread. While threaded, input is queued up for the next
+ * game_tick() and mode changes are held back until it's turned off again.
+ * Ticks are made with the game locked.
+*/
+int game_can_thread(game_t g);
+void game_set_threaded(game_t g, int threaded);
+int game_exit_pending(game_t g);
+void game_exit_finish(game_t g);
+void game_lock(game_t g);
+void game_unlock(game_t g);
 
 /* input */
 void game_mousemove(game_t g, unsigned int x, unsigned int y,
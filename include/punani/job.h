@@ -0,0 +1,22 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_JOB_H
+#define _PUNANI_JOB_H
+
+/* Fork/join parallel for. The range [0, num) is cut in to chunks which
+ * the calling thread and the workers claim in increasing order, so any
+ * one worker sees its chunks in ascending order. worker is in the range
+ * [0, job_num_workers()) with the caller always being worker 0.
+*/
+typedef void (*job_fn_t)(void *priv, unsigned int begin,
+				unsigned int end, unsigned int worker);
+
+void job_init(void);
+void job_exit(void);
+unsigned int job_num_workers(void);
+unsigned int job_worker(void);
+void job_run(unsigned int num, unsigned int chunk, job_fn_t fn, void *priv);
+
+#endif /* _PUNANI_JOB_H */
@@ -9,11 +9,34 @@ typedef struct _map *map_t;
 
 map_t map_load(renderer_t r, const char *name);
 void map_get_size(map_t map, unsigned int *x, unsigned int *y);
+void map_page(map_t map, const vec3_t pos, const vec3_t move);
+void map_put_released(map_t map);
+void map_cull(map_t map, renderer_t r);
+int map_sphere_visible(map_t map, const vec3_t c, float r);
 void map_render(map_t map, renderer_t r, light_t l);
 int map_save(map_t map, const char *fn);
 int map_collide_line(map_t map, const vec3_t a, const vec3_t b, vec3_t hit);
 void map_free(map_t map);
 
+/* Paging, culling and map_put_released() lock the map themselves, anything
+ * which collides against it from another thread must hold the lock around
+ * it. Tiles paged out are only freed by map_put_released(), which must be
+ * called from the thread that owns the GL context.
+*/
+void map_lock(map_t map);
+void map_unlock(map_t map);
+
+struct map_line {
+	vec3_t a, b;
+};
+struct map_line_hit {
+	vec3_t hit;
+	float frac; /* along a->b, only valid if collided */
+	int collided;
+};
+unsigned int map_collide_lines(map_t map, const struct map_line *lines,
+				unsigned int num, struct map_line_hit *out);
+
 struct map_hit {
 	struct _asset *asset; /* mesh */
 	struct _tile *tile;
@@ -25,6 +48,7 @@ struct map_hit {
 typedef int (*map_cbfn_t)(const struct map_hit *hit, void *priv);
 int map_findradius(map_t map, const vec3_t c, float r,
 			map_cbfn_t cb, void *priv);
+void map_sweep_begin(map_t map);
 int map_sweep(map_t map, const struct obb *obb,
 			map_cbfn_t cb, void *priv);
 
@@ -7,6 +7,10 @@
 
 typedef struct _missile *missile_t;
 
-missile_t missile_spawn(const vec3_t origin, const vec3_t angles);
+missile_t missile_spawn(entity_t owner, const vec3_t origin,
+				const vec3_t angles);
+
+int missile_init(void);
+void missile_exit(void);
 
 #endif /* _PUNANI_MISSILE_H */
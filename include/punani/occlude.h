@@ -0,0 +1,20 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_OCCLUDE_H
+#define _PUNANI_OCCLUDE_H
+
+/* Low resolution software depth buffer for occlusion culling. Runs
+ * entirely on the CPU, the caller provides the modelview-projection.
+*/
+typedef struct _occlude *occlude_t;
+
+occlude_t occlude_new(unsigned int w, unsigned int h);
+void occlude_begin(occlude_t o, const mat4_t mvp);
+float occlude_distance(occlude_t o, const vec3_t p);
+void occlude_box(occlude_t o, const vec3_t mins, const vec3_t maxs);
+int occlude_test(occlude_t o, const vec3_t mins, const vec3_t maxs);
+void occlude_free(occlude_t o);
+
+#endif /* _PUNANI_OCCLUDE_H */
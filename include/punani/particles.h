@@ -7,17 +7,32 @@
 
 typedef struct _particles *particles_t;
 
-particles_t particles_new(unsigned int max);
-void particles_think(particles_t p);
+/* when the pool is full, particles are evicted from systems of equal or
+ * lower priority to make room
+*/
+#define PARTICLES_PRIO_LOW	0
+#define PARTICLES_PRIO_NORMAL	1
+#define PARTICLES_PRIO_HIGH	2
+#define PARTICLES_PRIO_MAX	PARTICLES_PRIO_HIGH
+
+particles_t particles_new(texture_t sprite, unsigned int prio);
 void particles_free(particles_t p);
 void particles_unref(particles_t p);
+unsigned int particles_count(particles_t p);
 
 void particles_emit(particles_t p, const vec3_t begin, const vec3_t end);
 
-void particles_render_all(renderer_t r, float lerp);
 void particles_think_all(void);
 void particles_free_all(void);
 
+/* copies of particle state for rendering on another thread to ticks */
+typedef struct _particles_snap *particles_snap_t;
+
+particles_snap_t particles_snap_new(void);
+void particles_snap(particles_snap_t s);
+void particles_snap_free(particles_snap_t s);
+void particles_render_all(particles_snap_t s, renderer_t r, float lerp);
+
 void particles_init(void);
 void particles_exit(void);
 
@@ -0,0 +1,19 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_PREFAB_H
+#define _PUNANI_PREFAB_H
+
+/* A prefab bundles the resources an entity type needs so that they are
+ * looked up once, when the prefab is first taken, rather than per spawn.
+ * Missiles only draw their trail, so there's no mesh yet.
+*/
+typedef struct _prefab *prefab_t;
+
+prefab_t prefab_get(const char *name);
+void prefab_put(prefab_t pf);
+
+texture_t prefab_sprite(prefab_t pf);
+
+#endif /* _PUNANI_PREFAB_H */
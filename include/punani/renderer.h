@@ -10,9 +10,9 @@
 typedef struct _renderer *renderer_t;
 
 #include <punani/tex.h>
-#include <punani/game.h>
 
-renderer_t renderer_new(game_t g);
+struct _game;
+renderer_t renderer_new(struct _game *g);
 
 /* get screen res */
 void renderer_size(renderer_t r, unsigned int *x, unsigned int *y);
@@ -28,6 +28,8 @@ float renderer_fps(renderer_t r);
 void renderer_clear_color(renderer_t x, float r, float g, float b);
 void renderer_rotate(renderer_t r, float deg, float x, float y, float z);
 void renderer_translate(renderer_t r, float x, float y, float z);
+void renderer_push_matrix(renderer_t r);
+void renderer_pop_matrix(renderer_t r);
 
 void renderer_render_2d(renderer_t r);
 void renderer_blit(renderer_t r, texture_t tex, prect_t *src, prect_t *dst);
@@ -42,6 +44,7 @@ void renderer_xlat_world_to_obj(renderer_t r, vec3_t out, const vec3_t in);
 void renderer_unproject(renderer_t r, vec3_t out,
 			unsigned int x, unsigned int y, float h);
 void renderer_get_frustum_quad(renderer_t r, float h, vec3_t q[4]);
+void renderer_get_mvp(renderer_t r, mat4_t mvp);
 
 void renderer_free(renderer_t r);
 
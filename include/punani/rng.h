@@ -0,0 +1,15 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_RNG_H
+#define _PUNANI_RNG_H
+
+/* The one random stream the game uses. It's seeded explicitly so that a
+ * recorded demo can put it back where it was.
+*/
+void rng_seed(uint32_t seed);
+uint32_t rng_get_seed(void);
+uint32_t rng_next(void);
+
+#endif /* _PUNANI_RNG_H */
@@ -12,6 +12,9 @@ void tile_render(tile_t t, renderer_t r, light_t l);
 void tile_render_bbox(tile_t t, renderer_t r);
 void tile_put(tile_t t);
 
+unsigned int tile_num_items(tile_t t);
+asset_t tile_item(tile_t t, unsigned int i, vec3_t origin);
+
 int tile_collide_line(tile_t t, const vec3_t a, const vec3_t b, vec3_t hit);
 
 struct tile_hit {
@@ -0,0 +1,11 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_TIMER_H
+#define _PUNANI_TIMER_H
+
+/* monotonic clock, in microseconds since an arbitrary epoch */
+uint64_t timer_usec(void);
+
+#endif /* _PUNANI_TIMER_H */
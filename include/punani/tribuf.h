@@ -0,0 +1,22 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_TRIBUF_H
+#define _PUNANI_TRIBUF_H
+
+/* Triple buffer for handing state from one thread to another. The writer
+ * fills tribuf_back() and publishes it, the reader picks up whatever was
+ * published last with tribuf_front(). Neither ever waits for the other,
+ * and neither sees a buffer the other is still using.
+*/
+typedef struct _tribuf *tribuf_t;
+
+tribuf_t tribuf_new(void *a, void *b, void *c);
+void *tribuf_back(tribuf_t t);
+void tribuf_publish(tribuf_t t);
+void *tribuf_front(tribuf_t t);
+void *tribuf_buf(tribuf_t t, unsigned int i);
+void tribuf_free(tribuf_t t);
+
+#endif /* _PUNANI_TRIBUF_H */
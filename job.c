@@ -0,0 +1,184 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/cvar.h>
+#include <punani/job.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define JOB_MAX_WORKERS	8
+
+struct job_batch {
+	job_fn_t fn;
+	void *priv;
+	unsigned int num;
+	unsigned int chunk;
+	unsigned int num_chunks;
+	unsigned int next;
+};
+
+static pthread_t threads[JOB_MAX_WORKERS];
+static unsigned int num_threads;
+static __thread unsigned int worker_id;
+
+/* Every worker takes part in every batch, even if there's nothing left
+ * to claim by the time it wakes, so the batch can't be replaced under a
+ * worker which is late to wake up.
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static struct job_batch cur;
+static unsigned int gen, done;
+static int quit;
+
+/* 0 means one less than the number of CPUs */
+static unsigned int var_threads;
+static cvar_ns_t cvars;
+
+static void work(unsigned int worker)
+{
+	unsigned int c;
+
+	while((c = __sync_fetch_and_add(&cur.next, 1)) < cur.num_chunks) {
+		unsigned int begin = c * cur.chunk;
+		unsigned int end = begin + cur.chunk;
+
+		if ( end > cur.num )
+			end = cur.num;
+		(*cur.fn)(cur.priv, begin, end, worker);
+	}
+}
+
+static void *worker_main(void *priv)
+{
+	unsigned int id = (unsigned int)(uintptr_t)priv;
+	unsigned int seen = 0;
+
+	worker_id = id;
+	pthread_mutex_lock(&lock);
+	for(;;) {
+		while(seen == gen && !quit)
+			pthread_cond_wait(&wake, &lock);
+		if ( quit )
+			break;
+		seen = gen;
+		pthread_mutex_unlock(&lock);
+
+		work(id);
+
+		pthread_mutex_lock(&lock);
+		if ( ++done == num_threads )
+			pthread_cond_signal(&idle);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+void job_run(unsigned int num, unsigned int chunk, job_fn_t fn, void *priv)
+{
+	unsigned int num_chunks;
+
+	if ( !num )
+		return;
+
+	assert(chunk);
+	num_chunks = (num + chunk - 1) / chunk;
+
+	/* not worth waking anyone up */
+	if ( !num_threads || num_chunks < 2 ) {
+		(*fn)(priv, 0, num, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	cur.fn = fn;
+	cur.priv = priv;
+	cur.num = num;
+	cur.chunk = chunk;
+	cur.num_chunks = num_chunks;
+	cur.next = 0;
+	done = 0;
+	gen++;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	work(0);
+
+	pthread_mutex_lock(&lock);
+	while(done < num_threads)
+		pthread_cond_wait(&idle, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned int job_num_workers(void)
+{
+	return num_threads + 1;
+}
+
+/* threads which aren't workers all count as worker 0 */
+unsigned int job_worker(void)
+{
+	return worker_id;
+}
+
+static unsigned int auto_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if ( n > 1 )
+		return n - 1;
+#endif
+	return 0;
+}
+
+void job_init(void)
+{
+	unsigned int i, want;
+
+	cvars = cvar_ns_new("job");
+	if ( cvars ) {
+		cvar_register_uint(cvars, "threads",
+					CVAR_FLAG_SAVE_NOTDEFAULT,
+					&var_threads);
+		cvar_ns_load(cvars);
+	}
+
+	want = (var_threads) ? var_threads : auto_threads();
+	if ( want > JOB_MAX_WORKERS )
+		want = JOB_MAX_WORKERS;
+
+	quit = 0;
+	for(i = 0; i < want; i++) {
+		if ( pthread_create(&threads[i], NULL, worker_main,
+					(void *)(uintptr_t)(i + 1)) ) {
+			con_printf("job: only started %u/%u threads\n",
+					i, want);
+			break;
+		}
+		num_threads++;
+	}
+}
+
+void job_exit(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	for(i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	num_threads = 0;
+
+	if ( NULL != cvars ) {
+		cvar_ns_save(cvars);
+		cvar_ns_free(cvars);
+		cvars = NULL;
+	}
+}
@@ -39,7 +39,7 @@ out:
 	return lobby;
 }
 
-static void render(void *priv, float lerp)
+static void render(void *priv, void *snap, float lerp)
 {
 	struct lobby *lobby = priv;
 	unsigned int x, y, sx, sy;
@@ -9,487 +9,2079 @@
 #include <punani/map.h>
 #include <punani/asset.h>
 #include <punani/tile.h>
-#include <punani/blob.h>
-#include <punani/punani_gl.h>
+#include <punani/cvar.h>
+#include <punani/occlude.h>
+#include <punani/job.h>
 
 #include "dessert-stroke.h"
 #include "mapfile.h"
+#include "simd.h"
 
+#include <float.h>
+#include <pthread.h>
+
+/* the visible volume between the ground and m_ceiling, flattened on to
+ * the XZ plane as a convex polygon. Something is inside the polygon when,
+ * for every edge, dot(n, p) <= d.
+*/
+#define MAP_HULL_MAX	8
+struct map_frustum {
+	vec3_t q[4];
+	float n[MAP_HULL_MAX][2];
+	float d[MAP_HULL_MAX];
+	unsigned int num_planes;
+	float mins[2];
+	float maxs[2];
+};
+
+/* results of tile classification */
+#define CULL_OUTSIDE	0
+#define CULL_PARTIAL	1
+#define CULL_INSIDE	2
+
+/* per-frame visible set, shared by all render passes */
+struct map_vis_item {
+	asset_t asset;
+	vec3_t origin;
+};
+
+struct map_vis_tile {
+	tile_t tile;
+	unsigned int x, y;
+	unsigned int first, num; /* range of m_vis_items */
+	int colliding; /* as of the last sweep */
+};
+
+/* occlusion buffer resolution and how many occluders to draw into it */
+#define MAP_OCCLUDE_X		256
+#define MAP_OCCLUDE_Y		144
+#define MAP_OCCLUDERS_MAX	64
+
+/* Quadtree over the map grid. Nodes hold the merged bounds of all items
+ * under them, so mins[Y] and maxs[Y] are the lowest and tallest building.
+ * Nodes with no items have mins > maxs. The tree is complete and stored
+ * implicitly, one array per level, with leaves covering blocks of
+ * MAP_LEAF_TILES x MAP_LEAF_TILES tiles.
+*/
+#define MAP_LEAF_SHIFT	2
+#define MAP_LEAF_TILES	(1U << MAP_LEAF_SHIFT)
+struct map_node {
+	float mins[3];
+	float maxs[3];
+};
+
+/* A chunk of the index grid, resident when r_data is set. It is kept
+ * encoded, as read from the file, and decoded in to the block cache on
+ * demand. Regions covered by a single tile skip the cache altogether. Tiles
+ * are only loaded while some resident region refers to them.
+*/
+struct map_region {
+	uint8_t *r_data;
+	unsigned int *r_colliding;
+	uint32_t r_len;
+	uint32_t r_type;
+	unsigned int r_stamp;
+	int r_uniform;
+	midx_t r_dominant;
+};
+
+/* direct mapped on the low bits of region coordinates, so any 4x4 group
+ * of neighbouring regions can be decoded at once. Each job worker has a
+ * cache of its own so that collision jobs never wait on each other.
+*/
+#define MAP_BLOCK_SHIFT	2
+#define MAP_BLOCK_MASK	((1U << MAP_BLOCK_SHIFT) - 1)
+#define MAP_BLOCK_CACHE	(1U << (2 * MAP_BLOCK_SHIFT))
+struct map_block {
+	const struct map_region *b_region;
+	midx_t *b_indices;
+};
+
+/* a tile crossed by one of the lines in a batch */
+struct map_line_cell {
+	unsigned int cell;
+	unsigned int line;
+};
+
+struct line;
+
+/* m_lock is held by the tick thread while paging and colliding and by the
+ * render thread while culling and putting released tiles.
+*/
 struct _map {
+	pthread_mutex_t m_lock;
 	asset_file_t m_assets;
-	midx_t *m_indices;
+	FILE *m_file;
+	char *m_names;
 	tile_t *m_tiles;
-	uint8_t *m_buf;
-	size_t m_sz;
-	int *m_colliding;
+	unsigned int *m_tile_ref;
+	uint8_t *m_tile_queued;
+	midx_t *m_released; /* unreferenced, waiting for map_put_released() */
+	unsigned int m_num_released;
+	unsigned int m_sweep_seq;
 	unsigned int m_num_tiles;
 	unsigned int m_width;
 	unsigned int m_height;
+
+	struct map_chunk *m_chunk_hdr;
+	struct map_region *m_regions;
+	unsigned int m_chunk;
+	unsigned int m_chunks_x;
+	unsigned int m_chunks_y;
+	unsigned int m_num_chunks;
+	unsigned int m_num_resident;
+	unsigned int m_tick;
+
+	struct map_block *m_blocks; /* MAP_BLOCK_CACHE per worker */
+	midx_t *m_block_buf;
+	unsigned int m_num_caches;
+
+	cvar_ns_t m_cvars;
+	unsigned int m_budget;
+	unsigned int m_prefetch;
+	unsigned int m_radius;
+	unsigned int m_lookahead;
+	float m_ceiling;
+	float m_overhang;
+
+	struct map_node *m_tile_bounds;
+	struct map_node **m_nodes;
+	struct map_node *m_node_buf;
+	unsigned int m_levels;
+
+	struct map_frustum m_frustum;
+	uint8_t *m_cull_row;
+	struct map_vis_item *m_vis_items;
+	struct map_vis_tile *m_vis_tiles;
+	unsigned int m_num_vis_items;
+	unsigned int m_max_vis_items;
+	unsigned int m_num_vis_tiles;
+	unsigned int m_max_vis_tiles;
+
+	/* items hidden from the camera, they may still cast shadows */
+	occlude_t m_occ;
+	struct map_vis_item *m_occ_items;
+	unsigned int m_num_occ_items;
+	unsigned int m_max_occ_items;
+	unsigned int m_occlude;
+	unsigned int m_occluders;
+	float m_occluder_height;
+	float m_occluder_shrink;
+
+	/* scratch space for map_collide_lines() */
+	struct line *m_lines;
+	struct map_line_cell *m_line_cells;
+	struct map_line_cell *m_line_sort;
+	unsigned int m_max_lines;
+	unsigned int m_num_line_cells;
+	unsigned int m_max_line_cells;
+};
+
+static int sphere_visible(const struct map_frustum *f, float x, float z,
+				float r)
+{
+	unsigned int i;
+
+	for(i = 0; i < f->num_planes; i++) {
+		if ( f->n[i][0] * x + f->n[i][1] * z - f->d[i] > r )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Separating axis test of a row of equal sized boxes against the hull. The
+ * box axes are taken care of by only looking at tiles in the hulls bounding
+ * box, which leaves the hull edges. Along each edge normal, the nearest and
+ * farthest box corners only depend on the signs of the normal, so for a row
+ * of boxes the only thing which varies is nx * x.
+*/
+static void classify_row(const struct map_frustum *f, float x, float y,
+				float stride, float w, float h,
+				unsigned int num, uint8_t *out)
+{
+	float lo[MAP_HULL_MAX], hi[MAP_HULL_MAX];
+	unsigned int i, p;
+
+	for(p = 0; p < f->num_planes; p++) {
+		float nx = f->n[p][0], nz = f->n[p][1];
+
+		lo[p] = nz * ((nz > 0) ? y : y + h) - f->d[p];
+		hi[p] = nz * ((nz > 0) ? y + h : y) - f->d[p];
+		if ( nx > 0 ) {
+			hi[p] += nx * w;
+		}else{
+			lo[p] += nx * w;
+		}
+	}
+
+	/* four boxes at a time, lanes past the end are thrown away */
+	for(i = 0; i < num; i += 4) {
+		v4_t vx, zero, outside, crossing;
+		unsigned int k;
+		int mo, mc;
+
+		vx = v4_set(x + i * stride, x + (i + 1) * stride,
+				x + (i + 2) * stride, x + (i + 3) * stride);
+		zero = v4_set1(0.0);
+		outside = zero;
+		crossing = zero;
+
+		for(p = 0; p < f->num_planes; p++) {
+			v4_t nx = v4_mul(v4_set1(f->n[p][0]), vx);
+			v4_t vlo = v4_add(nx, v4_set1(lo[p]));
+			v4_t vhi = v4_add(nx, v4_set1(hi[p]));
+			outside = v4_or(outside, v4_cmpgt(vlo, zero));
+			crossing = v4_or(crossing, v4_cmpgt(vhi, zero));
+		}
+
+		mo = v4_mask(outside);
+		mc = v4_mask(crossing);
+		for(k = 0; k < 4 && i + k < num; k++) {
+			if ( mo & (1 << k) )
+				out[i + k] = CULL_OUTSIDE;
+			else if ( mc & (1 << k) )
+				out[i + k] = CULL_PARTIAL;
+			else
+				out[i + k] = CULL_INSIDE;
+		}
+	}
+}
+
+static int node_empty(const struct map_node *n)
+{
+	return n->mins[0] > n->maxs[0];
+}
+
+static void node_clear(struct map_node *n)
+{
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		n->mins[i] = FLT_MAX;
+		n->maxs[i] = -FLT_MAX;
+	}
+}
+
+static void node_add(struct map_node *n, const struct map_node *b,
+			float x, float z)
+{
+	if ( node_empty(b) )
+		return;
+
+	n->mins[0] = f_min(n->mins[0], b->mins[0] + x);
+	n->mins[1] = f_min(n->mins[1], b->mins[1]);
+	n->mins[2] = f_min(n->mins[2], b->mins[2] + z);
+	n->maxs[0] = f_max(n->maxs[0], b->maxs[0] + x);
+	n->maxs[1] = f_max(n->maxs[1], b->maxs[1]);
+	n->maxs[2] = f_max(n->maxs[2], b->maxs[2] + z);
+}
+
+static int node_overlaps(const struct map_node *n,
+				const vec3_t mins, const vec3_t maxs)
+{
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		if ( n->mins[i] > maxs[i] || n->maxs[i] < mins[i] )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* slab test, returns fraction along a->b where the segment enters */
+static int node_segment(const struct map_node *n, const vec3_t a,
+			const vec3_t d, float *frac)
+{
+	float tmin = 0.0, tmax = 1.0;
+	unsigned int i;
+
+	/* inverted bounds would pass the slabs below */
+	if ( node_empty(n) )
+		return 0;
+
+	for(i = 0; i < 3; i++) {
+		float t1, t2, inv;
+
+		if ( d[i] == 0.0 ) {
+			if ( a[i] < n->mins[i] || a[i] > n->maxs[i] )
+				return 0;
+			continue;
+		}
+
+		inv = 1.0 / d[i];
+		t1 = (n->mins[i] - a[i]) * inv;
+		t2 = (n->maxs[i] - a[i]) * inv;
+		if ( t1 > t2 ) {
+			float tmp = t1;
+			t1 = t2;
+			t2 = tmp;
+		}
+
+		tmin = f_max(tmin, t1);
+		tmax = f_min(tmax, t2);
+		if ( tmin > tmax )
+			return 0;
+	}
+
+	*frac = tmin;
+	return 1;
+}
+
+static struct map_region *region_at(struct _map *m,
+					unsigned int x, unsigned int y)
+{
+	return &m->m_regions[(y / m->m_chunk) * m->m_chunks_x +
+				x / m->m_chunk];
+}
+
+static int chunk_decode(struct _map *m, uint32_t type,
+			const uint8_t *data, uint32_t len, midx_t *out)
+{
+	unsigned int i, n, num = m->m_chunk * m->m_chunk;
+	const struct map_patch *patch;
+	const struct map_run *run;
+	midx_t dom;
+
+	switch(type) {
+	case MAPCHUNK_RAW:
+		if ( len != num * sizeof(*out) )
+			return 0;
+		memcpy(out, data, len);
+		break;
+	case MAPCHUNK_RLE:
+		if ( len % sizeof(*run) )
+			return 0;
+		run = (const struct map_run *)data;
+		for(n = 0, i = 0; i < len / sizeof(*run); i++) {
+			unsigned int j;
+
+			if ( run[i].r_len > num - n )
+				return 0;
+			for(j = 0; j < run[i].r_len; j++)
+				out[n++] = run[i].r_idx;
+		}
+		if ( n != num )
+			return 0;
+		break;
+	case MAPCHUNK_SPARSE:
+		if ( len < sizeof(dom) || (len - sizeof(dom)) % sizeof(*patch) )
+			return 0;
+		memcpy(&dom, data, sizeof(dom));
+		for(i = 0; i < num; i++)
+			out[i] = dom;
+		patch = (const struct map_patch *)(data + sizeof(dom));
+		for(i = 0; i < (len - sizeof(dom)) / sizeof(*patch); i++) {
+			if ( patch[i].p_cell >= num )
+				return 0;
+			out[patch[i].p_cell] = patch[i].p_idx;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	for(i = 0; i < num; i++) {
+		if ( out[i] >= m->m_num_tiles )
+			return 0;
+	}
+
+	return 1;
+}
+
+static struct map_block *block_slot(struct _map *m,
+					unsigned int cx, unsigned int cy)
+{
+	unsigned int w = job_worker();
+
+	assert(w < m->m_num_caches);
+	return &m->m_blocks[w * MAP_BLOCK_CACHE + ((cx & MAP_BLOCK_MASK) |
+			((cy & MAP_BLOCK_MASK) << MAP_BLOCK_SHIFT))];
+}
+
+static midx_t *block_get(struct _map *m, unsigned int cx, unsigned int cy)
+{
+	const struct map_region *r = &m->m_regions[cy * m->m_chunks_x + cx];
+	struct map_block *b = block_slot(m, cx, cy);
+
+	if ( b->b_region != r ) {
+		/* already validated when paged in */
+		chunk_decode(m, r->r_type, r->r_data, r->r_len, b->b_indices);
+		b->b_region = r;
+	}
+
+	return b->b_indices;
+}
+
+static void block_invalidate(struct _map *m, const struct map_region *r)
+{
+	unsigned int i;
+
+	for(i = 0; i < m->m_num_caches * MAP_BLOCK_CACHE; i++) {
+		if ( m->m_blocks[i].b_region == r )
+			m->m_blocks[i].b_region = NULL;
+	}
+}
+
+/* only valid for tiles in resident regions */
+static midx_t index_at(struct _map *m, unsigned int x, unsigned int y)
+{
+	unsigned int cx = x / m->m_chunk, cy = y / m->m_chunk;
+	const struct map_region *r = &m->m_regions[cy * m->m_chunks_x + cx];
+
+	assert(r->r_data);
+	if ( r->r_uniform )
+		return r->r_dominant;
+
+	return block_get(m, cx, cy)[(y % m->m_chunk) * m->m_chunk +
+					x % m->m_chunk];
+}
+
+static unsigned int *colliding_at(struct _map *m,
+					unsigned int x, unsigned int y)
+{
+	struct map_region *r = region_at(m, x, y);
+
+	return &r->r_colliding[(y % m->m_chunk) * m->m_chunk +
+				x % m->m_chunk];
+}
+
+static tile_t tile_at(struct _map *m, unsigned int x, unsigned int y,
+			const struct map_node **bounds)
+{
+	midx_t idx = index_at(m, x, y);
+
+	if ( bounds )
+		*bounds = &m->m_tile_bounds[idx];
+	return m->m_tiles[idx];
+}
+
+/* range of tiles covered by a node, clipped to the map */
+static int node_tiles(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y,
+			unsigned int *x0, unsigned int *y0,
+			unsigned int *x1, unsigned int *y1)
+{
+	unsigned int shift = MAP_LEAF_SHIFT + (m->m_levels - 1 - l);
+
+	*x0 = x << shift;
+	*y0 = y << shift;
+	*x1 = r_min((x + 1) << shift, m->m_width);
+	*y1 = r_min((y + 1) << shift, m->m_height);
+	return (*x0 < *x1 && *y0 < *y1);
+}
+
+static struct map_vis_item *vis_item_new(struct _map *m)
+{
+	if ( m->m_num_vis_items >= m->m_max_vis_items ) {
+		struct map_vis_item *new;
+		unsigned int max;
+
+		max = (m->m_max_vis_items) ? m->m_max_vis_items * 2 : 256;
+		new = realloc(m->m_vis_items, max * sizeof(*new));
+		if ( NULL == new )
+			return NULL;
+
+		m->m_vis_items = new;
+		m->m_max_vis_items = max;
+	}
+
+	return &m->m_vis_items[m->m_num_vis_items++];
+}
+
+static struct map_vis_tile *vis_tile_new(struct _map *m)
+{
+	if ( m->m_num_vis_tiles >= m->m_max_vis_tiles ) {
+		struct map_vis_tile *new;
+		unsigned int max;
+
+		max = (m->m_max_vis_tiles) ? m->m_max_vis_tiles * 2 : 64;
+		new = realloc(m->m_vis_tiles, max * sizeof(*new));
+		if ( NULL == new )
+			return NULL;
+
+		m->m_vis_tiles = new;
+		m->m_max_vis_tiles = max;
+	}
+
+	return &m->m_vis_tiles[m->m_num_vis_tiles++];
+}
+
+static void cull_tile_at(struct _map *m, unsigned int tx, unsigned int ty,
+				int partial)
+{
+	struct map_vis_tile *vt;
+	unsigned int i, num;
+	float x, y;
+	tile_t t;
+
+	x = (float)tx * TILE_X;
+	y = (float)ty * TILE_Y;
+
+	t = tile_at(m, tx, ty, NULL);
+
+	vt = vis_tile_new(m);
+	if ( NULL == vt )
+		return;
+	vt->tile = t;
+	vt->x = tx;
+	vt->y = ty;
+	vt->first = m->m_num_vis_items;
+	vt->num = 0;
+	vt->colliding = (*colliding_at(m, tx, ty) == m->m_sweep_seq);
+
+	num = tile_num_items(t);
+	for(i = 0; i < num; i++) {
+		struct map_vis_item *vi;
+		vec3_t origin;
+		asset_t a;
+
+		a = tile_item(t, i, origin);
+		origin[0] += x;
+		origin[2] += y;
+
+		/* tile straddles the edge, check items individually */
+		if ( partial && !sphere_visible(&m->m_frustum,
+						origin[0], origin[2],
+						asset_radius(a)) )
+			continue;
+
+		vi = vis_item_new(m);
+		if ( NULL == vi )
+			return;
+
+		vi->asset = a;
+		v_copy(vi->origin, origin);
+		vt->num++;
+	}
+}
+
+static float cross2(const float *o, const float *a, const float *b)
+{
+	return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+}
+
+static int ptcmp(const void *A, const void *B)
+{
+	const float *a = A, *b = B;
+
+	if ( a[0] != b[0] )
+		return (a[0] < b[0]) ? -1 : 1;
+	if ( a[1] != b[1] )
+		return (a[1] < b[1]) ? -1 : 1;
+	return 0;
+}
+
+/* convex hull (monotone chain) of the ground and ceiling quads. Slices of
+ * the frustum at any height in between are contained within it.
+*/
+static void frustum_hull(struct map_frustum *f, vec3_t top[4])
+{
+	float pt[8][2], hull[16][2];
+	unsigned int i, k = 0, lower;
+
+	for(i = 0; i < 4; i++) {
+		pt[i][0] = f->q[i][X];
+		pt[i][1] = f->q[i][Z];
+		pt[i + 4][0] = top[i][X];
+		pt[i + 4][1] = top[i][Z];
+	}
+
+	qsort(pt, 8, sizeof(pt[0]), ptcmp);
+
+	for(i = 0; i < 8; i++) {
+		while(k >= 2 && cross2(hull[k - 2], hull[k - 1], pt[i]) <= 0)
+			k--;
+		memcpy(hull[k++], pt[i], sizeof(pt[i]));
+	}
+
+	for(lower = k + 1, i = 7; i-- > 0; ) {
+		while(k >= lower && cross2(hull[k - 2], hull[k - 1], pt[i]) <= 0)
+			k--;
+		memcpy(hull[k++], pt[i], sizeof(pt[i]));
+	}
+
+	/* last point is a repeat of the first */
+	k--;
+
+	f->mins[0] = f->maxs[0] = hull[0][0];
+	f->mins[1] = f->maxs[1] = hull[0][1];
+	f->num_planes = 0;
+	for(i = 0; i < k && i < MAP_HULL_MAX; i++) {
+		const float *a = hull[i], *b = hull[(i + 1) % k];
+		float ex, ez;
+
+		ex = b[0] - a[0];
+		ez = b[1] - a[1];
+
+		/* counter-clockwise, so outward normal is (ez, -ex) */
+		f->n[i][0] = ez;
+		f->n[i][1] = -ex;
+		f->d[i] = f->n[i][0] * a[0] + f->n[i][1] * a[1];
+		f->num_planes++;
+
+		f->mins[0] = f_min(f->mins[0], a[0]);
+		f->mins[1] = f_min(f->mins[1], a[1]);
+		f->maxs[0] = f_max(f->maxs[0], a[0]);
+		f->maxs[1] = f_max(f->maxs[1], a[1]);
+	}
+}
+
+static void get_frustum(renderer_t r, struct map_frustum *f, float ceil)
+{
+	vec3_t top[4];
+
+	renderer_get_frustum_quad(r, 0.0, f->q);
+	renderer_get_frustum_quad(r, ceil, top);
+	frustum_hull(f, top);
+}
+
+static void cull_leaf(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y, int inside)
+{
+	struct map_frustum *f = &m->m_frustum;
+	unsigned int x0, y0, x1, y1, i, j;
+	float ov = m->m_overhang;
+
+	if ( !node_tiles(m, l, x, y, &x0, &y0, &x1, &y1) )
+		return;
+
+	for(i = y0; i < y1; i++) {
+		if ( inside ) {
+			for(j = x0; j < x1; j++)
+				cull_tile_at(m, j, i, 0);
+			continue;
+		}
+
+		/* items may hang over the edges of their tile */
+		classify_row(f, x0 * TILE_X - ov, i * TILE_Y - ov,
+				TILE_X, TILE_X + 2 * ov, TILE_Y + 2 * ov,
+				x1 - x0, m->m_cull_row);
+		for(j = x0; j < x1; j++) {
+			switch(m->m_cull_row[j - x0]) {
+			case CULL_OUTSIDE:
+				break;
+			case CULL_PARTIAL:
+				cull_tile_at(m, j, i, 1);
+				break;
+			case CULL_INSIDE:
+				cull_tile_at(m, j, i, 0);
+				break;
+			}
+		}
+	}
+}
+
+static void cull_node(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y, int inside)
+{
+	const struct map_node *n = &m->m_nodes[l][(y << l) + x];
+	unsigned int i;
+
+	if ( node_empty(n) )
+		return;
+
+	if ( !inside ) {
+		uint8_t c;
+
+		classify_row(&m->m_frustum, n->mins[X], n->mins[Z], 0.0,
+				n->maxs[X] - n->mins[X],
+				n->maxs[Z] - n->mins[Z], 1, &c);
+		if ( c == CULL_OUTSIDE )
+			return;
+		inside = (c == CULL_INSIDE);
+	}
+
+	if ( l + 1 == m->m_levels ) {
+		cull_leaf(m, l, x, y, inside);
+		return;
+	}
+
+	for(i = 0; i < 4; i++)
+		cull_node(m, l + 1, (x << 1) + (i & 1), (y << 1) + (i >> 1),
+				inside);
+}
+
+static void item_bounds(const struct map_vis_item *vi,
+			vec3_t mins, vec3_t maxs)
+{
+	asset_mins(vi->asset, mins);
+	asset_maxs(vi->asset, maxs);
+	v_add(mins, mins, vi->origin);
+	v_add(maxs, maxs, vi->origin);
+}
+
+static int occ_item_add(struct _map *m, const struct map_vis_item *vi)
+{
+	if ( m->m_num_occ_items >= m->m_max_occ_items ) {
+		struct map_vis_item *new;
+		unsigned int max;
+
+		max = (m->m_max_occ_items) ? m->m_max_occ_items * 2 : 256;
+		new = realloc(m->m_occ_items, max * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+
+		m->m_occ_items = new;
+		m->m_max_occ_items = max;
+	}
+
+	m->m_occ_items[m->m_num_occ_items++] = *vi;
+	return 1;
+}
+
+/* Draw the nearest tall items in to the occlusion buffer. Boxes are shrunk
+ * towards the base so they stay inside the buildings they stand for.
+*/
+static void draw_occluders(struct _map *m)
+{
+	unsigned int cand[MAP_OCCLUDERS_MAX];
+	float dist[MAP_OCCLUDERS_MAX];
+	unsigned int i, j, num = 0, max;
+
+	max = r_min(m->m_occluders, MAP_OCCLUDERS_MAX);
+	for(i = 0; max && i < m->m_num_vis_items; i++) {
+		vec3_t mins, maxs, c;
+		float d;
+
+		item_bounds(&m->m_vis_items[i], mins, maxs);
+		if ( maxs[Y] - mins[Y] < m->m_occluder_height )
+			continue;
+
+		v_add(c, mins, maxs);
+		v_scale(c, 0.5);
+		d = occlude_distance(m->m_occ, c);
+
+		/* keep the nearest few, sorted */
+		for(j = num; j > 0 && dist[j - 1] > d; j--) {
+			if ( j < max ) {
+				dist[j] = dist[j - 1];
+				cand[j] = cand[j - 1];
+			}
+		}
+		if ( j < max ) {
+			dist[j] = d;
+			cand[j] = i;
+			if ( num < max )
+				num++;
+		}
+	}
+
+	for(i = 0; i < num; i++) {
+		float s = m->m_occluder_shrink;
+		vec3_t mins, maxs, d;
+
+		item_bounds(&m->m_vis_items[cand[i]], mins, maxs);
+		v_sub(d, maxs, mins);
+		mins[X] += d[X] * s;
+		mins[Z] += d[Z] * s;
+		maxs[X] -= d[X] * s;
+		maxs[Y] -= d[Y] * s;
+		maxs[Z] -= d[Z] * s;
+		occlude_box(m->m_occ, mins, maxs);
+	}
+}
+
+/* Move hidden items out of the visible set, whole tiles at a time where
+ * possible. Hidden tiles are dropped altogether.
+*/
+static void occlusion_cull(struct _map *m, renderer_t r)
+{
+	unsigned int i, j, num_items = 0, num_tiles = 0;
+	mat4_t mvp;
+
+	renderer_get_mvp(r, mvp);
+	occlude_begin(m->m_occ, mvp);
+	draw_occluders(m);
+
+	for(i = 0; i < m->m_num_vis_tiles; i++) {
+		struct map_vis_tile *vt = &m->m_vis_tiles[i];
+		const struct map_node *b;
+		struct map_node n;
+		int hidden;
+
+		tile_at(m, vt->x, vt->y, &b);
+		node_clear(&n);
+		node_add(&n, b, vt->x * TILE_X, vt->y * TILE_Y);
+		hidden = !node_empty(&n) &&
+			!occlude_test(m->m_occ, n.mins, n.maxs);
+
+		for(j = vt->first; j < vt->first + vt->num; j++) {
+			struct map_vis_item *vi = &m->m_vis_items[j];
+			vec3_t mins, maxs;
+
+			if ( !hidden ) {
+				item_bounds(vi, mins, maxs);
+				if ( occlude_test(m->m_occ, mins, maxs) ) {
+					m->m_vis_items[num_items++] = *vi;
+					continue;
+				}
+			}
+
+			/* out of memory, it'll just have to be drawn */
+			if ( !occ_item_add(m, vi) )
+				m->m_vis_items[num_items++] = *vi;
+		}
+
+		if ( !hidden )
+			m->m_vis_tiles[num_tiles++] = *vt;
+	}
+
+	m->m_num_vis_items = num_items;
+	m->m_num_vis_tiles = num_tiles;
+}
+
+void map_lock(map_t m)
+{
+	pthread_mutex_lock(&m->m_lock);
+}
+
+void map_unlock(map_t m)
+{
+	pthread_mutex_unlock(&m->m_lock);
+}
+
+/* Build the visible set for the current frame. This is done once, up front,
+ * so that the unlit, shadow and lit passes can all share the results.
+*/
+void map_cull(map_t m, renderer_t r)
+{
+	map_lock(m);
+	m->m_num_vis_items = 0;
+	m->m_num_vis_tiles = 0;
+	m->m_num_occ_items = 0;
+
+	get_frustum(r, &m->m_frustum, m->m_ceiling);
+	cull_node(m, 0, 0, 0, 0);
+
+	if ( m->m_occlude )
+		occlusion_cull(m, r);
+	map_unlock(m);
+}
+
+/* conservative test against the visible volume, used for entities */
+int map_sphere_visible(map_t m, const vec3_t c, float r)
+{
+	/* above anything we bothered to bound */
+	if ( c[Y] - r > m->m_ceiling )
+		return 1;
+
+	return sphere_visible(&m->m_frustum, c[X], c[Z], r);
+}
+
+static void render_items(map_t m, renderer_t r, light_t l,
+				const struct map_vis_item *vi,
+				unsigned int num)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++, vi++) {
+		renderer_push_matrix(r);
+		renderer_translate(r, vi->origin[0],
+				vi->origin[1], vi->origin[2]);
+		asset_render(vi->asset, r, l);
+		renderer_pop_matrix(r);
+	}
+}
+
+static void render_map(map_t m, renderer_t r, light_t l)
+{
+	unsigned int i;
+
+	asset_file_render_begin(m->m_assets, r, l);
+	render_items(m, r, l, m->m_vis_items, m->m_num_vis_items);
+
+	/* shadows of hidden items can still fall in to view */
+	if ( l )
+		render_items(m, r, l, m->m_occ_items, m->m_num_occ_items);
+
+	for(i = 0; i < m->m_num_vis_tiles; i++) {
+		struct map_vis_tile *vt = &m->m_vis_tiles[i];
+
+		if ( !vt->colliding )
+			continue;
+
+		renderer_push_matrix(r);
+		renderer_translate(r, vt->x * TILE_X, 0.0, vt->y * TILE_Y);
+		tile_render_bbox(vt->tile, r);
+		renderer_pop_matrix(r);
+	}
+	asset_file_render_end(m->m_assets);
+
+#if 0
+	/* Draw the clip field */
+	renderer_wireframe(r, 1);
+	glColor4f(1.0, 0.0, 0.0, 1.0);
+	glEnable(GL_CULL_FACE);
+	glBegin(GL_QUADS);
+	for(i = 0; i < 4; i++) {
+		glVertex3f(m->m_frustum.q[i][0], 0, m->m_frustum.q[i][2]);
+	}
+	glEnd();
+	renderer_wireframe(r, 0);
+#endif
+}
+
+typedef void (*line_fn_t)(struct _map *m, int x, int y, struct line *line);
+
+struct line {
+	const float *a, *b;
+	vec3_t d;
+	vec3_t hit;
+	float len2;
+	float frac;
+	int ret;
+	line_fn_t fn;
+	unsigned int idx;
+};
+
+static void line_init(struct line *line, const vec3_t a, const vec3_t b,
+			line_fn_t fn)
+{
+	line->a = a;
+	line->b = b;
+	v_sub(line->d, b, a);
+	line->len2 = v_dot_product(line->d, line->d);
+	line->ret = 0;
+	line->fn = fn;
+}
+
+static void line_test(tile_t t, const struct map_node *bounds,
+			int x, int y, struct line *line)
+{
+	vec3_t start, end, h;
+	float frac;
+
+	/* translate the line segment in to tile space */
+	v_copy(start, line->a);
+	v_copy(end, line->b);
+	start[0] -= TILE_X * x;
+	start[2] -= TILE_Y * y;
+	end[0] -= TILE_X * x;
+	end[2] -= TILE_Y * y;
+
+	if ( !node_segment(bounds, start, line->d, &frac) )
+		return;
+	if ( line->ret && frac > line->frac )
+		return;
+
+	if ( !tile_collide_line(t, start, end, h) )
+		return;
+
+	/* tile_collide_line gives the nearest hit in this tile */
+	v_sub(h, h, start);
+	frac = (line->len2 > 0.0) ?
+		v_dot_product(h, line->d) / line->len2 : 0.0;
+	if ( !line->ret || frac < line->frac ) {
+		v_add(line->hit, h, line->a);
+		line->frac = frac;
+		line->ret = 1;
+	}
+}
+
+static void line_tile(struct _map *m, int x, int y, struct line *line)
+{
+	const struct map_node *bounds;
+	tile_t t;
+
+	t = tile_at(m, x, y, &bounds);
+	line_test(t, bounds, x, y, line);
+}
+
+/* tiles within k of (x, y) which were not near the previous cell */
+static void line_cell(struct _map *m, int x, int y, int px, int py, int k,
+			struct line *line)
+{
+	int i, j;
+
+	for(i = y - k; i <= y + k; i++) {
+		for(j = x - k; j <= x + k; j++) {
+			if ( abs(j - px) <= k && abs(i - py) <= k )
+				continue;
+			if ( j < 0 || i < 0 ||
+					(unsigned int)j >= m->m_width ||
+					(unsigned int)i >= m->m_height )
+				continue;
+			if ( NULL == region_at(m, j, i)->r_data )
+				continue;
+			(*line->fn)(m, j, i, line);
+		}
+	}
+}
+
+/* clip [*t0, *t1] to the slab lo <= a + d * t <= hi */
+static int line_clip(float a, float d, float lo, float hi,
+			float *t0, float *t1)
+{
+	float u0, u1;
+
+	if ( d == 0.0 )
+		return (a >= lo && a <= hi);
+
+	u0 = (lo - a) / d;
+	u1 = (hi - a) / d;
+	if ( u0 > u1 ) {
+		float tmp = u0;
+		u0 = u1;
+		u1 = tmp;
+	}
+
+	*t0 = f_max(*t0, u0);
+	*t1 = f_min(*t1, u1);
+	return (*t0 <= *t1);
+}
+
+/* set up one axis of the grid walk */
+static void line_axis(float a, float d, float size, int cell,
+			int *step, float *tmax, float *tdelta)
+{
+	if ( d > 0.0 ) {
+		*step = 1;
+		*tmax = ((cell + 1) * size - a) / d;
+		*tdelta = size / d;
+	}else if ( d < 0.0 ) {
+		*step = -1;
+		*tmax = (cell * size - a) / d;
+		*tdelta = -size / d;
+	}else{
+		*step = 0;
+		*tmax = FLT_MAX;
+		*tdelta = FLT_MAX;
+	}
+}
+
+/* Amanatides-Woo walk over the tile grid, visiting cells in the order the
+ * segment crosses them. Items may overhang their tile by up to
+ * m_overhang so each cell also checks its neighbours out to k tiles.
+*/
+static void line_walk(struct _map *m, struct line *line)
+{
+	float t0, t1, tmax_x, tmax_y, tdelta_x, tdelta_y;
+	int k, x, y, px, py, step_x, step_y, w, h;
+	const float *a = line->a;
+
+	/* misses everything resident */
+	if ( !node_segment(&m->m_nodes[0][0], a, line->d, &t0) )
+		return;
+
+	k = ceil(m->m_overhang / f_min(TILE_X, TILE_Y));
+	w = m->m_width;
+	h = m->m_height;
+
+	t1 = 1.0;
+	if ( !line_clip(a[X], line->d[X], -k * TILE_X, (w + k) * TILE_X,
+			&t0, &t1) )
+		return;
+	if ( !line_clip(a[Z], line->d[Z], -k * TILE_Y, (h + k) * TILE_Y,
+			&t0, &t1) )
+		return;
+
+	x = r_clamp(floor((a[X] + line->d[X] * t0) / TILE_X), -k, w + k - 1);
+	y = r_clamp(floor((a[Z] + line->d[Z] * t0) / TILE_Y), -k, h + k - 1);
+	line_axis(a[X], line->d[X], TILE_X, x, &step_x, &tmax_x, &tdelta_x);
+	line_axis(a[Z], line->d[Z], TILE_Y, y, &step_y, &tmax_y, &tdelta_y);
+
+	/* pretend the previous cell was too far away to matter */
+	px = x - (2 * k + 1);
+	py = y;
+
+	for(;;) {
+		float next;
+
+		line_cell(m, x, y, px, py, k, line);
+
+		/* anything left to find lies beyond this cell */
+		next = f_min(tmax_x, tmax_y);
+		if ( line->ret && line->frac <= next )
+			break;
+		if ( next > t1 )
+			break;
+
+		px = x;
+		py = y;
+		if ( tmax_x < tmax_y ) {
+			x += step_x;
+			tmax_x += tdelta_x;
+		}else{
+			y += step_y;
+			tmax_y += tdelta_y;
+		}
+	}
+}
+
+int map_collide_line(map_t m, const vec3_t a, const vec3_t b, vec3_t hit)
+{
+	struct line line;
+
+	line_init(&line, a, b, line_tile);
+	line_walk(m, &line);
+	if ( line.ret )
+		v_copy(hit, line.hit);
+
+	return line.ret;
+}
+
+/* note that the line crosses this tile, it gets tested later */
+static void line_defer(struct _map *m, int x, int y, struct line *line)
+{
+	const struct map_node *bounds;
+	struct map_line_cell *c;
+	vec3_t start;
+	float frac;
+
+	/* cheap rejection against the tile bounds first */
+	tile_at(m, x, y, &bounds);
+	v_copy(start, line->a);
+	start[0] -= TILE_X * x;
+	start[2] -= TILE_Y * y;
+	if ( !node_segment(bounds, start, line->d, &frac) )
+		return;
+
+	if ( m->m_num_line_cells >= m->m_max_line_cells ) {
+		struct map_line_cell *new;
+		unsigned int max;
+
+		max = (m->m_max_line_cells) ? m->m_max_line_cells * 2 : 256;
+		new = realloc(m->m_line_sort, max * sizeof(*new));
+		if ( NULL == new )
+			goto now;
+		m->m_line_sort = new;
+
+		new = realloc(m->m_line_cells, max * sizeof(*new));
+		if ( NULL == new )
+			goto now;
+		m->m_line_cells = new;
+
+		m->m_max_line_cells = max;
+	}
+
+	c = &m->m_line_cells[m->m_num_line_cells++];
+	c->cell = y * m->m_width + x;
+	c->line = line->idx;
+	return;
+
+now:
+	/* test it right now instead */
+	line_tile(m, x, y, line);
+}
+
+/* stable radix sort by cell, lines stay in order within each cell */
+static void line_sort(struct _map *m)
+{
+	unsigned int i, shift, bits = 0;
+
+	for(i = 0; i < m->m_num_line_cells; i++)
+		bits |= m->m_line_cells[i].cell;
+
+	for(shift = 0; shift < 32 && (bits >> shift); shift += 8) {
+		unsigned int count[256], sum = 0;
+		struct map_line_cell *tmp;
+
+		memset(count, 0, sizeof(count));
+		for(i = 0; i < m->m_num_line_cells; i++)
+			count[(m->m_line_cells[i].cell >> shift) & 0xff]++;
+
+		for(i = 0; i < 256; i++) {
+			unsigned int n = count[i];
+			count[i] = sum;
+			sum += n;
+		}
+
+		for(i = 0; i < m->m_num_line_cells; i++) {
+			const struct map_line_cell *c = &m->m_line_cells[i];
+			m->m_line_sort[count[(c->cell >> shift) & 0xff]++] = *c;
+		}
+
+		tmp = m->m_line_cells;
+		m->m_line_cells = m->m_line_sort;
+		m->m_line_sort = tmp;
+	}
+}
+
+static int line_scratch(struct _map *m, unsigned int num)
+{
+	struct line *new;
+
+	if ( num <= m->m_max_lines )
+		return 1;
+
+	new = realloc(m->m_lines, num * sizeof(*new));
+	if ( NULL == new )
+		return 0;
+
+	m->m_lines = new;
+	m->m_max_lines = num;
+	return 1;
+}
+
+/* Collect every (tile, line) pair up front then sort by tile, so each
+ * tile is fetched once and tested against all of the lines crossing it
+ * while its items are still in cache.
+*/
+unsigned int map_collide_lines(map_t m, const struct map_line *lines,
+				unsigned int num, struct map_line_hit *out)
+{
+	unsigned int i, j, ret = 0;
+
+	if ( !line_scratch(m, num) ) {
+		for(i = 0; i < num; i++) {
+			out[i].collided = map_collide_line(m, lines[i].a,
+							lines[i].b,
+							out[i].hit);
+			ret += !!out[i].collided;
+		}
+		return ret;
+	}
+
+	m->m_num_line_cells = 0;
+	for(i = 0; i < num; i++) {
+		line_init(&m->m_lines[i], lines[i].a, lines[i].b, line_defer);
+		m->m_lines[i].idx = i;
+		line_walk(m, &m->m_lines[i]);
+	}
+
+	line_sort(m);
+
+	for(i = 0; i < m->m_num_line_cells; i = j) {
+		unsigned int cell = m->m_line_cells[i].cell;
+		unsigned int x = cell % m->m_width, y = cell / m->m_width;
+		const struct map_node *bounds;
+		tile_t t;
+
+		t = tile_at(m, x, y, &bounds);
+		for(j = i; j < m->m_num_line_cells &&
+				m->m_line_cells[j].cell == cell; j++) {
+			line_test(t, bounds, x, y,
+				&m->m_lines[m->m_line_cells[j].line]);
+		}
+	}
+
+	for(i = 0; i < num; i++) {
+		const struct line *line = &m->m_lines[i];
+
+		out[i].collided = line->ret;
+		if ( !line->ret )
+			continue;
+
+		v_copy(out[i].hit, line->hit);
+		out[i].frac = line->frac;
+		ret++;
+	}
+
+	return ret;
+}
+
+struct shim {
+	map_cbfn_t cb;
+	map_t m;
+	void *priv;
+	tile_t tile;
+	int x, y;
 };
 
-struct map_frustum {
-	vec3_t q[4];
-	float mins[2];
-	float maxs[2];
+static int tcb(const struct tile_hit *hit, void *priv)
+{
+	struct shim *shim = priv;
+	struct map_hit h;
+
+	h.asset = hit->asset;
+	h.tile = shim->tile;
+	v_copy(h.origin, hit->origin);
+	memcpy(h.times, hit->times, sizeof(h.times));
+	h.origin[0] += TILE_X * shim->x;
+	h.origin[2] += TILE_Y * shim->y;
+	h.map_x = shim->x;
+	h.map_y = shim->y;
+	h.tile_idx = hit->index;
+
+	*colliding_at(shim->m, shim->x, shim->y) = shim->m->m_sweep_seq;
+
+	return (*shim->cb)(&h, shim->priv);
+}
+
+/* called for each tile whose items overlap the query box */
+typedef int (*box_fn_t)(struct _map *m, tile_t t,
+			unsigned int x, unsigned int y, void *priv);
+
+struct box {
+	vec3_t mins;
+	vec3_t maxs;
+	box_fn_t fn;
+	void *priv;
 };
 
-static int point_inside(struct map_frustum *f, vec3_t p)
+static int box_leaf(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y, struct box *box)
 {
-	vec3_t c, a, b;
-	unsigned int i;
+	unsigned int x0, y0, x1, y1, i, j;
 
-	for(i = 0; i < 4; i++) {
-		v_sub(a, f->q[i], f->q[(i + 1) % 4]);
-		v_sub(b, p, f->q[(i + 1) % 4]);
+	if ( !node_tiles(m, l, x, y, &x0, &y0, &x1, &y1) )
+		return 1;
 
-		v_cross_product(c, a, b);
-		if ( c[Y] > 0 )
-			return 0;
+	for(i = y0; i < y1; i++) {
+		for(j = x0; j < x1; j++) {
+			const struct map_node *bounds;
+			struct map_node n;
+			tile_t t;
+
+			t = tile_at(m, j, i, &bounds);
+			node_clear(&n);
+			node_add(&n, bounds, j * TILE_X, i * TILE_Y);
+			if ( !node_overlaps(&n, box->mins, box->maxs) )
+				continue;
+
+			if ( !(*box->fn)(m, t, j, i, box->priv) )
+				return 0;
+		}
 	}
 
 	return 1;
 }
 
-static int corners_inside(struct map_frustum *f, vec3_t *p)
+static int box_node(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y, struct box *box)
 {
+	const struct map_node *n = &m->m_nodes[l][(y << l) + x];
 	unsigned int i;
 
+	if ( !node_overlaps(n, box->mins, box->maxs) )
+		return 1;
+
+	if ( l + 1 == m->m_levels )
+		return box_leaf(m, l, x, y, box);
+
 	for(i = 0; i < 4; i++) {
-		if ( point_inside(f, p[i]) )
-			return 1;
+		if ( !box_node(m, l + 1, (x << 1) + (i & 1),
+				(y << 1) + (i >> 1), box) )
+			return 0;
 	}
 
-	return 0;
+	return 1;
 }
 
-static int line_intersects(float x1, float y1, float x2, float y2,
-				float x3, float y3, float x4, float y4)
+struct radius {
+	struct shim shim;
+	const float *c;
+	float r;
+};
+
+static int radius_tile(struct _map *m, tile_t t,
+			unsigned int x, unsigned int y, void *priv)
 {
-	float d;
+	struct radius *rad = priv;
+	vec3_t c2;
+
+	/* translate the sphere in to tile space */
+	v_copy(c2, rad->c);
+	c2[0] -= TILE_X * x;
+	c2[2] -= TILE_Y * y;
+
+	rad->shim.tile = t;
+	rad->shim.x = x;
+	rad->shim.y = y;
+	return tile_collide_sphere(t, c2, rad->r, tcb, &rad->shim);
+}
 
-	d = (x1 - x2) * (y3 - y4) - (y1 - y2) * (x3 - x4);
-	if ( d == 0.0 )
-		return 0;
+int map_findradius(map_t m, const vec3_t c, float r,
+			map_cbfn_t cb, void *priv)
+{
+	struct radius rad;
+	struct box box;
+	unsigned int i;
 
-	return 1;
+	for(i = 0; i < 3; i++) {
+		box.mins[i] = c[i] - r;
+		box.maxs[i] = c[i] + r;
+	}
+	box.fn = radius_tile;
+	box.priv = &rad;
+
+	rad.shim.m = m;
+	rad.shim.cb = cb;
+	rad.shim.priv = priv;
+	rad.c = c;
+	rad.r = r;
+
+	return box_node(m, 0, 0, 0, &box);
 }
 
-static int lines_intersect(struct map_frustum *f, vec3_t *p)
+struct sweep {
+	struct shim shim;
+	const struct obb *obb;
+};
+
+static int sweep_tile(struct _map *m, tile_t t,
+			unsigned int x, unsigned int y, void *priv)
 {
-	unsigned int i, j;
-	float x1, x2, x3, x4;
-	float y1, y2, y3, y4;
+	struct sweep *sw = priv;
+	struct obb obb;
+	vec3_t off;
+
+	off[0] = x * TILE_X;
+	off[1] = 0.0;
+	off[2] = y * TILE_Y;
+	memcpy(&obb, sw->obb, sizeof(obb));
+	v_sub(obb.origin, obb.origin, off);
+
+	sw->shim.tile = t;
+	sw->shim.x = x;
+	sw->shim.y = y;
+	return tile_sweep(t, &obb, tcb, &sw->shim);
+}
 
-	for(i = 0; i < 4; i++) {
-		for(j = 0; j < 4; i++) {
-			x1 = f->q[i][X];
-			y1 = f->q[i][Z];
-			x2 = f->q[(i + 1) % 4][X];
-			y2 = f->q[(i + 1) % 4][Z];
-			x3 = p[i][X];
-			y3 = p[i][Z];
-			x4 = p[(i + 1) % 4][X];
-			y4 = p[(i + 1) % 4][Z];
-			if ( line_intersects(x1, y1, x2, y2, x3, y3, x4, y4) )
-				return 1;
-		}
+/* Invalidates the colliding tiles marked by previous sweeps. Sweeps
+ * only read the map otherwise, and concurrent sweeps all mark tiles
+ * with the same sequence number, so they may run in parallel between
+ * calls to this.
+*/
+void map_sweep_begin(map_t m)
+{
+	m->m_sweep_seq++;
+}
+
+int map_sweep(map_t m, const struct obb *sweep,
+			map_cbfn_t cb, void *priv)
+{
+	struct sweep sw;
+	struct box box;
+	unsigned int i;
+
+	/* bounds of the box over the whole of its move */
+	obb_build_aabb(sweep, box.mins, box.maxs);
+	for(i = 0; i < 3; i++) {
+		if ( sweep->vel[i] < 0 )
+			box.mins[i] += sweep->vel[i];
+		else
+			box.maxs[i] += sweep->vel[i];
 	}
+	box.fn = sweep_tile;
+	box.priv = &sw;
 
+	sw.shim.m = m;
+	sw.shim.cb = cb;
+	sw.shim.priv = priv;
+	sw.obb = sweep;
+
+	box_node(m, 0, 0, 0, &box);
 	return 0;
 }
 
-static int visible(struct map_frustum *f, float x1, float x2,
-					float y1, float y2)
+void map_render(map_t m, renderer_t r, light_t l)
+{
+	render_map(m, r, l);
+}
+
+void map_get_size(map_t m, unsigned int *x, unsigned int *y)
+{
+	if ( x )
+		*x = m->m_width;
+	if ( y )
+		*y = m->m_height;
+}
+
+/* merged bounds of the items in a tile, in tile space */
+static void tile_bounds(tile_t t, struct map_node *n)
+{
+	unsigned int i, num;
+
+	node_clear(n);
+
+	num = tile_num_items(t);
+	for(i = 0; i < num; i++) {
+		struct map_node b;
+		vec3_t origin;
+		asset_t a;
+
+		a = tile_item(t, i, origin);
+		asset_mins(a, b.mins);
+		asset_maxs(a, b.maxs);
+		v_add(b.mins, b.mins, origin);
+		v_add(b.maxs, b.maxs, origin);
+		node_add(n, &b, 0.0, 0.0);
+	}
+}
+
+static int build_tree(struct _map *m)
 {
-	vec3_t p[4];
+	unsigned int dim, num, l, i;
+	struct map_node *n;
 
-	p[0][X] = x1;
-	p[0][Y] = 0.0;
-	p[0][Z] = y1;
+	for(m->m_levels = 1, dim = MAP_LEAF_TILES;
+			dim < m->m_width || dim < m->m_height; dim <<= 1)
+		m->m_levels++;
 
-	p[1][X] = x1;
-	p[1][Y] = 0.0;
-	p[1][Z] = y2;
+	for(num = 0, l = 0; l < m->m_levels; l++)
+		num += 1U << (2 * l);
 
-	p[2][X] = x2;
-	p[2][Y] = 0.0;
-	p[2][Z] = y2;
+	m->m_nodes = calloc(m->m_levels, sizeof(*m->m_nodes));
+	if ( NULL == m->m_nodes )
+		return 0;
 
-	p[3][X] = x2;
-	p[3][Y] = 0.0;
-	p[3][Z] = y1;
+	m->m_node_buf = malloc(num * sizeof(*m->m_node_buf));
+	if ( NULL == m->m_node_buf ) {
+		free(m->m_nodes);
+		return 0;
+	}
 
-	if ( !corners_inside(f, p) ) {
-		return lines_intersect(f, p);
+	for(n = m->m_node_buf, l = 0; l < m->m_levels; l++) {
+		m->m_nodes[l] = n;
+		n += 1U << (2 * l);
 	}
 
+	/* nothing is resident yet */
+	for(i = 0; i < num; i++)
+		node_clear(&m->m_node_buf[i]);
+
 	return 1;
 }
 
-static void render_tile_at(tile_t t, float x, float y,
-				renderer_t r, light_t l,
-				struct map_frustum *f, int colliding)
+static void leaf_refit(struct _map *m, unsigned int x, unsigned int y)
 {
-	if ( !visible(f, x, x + TILE_X, y, y + TILE_Y) ) {
+	unsigned int l = m->m_levels - 1;
+	unsigned int x0, y0, x1, y1, i, j;
+	struct map_node *n;
+
+	n = &m->m_nodes[l][(y << l) + x];
+	node_clear(n);
+	if ( !node_tiles(m, l, x, y, &x0, &y0, &x1, &y1) )
+		return;
+
+	/* leaves never straddle regions */
+	if ( NULL == region_at(m, x0, y0)->r_data )
 		return;
+
+	for(i = y0; i < y1; i++) {
+		for(j = x0; j < x1; j++) {
+			const struct map_node *b;
+			tile_at(m, j, i, &b);
+			node_add(n, b, j * TILE_X, i * TILE_Y);
+		}
 	}
-	glPushMatrix();
-	renderer_translate(r, x, 0.0, y);
-	tile_render(t, r, l);
-	if ( colliding )
-		tile_render_bbox(t, r);
-	glPopMatrix();
 }
 
-static void get_frustum_bbox(renderer_t r, struct map_frustum *f)
+static void node_refit(struct _map *m, unsigned int l,
+			unsigned int x, unsigned int y)
 {
+	struct map_node *n = &m->m_nodes[l][(y << l) + x];
 	unsigned int i;
 
-	renderer_get_frustum_quad(r, 0.0, f->q);
-
-	f->mins[0] = f->mins[1] = 1000.0;
-	f->maxs[0] = f->maxs[1] = -1000.0;
+	node_clear(n);
 	for(i = 0; i < 4; i++) {
-		if ( f->q[i][X] < f->mins[X] )
-			f->mins[X] = f->q[i][X];
-		if ( f->q[i][X] > f->maxs[X] )
-			f->maxs[X] = f->q[i][X];
-		if ( f->q[i][Z] < f->mins[Y] )
-			f->mins[Y] = f->q[i][Z];
-		if ( f->q[i][Z] > f->maxs[Y] )
-			f->maxs[Y] = f->q[i][Z];
+		unsigned int cx, cy;
+		cx = (x << 1) + (i & 1);
+		cy = (y << 1) + (i >> 1);
+		node_add(n, &m->m_nodes[l + 1][(cy << (l + 1)) + cx],
+				0.0, 0.0);
 	}
 }
 
-static void render_map(map_t m, renderer_t r, light_t l)
+/* update the tree after a region has been paged in or out */
+static void region_refit(struct _map *m, unsigned int cx, unsigned int cy)
 {
-	struct map_frustum f;
-	int i, j;
-	int xa, xb, ya, yb;
-
-	get_frustum_bbox(r, &f);
-
-	ya = floor(f.mins[Y] / TILE_Y);
-	yb = ceil(f.maxs[Y] / TILE_Y);
-	xa = floor(f.mins[X] / TILE_X);
-	xb = ceil(f.maxs[X] / TILE_X);
+	unsigned int per = m->m_chunk >> MAP_LEAF_SHIFT;
+	unsigned int l = m->m_levels - 1;
+	unsigned int x0, y0, x1, y1, x, y;
+
+	x0 = cx * per;
+	y0 = cy * per;
+	x1 = r_min(x0 + per, 1U << l);
+	y1 = r_min(y0 + per, 1U << l);
+
+	for(y = y0; y < y1; y++)
+		for(x = x0; x < x1; x++)
+			leaf_refit(m, x, y);
+
+	while(l--) {
+		x0 >>= 1;
+		y0 >>= 1;
+		x1 = ((x1 - 1) >> 1) + 1;
+		y1 = ((y1 - 1) >> 1) + 1;
+		for(y = y0; y < y1; y++)
+			for(x = x0; x < x1; x++)
+				node_refit(m, l, x, y);
+	}
+}
 
-	if ( xa < 0 )
-		xa = 0;
-	if ( ya < 0 )
-		ya = 0;
-	if ( xb > (int)m->m_width )
-		xb = m->m_width;
-	if ( yb > (int)m->m_height )
-		yb = m->m_height;
+static int tile_ref(struct _map *m, midx_t idx)
+{
+	struct map_node *b = &m->m_tile_bounds[idx];
 
-	asset_file_render_begin(m->m_assets, r, l);
-	for(i = ya; i < yb; i++) {
-		for(j = xa; j < xb; j++) {
-			float x, y;
-			tile_t t;
+	if ( m->m_tile_ref[idx]++ )
+		return 1;
 
-			x = (float)j * TILE_X;
-			y = (float)i * TILE_Y;
+	/* released but not put yet, so it's still good */
+	if ( m->m_tiles[idx] )
+		return 1;
 
-			t = m->m_tiles[m->m_indices[i * m->m_width + j]];
-			render_tile_at(t, x, y, r, l, &f,
-					m->m_colliding[i * m->m_width + j]);
-		}
+	m->m_tiles[idx] = tile_get(m->m_assets,
+					m->m_names + idx * MAPFILE_NAMELEN);
+	if ( NULL == m->m_tiles[idx] ) {
+		m->m_tile_ref[idx]--;
+		return 0;
 	}
-	asset_file_render_end(m->m_assets);
 
-#if 0
-	/* Draw the clip field */
-	renderer_wireframe(r, 1);
-	glColor4f(1.0, 0.0, 0.0, 1.0);
-	glEnable(GL_CULL_FACE);
-	glBegin(GL_QUADS);
-	for(i = 0; i < 4; i++) {
-		glVertex3f(f.q[i][0], 0, f.q[i][2]);
-	}
-	glEnd();
-	renderer_wireframe(r, 0);
-#endif
+	tile_bounds(m->m_tiles[idx], b);
+	if ( node_empty(b) )
+		return 1;
+
+	/* tallest building and how far items stick out of tiles */
+	m->m_ceiling = f_max(m->m_ceiling, b->maxs[Y]);
+	m->m_overhang = f_max(m->m_overhang, -b->mins[X]);
+	m->m_overhang = f_max(m->m_overhang, -b->mins[Z]);
+	m->m_overhang = f_max(m->m_overhang, b->maxs[X] - TILE_X);
+	m->m_overhang = f_max(m->m_overhang, b->maxs[Z] - TILE_Y);
+	return 1;
 }
 
-int map_collide_line(map_t m, const vec3_t a, const vec3_t b, vec3_t hit)
+static void tile_unref(struct _map *m, midx_t idx)
 {
-	int mins[2], maxs[2];
-	int x, y;
-	int ret = 0;
-
-	/* First determine which tiles the line segment crosses */
-	mins[0] = floor(f_min(a[0], b[0]) / TILE_X);
-	mins[1] = floor(f_min(a[2], b[2]) / TILE_Y);
-	maxs[0] = ceil(f_max(a[0], b[0]) / TILE_X);
-	maxs[1] = ceil(f_max(a[2], b[2]) / TILE_Y);
-
-	mins[0] = r_max(mins[0], 0);
-	mins[1] = r_max(mins[1], 0);
-	maxs[0] = r_min(maxs[0], m->m_width);
-	maxs[1] = r_min(maxs[1], m->m_height);
+	assert(m->m_tile_ref[idx]);
+	if ( --m->m_tile_ref[idx] || m->m_tile_queued[idx] )
+		return;
 
-#if 0
-	printf("%f,%f -> %f,%f :: %u,%u -> %u,%u\n",
-		a[0], a[2], b[0], b[2],
-		mins[0], mins[1], maxs[0] - 1, maxs[1] - 1);
-#endif
-	for(y = mins[1]; y < maxs[1]; y++) {
-		for(x = mins[0]; x < maxs[0]; x++) {
-			vec3_t start, end, h;
-			tile_t t;
+	/* freeing tiles is GL work, so leave it to the render thread */
+	m->m_tile_queued[idx] = 1;
+	m->m_released[m->m_num_released++] = idx;
+}
 
-			/* lookup the tile */
-			t = m->m_tiles[m->m_indices[y * m->m_width + x]];
+void map_put_released(map_t m)
+{
+	unsigned int i;
 
-			/* translate the line segment in to tile space */
-			v_copy(start, a);
-			v_copy(end, b);
-			start[0] -= TILE_X * x;
-			start[2] -= TILE_Y * y;
-			end[0] -= TILE_X * x;
-			end[2] -= TILE_Y * y;
-#if 0
-			printf(" - tile %u,%u: %f,%f,%f %f,%f,%f\n",
-				x, y,
-				start[0], start[1], start[2],
-				end[0], end[1], end[2]);
-#endif
-			if ( !tile_collide_line(t, start, end, h) )
-				continue;
+	map_lock(m);
+	for(i = 0; i < m->m_num_released; i++) {
+		midx_t idx = m->m_released[i];
 
-			/* make sure to chose nearest intersection */
-			if ( ret ) {
-				vec3_t tmp;
-				float da, db;
+		m->m_tile_queued[idx] = 0;
+		if ( m->m_tile_ref[idx] )
+			continue;
 
-				v_sub(tmp, a, hit);
-				da = fabs(v_len(tmp));
+		tile_put(m->m_tiles[idx]);
+		m->m_tiles[idx] = NULL;
+	}
+	m->m_num_released = 0;
+	map_unlock(m);
+}
 
-				v_sub(tmp, a, h);
-				db = fabs(v_len(tmp));
+static int chunk_read(struct _map *m, const struct map_chunk *c,
+			struct map_region *r)
+{
+	r->r_data = malloc(c->c_len ? c->c_len : 1);
+	if ( NULL == r->r_data )
+		return 0;
 
-				if ( db < da )
-					v_copy(hit, h);
-			}else{
-				v_copy(hit, h);
-				ret = 1;
-			}
-		}
+	if ( fseek(m->m_file, c->c_off, SEEK_SET) ||
+			fread(r->r_data, c->c_len, 1, m->m_file) != 1 ) {
+		con_printf("map: chunk at %"PRIu32": %s\n",
+			c->c_off, strerror(errno));
+		free(r->r_data);
+		r->r_data = NULL;
+		return 0;
 	}
 
-	return ret;
+	r->r_len = c->c_len;
+	r->r_type = c->c_type;
+	r->r_uniform = (c->c_type == MAPCHUNK_SPARSE &&
+			c->c_len == sizeof(r->r_dominant));
+	if ( r->r_uniform )
+		memcpy(&r->r_dominant, r->r_data, sizeof(r->r_dominant));
+	return 1;
 }
 
-struct shim {
-	map_cbfn_t cb;
-	map_t m;
-	void *priv;
-	tile_t tile;
-	int x, y;
-};
-
-static int tcb(const struct tile_hit *hit, void *priv)
+static int region_load(struct _map *m, unsigned int cx, unsigned int cy)
 {
-	struct shim *shim = priv;
-	struct map_hit h;
+	unsigned int i, num = m->m_chunk * m->m_chunk;
+	unsigned int ofs = cy * m->m_chunks_x + cx;
+	struct map_region *r = &m->m_regions[ofs];
+	struct map_block *b;
+	const midx_t *idx;
+
+	if ( r->r_data )
+		return 1;
+
+	r->r_colliding = calloc(num, sizeof(*r->r_colliding));
+	if ( NULL == r->r_colliding )
+		goto err;
+
+	if ( !chunk_read(m, &m->m_chunk_hdr[ofs], r) )
+		goto err_free_colliding;
+
+	/* validate in to the cache, where the decoded copy is left */
+	b = block_slot(m, cx, cy);
+	b->b_region = NULL;
+	if ( !chunk_decode(m, r->r_type, r->r_data, r->r_len,
+				b->b_indices) ) {
+		con_printf("map: bad chunk at %"PRIu32"\n",
+			m->m_chunk_hdr[ofs].c_off);
+		goto err_free_data;
+	}
 
-	h.asset = hit->asset;
-	h.tile = shim->tile;
-	v_copy(h.origin, hit->origin);
-	memcpy(h.times, hit->times, sizeof(h.times));
-	h.origin[0] += TILE_X * shim->x;
-	h.origin[2] += TILE_Y * shim->y;
-	h.map_x = shim->x;
-	h.map_y = shim->y;
-	h.tile_idx = hit->index;
+	idx = b->b_indices;
+	for(i = 0; i < num; i++) {
+		if ( !tile_ref(m, idx[i]) )
+			goto err_unref;
+	}
 
-	shim->m->m_colliding[shim->y * shim->m->m_width + shim->x] = 1;
+	b->b_region = r;
+	m->m_num_resident++;
+	region_refit(m, cx, cy);
+	return 1;
 
-	return (*shim->cb)(&h, shim->priv);
+err_unref:
+	while(i--)
+		tile_unref(m, idx[i]);
+err_free_data:
+	free(r->r_data);
+	r->r_data = NULL;
+err_free_colliding:
+	free(r->r_colliding);
+	r->r_colliding = NULL;
+err:
+	return 0;
 }
 
-int map_findradius(map_t m, const vec3_t c, float r,
-			map_cbfn_t cb, void *priv)
+static void region_unload(struct _map *m, unsigned int cx, unsigned int cy)
 {
-	int mins[2], maxs[2];
-	struct shim shim;
-	int x, y;
+	struct map_region *r = &m->m_regions[cy * m->m_chunks_x + cx];
+	unsigned int i, num = m->m_chunk * m->m_chunk;
+	const midx_t *idx;
+
+	if ( NULL == r->r_data )
+		return;
 
-	/* First determine which tiles the sphere intersects */
-	mins[0] = floor((c[0] - r) / TILE_X);
-	mins[1] = floor((c[2] - r) / TILE_Y);
-	maxs[0] = ceil((c[0] + r)/ TILE_X);
-	maxs[1] = ceil((c[2] + r) / TILE_Y);
+	idx = block_get(m, cx, cy);
+	for(i = 0; i < num; i++)
+		tile_unref(m, idx[i]);
+
+	block_invalidate(m, r);
+	free(r->r_data);
+	free(r->r_colliding);
+	r->r_data = NULL;
+	r->r_colliding = NULL;
+	m->m_num_resident--;
+	region_refit(m, cx, cy);
+}
 
-	mins[0] = r_max(mins[0], 0);
-	mins[1] = r_max(mins[1], 0);
-	maxs[0] = r_min(maxs[0], m->m_width);
-	maxs[1] = r_min(maxs[1], m->m_height);
+static int chunk_coord(struct _map *m, float pos, unsigned int max)
+{
+	int ret = floor(pos / (m->m_chunk * TILE_X));
+	return r_min(r_max(ret, 0), (int)max - 1);
+}
 
-	for(y = mins[1]; y < maxs[1]; y++) {
-		for(x = mins[0]; x < maxs[0]; x++) {
-			vec3_t c2;
-			tile_t t;
+static int chunk_dist(int ax, int ay, int bx, int by)
+{
+	return (ax - bx) * (ax - bx) + (ay - by) * (ay - by);
+}
 
-			/* lookup the tile */
-			t = m->m_tiles[m->m_indices[y * m->m_width + x]];
+/* page out the region furthest from (cx, cy), apart from its immediate
+ * neighbours. Regions wanted this tick are only evicted if want is set.
+*/
+static int evict_one(struct _map *m, int cx, int cy, int want)
+{
+	int x, y, bx = -1, by = -1, best = -1;
 
-			/* translate the line sphere in to tile space */
-			v_copy(c2, c);
-			c2[0] -= TILE_X * x;
-			c2[2] -= TILE_Y * y;
+	for(y = 0; y < (int)m->m_chunks_y; y++) {
+		for(x = 0; x < (int)m->m_chunks_x; x++) {
+			struct map_region *r;
+			int d;
 
-			shim.cb = cb;
-			shim.priv = priv;
-			shim.tile = t;
-			shim.x = x;
-			shim.y = y;
-			if ( !tile_collide_sphere(t, c2, r, tcb, &shim) )
-				return 0;
+			r = &m->m_regions[y * m->m_chunks_x + x];
+			if ( NULL == r->r_data )
+				continue;
+			if ( abs(x - cx) <= 1 && abs(y - cy) <= 1 )
+				continue;
+			if ( !want && r->r_stamp == m->m_tick )
+				continue;
+
+			d = chunk_dist(x, y, cx, cy);
+			if ( d > best ) {
+				best = d;
+				bx = x;
+				by = y;
+			}
 		}
 	}
 
+	if ( best < 0 )
+		return 0;
+
+	region_unload(m, bx, by);
 	return 1;
 }
 
-int map_sweep(map_t m, const struct obb *sweep,
-			map_cbfn_t cb, void *priv)
+#define MAP_PREFETCH_MAX	8
+
+/* Called once per tick with the position and velocity of whatever the map
+ * should be paged in around. The regions around pos are loaded straight
+ * away, regions within m_radius of pos, or of where we will be in
+ * m_lookahead ticks, are prefetched a few at a time, nearest the predicted
+ * position first. Anything else is paged out when over budget.
+*/
+void map_page(map_t m, const vec3_t pos, const vec3_t move)
 {
-	vec3_t smins, smaxs;
-	int mins[2], maxs[2];
-	struct shim shim;
-	vec3_t v;
-	int x, y;
+	int cand[MAP_PREFETCH_MAX][3];
+	unsigned int num_cand = 0, max_cand, i;
+	int cx, cy, ax, ay, rad, x, y;
+	int x0, y0, x1, y1;
+
+	map_lock(m);
+	m->m_tick++;
+
+	cx = chunk_coord(m, pos[X], m->m_chunks_x);
+	cy = chunk_coord(m, pos[Z], m->m_chunks_y);
+	ax = chunk_coord(m, pos[X] + move[X] * m->m_lookahead,
+				m->m_chunks_x);
+	ay = chunk_coord(m, pos[Z] + move[Z] * m->m_lookahead,
+				m->m_chunks_y);
+
+	/* needed right now for collisions */
+	for(y = r_max(cy - 1, 0); y <= r_min(cy + 1, m->m_chunks_y - 1); y++) {
+		for(x = r_max(cx - 1, 0);
+				x <= r_min(cx + 1, m->m_chunks_x - 1); x++) {
+			region_load(m, x, y);
+			m->m_regions[y * m->m_chunks_x + x].r_stamp = m->m_tick;
+		}
+	}
 
-	obb_build_aabb(sweep, smins, smaxs);
-
-	//v_sub(v, sweep->b, sweep->a);
-	v_zero(v);
-
-	mins[0] = floor( (smins[0] -
-			((v[0] < 0) ? v[0] : 0.0)) / TILE_X);
-	mins[1] = floor( (smins[2] -
-			((v[2] < 0) ? v[2] : 0.0)) / TILE_Y);
-	maxs[0] = ceil( (smaxs[0] +
-			((v[0] > 0) ? v[0] : 0.0)) / TILE_X);
-	maxs[1] = ceil( (smaxs[2] +
-			((v[2] > 0) ? v[2] : 0.0)) / TILE_Y);
-
-	mins[0] = r_max(mins[0], 0);
-	mins[1] = r_max(mins[1], 0);
-	maxs[0] = r_min(maxs[0], m->m_width);
-	maxs[1] = r_min(maxs[1], m->m_height);
-
-#if 1
-	mins[0] = mins[1] = 0;
-	maxs[0] = m->m_width;
-	maxs[1] = m->m_height;
-#endif
+	rad = m->m_radius;
+	max_cand = r_min(m->m_prefetch, MAP_PREFETCH_MAX);
+	x0 = r_max(r_min(cx, ax) - rad, 0);
+	y0 = r_max(r_min(cy, ay) - rad, 0);
+	x1 = r_min(r_max(cx, ax) + rad, m->m_chunks_x - 1);
+	y1 = r_min(r_max(cy, ay) + rad, m->m_chunks_y - 1);
 
-	memset(m->m_colliding, 0, m->m_width * m->m_height * sizeof(*m->m_colliding));
+	for(y = y0; y <= y1; y++) {
+		for(x = x0; x <= x1; x++) {
+			struct map_region *r;
+			int d;
 
-//	printf("tiles: %d,%d -> %d,%d\n",
-//		mins[0], mins[1], maxs[0] - 1, maxs[1] - 1);
-	for(y = mins[1]; y < maxs[1]; y++) {
-		for(x = mins[0]; x < maxs[0]; x++) {
-			struct obb obb;
-			vec3_t off;
-			tile_t t;
+			d = chunk_dist(x, y, ax, ay);
+			if ( d > rad * rad && chunk_dist(x, y, cx, cy) > rad * rad )
+				continue;
 
-			/* lookup the tile */
-			t = m->m_tiles[m->m_indices[y * m->m_width + x]];
-			off[0] = x * TILE_X;
-			off[1] = 0.0;
-			off[2] = y * TILE_Y;
-			memcpy(&obb, sweep, sizeof(obb));
-			v_sub(obb.origin, obb.origin, off);
-
-			shim.m = m;
-			shim.cb = cb;
-			shim.priv = priv;
-			shim.tile = t;
-			shim.x = x;
-			shim.y = y;
-			if ( !tile_sweep(t, &obb, tcb, &shim) )
-				return 0;
+			r = &m->m_regions[y * m->m_chunks_x + x];
+			r->r_stamp = m->m_tick;
+			if ( r->r_data || !max_cand )
+				continue;
+
+			/* keep the nearest few, sorted */
+			for(i = num_cand; i > 0 && cand[i - 1][2] > d; i--) {
+				if ( i < max_cand )
+					memcpy(cand[i], cand[i - 1],
+						sizeof(cand[i]));
+			}
+			if ( i < max_cand ) {
+				cand[i][0] = x;
+				cand[i][1] = y;
+				cand[i][2] = d;
+				if ( num_cand < max_cand )
+					num_cand++;
+			}
 		}
 	}
 
-	return 0;
-}
-
-void map_render(map_t m, renderer_t r, light_t l)
-{
-	render_map(m, r, l);
-}
+	for(i = 0; i < num_cand; i++) {
+		if ( m->m_num_resident >= m->m_budget &&
+				!evict_one(m, cx, cy, 0) )
+			break;
+		region_load(m, cand[i][0], cand[i][1]);
+	}
 
-void map_get_size(map_t m, unsigned int *x, unsigned int *y)
-{
-	if ( x )
-		*x = m->m_width;
-	if ( y )
-		*y = m->m_height;
+	while(m->m_num_resident > m->m_budget && evict_one(m, cx, cy, 1))
+		/* nothing */;
+	map_unlock(m);
 }
 
 map_t map_load(renderer_t r, const char *name)
 {
-	const struct map_hdr *hdr;
+	struct map_hdr hdr;
 	struct _map *m = NULL;
 	unsigned int i;
-	char *names;
+	size_t sz;
 
 	m = calloc(1, sizeof(*m));
 	if ( NULL == m )
 		goto out;
 
+	pthread_mutex_init(&m->m_lock, NULL);
+
 	m->m_assets = asset_file_open("data/assets.db");
 	if ( NULL == m->m_assets )
 		goto out_free;
 
-	m->m_buf = blob_from_file(name, &m->m_sz);
-	if ( NULL == m->m_buf )
+	m->m_file = fopen(name, "rb");
+	if ( NULL == m->m_file ) {
+		con_printf("map_load: %s: %s\n", name, strerror(errno));
 		goto out_free_asset;
+	}
+
+	if ( fread(&hdr, sizeof(hdr), 1, m->m_file) != 1 ) {
+		con_printf("map_load: %s: corrupt file\n", name);
+		goto out_close;
+	}
+
+	if ( hdr.h_magic != MAPFILE_MAGIC ) {
+		con_printf("map_load: %s: bad magic\n", name);
+		goto out_close;
+	}
 
-	hdr = (struct map_hdr *)m->m_buf;
-	if ( m->m_sz < sizeof(*hdr) )
-		goto out_free_blob;
+	m->m_width = hdr.h_x;
+	m->m_height = hdr.h_y;
+	m->m_num_tiles = hdr.h_num_tiles;
+	m->m_chunk = hdr.h_chunk;
+	if ( !m->m_width || !m->m_height || !m->m_chunk ||
+			(m->m_chunk % MAP_LEAF_TILES) ) {
+		con_printf("map_load: %s: bad dimensions\n", name);
+		goto out_close;
+	}
+
+	m->m_chunks_x = (m->m_width + m->m_chunk - 1) / m->m_chunk;
+	m->m_chunks_y = (m->m_height + m->m_chunk - 1) / m->m_chunk;
+	m->m_num_chunks = m->m_chunks_x * m->m_chunks_y;
+	if ( hdr.h_num_chunks != m->m_num_chunks ) {
+		con_printf("map_load: %s: bad chunk count\n", name);
+		goto out_close;
+	}
+
+	sz = m->m_num_tiles * MAPFILE_NAMELEN;
+	m->m_names = malloc(sz);
+	if ( NULL == m->m_names )
+		goto out_close;
 
-	if ( hdr->h_magic != MAPFILE_MAGIC ) {
-		fprintf(stderr, "bad magic\n");
-		goto out_free_blob;
+	if ( fread(m->m_names, sz, 1, m->m_file) != 1 ) {
+		con_printf("map_load: %s: corrupt file\n", name);
+		goto out_free_names;
 	}
 
-	m->m_width = hdr->h_x;
-	m->m_height = hdr->h_y;
-	m->m_num_tiles= hdr->h_num_tiles;
+	m->m_chunk_hdr = malloc(m->m_num_chunks * sizeof(*m->m_chunk_hdr));
+	if ( NULL == m->m_chunk_hdr )
+		goto out_free_names;
+
+	if ( fread(m->m_chunk_hdr, sizeof(*m->m_chunk_hdr),
+			m->m_num_chunks, m->m_file) != m->m_num_chunks ) {
+		con_printf("map_load: %s: corrupt file\n", name);
+		goto out_free_chunks;
+	}
+
+	m->m_regions = calloc(m->m_num_chunks, sizeof(*m->m_regions));
+	if ( NULL == m->m_regions )
+		goto out_free_chunks;
 
 	m->m_tiles = calloc(m->m_num_tiles, sizeof(*m->m_tiles));
 	if ( NULL == m->m_tiles )
-		goto out_free_blob;
-
-	names = (char *)(m->m_buf + sizeof(*hdr));
-	for(i = 0; i < m->m_num_tiles; i++) {
-		m->m_tiles[i] = tile_get(m->m_assets,
-					names + i * MAPFILE_NAMELEN);
-		if ( NULL == m->m_tiles[i] )
-			goto out_free_tiles;
+		goto out_free_regions;
+
+	m->m_tile_ref = calloc(m->m_num_tiles, sizeof(*m->m_tile_ref));
+	if ( NULL == m->m_tile_ref )
+		goto out_free_tiles;
+
+	m->m_tile_queued = calloc(m->m_num_tiles, sizeof(*m->m_tile_queued));
+	if ( NULL == m->m_tile_queued )
+		goto out_free_ref;
+
+	m->m_released = calloc(m->m_num_tiles, sizeof(*m->m_released));
+	if ( NULL == m->m_released )
+		goto out_free_queued;
+
+	m->m_tile_bounds = calloc(m->m_num_tiles, sizeof(*m->m_tile_bounds));
+	if ( NULL == m->m_tile_bounds )
+		goto out_free_released;
+
+	if ( !build_tree(m) )
+		goto out_free_bounds;
+
+	m->m_cull_row = calloc(m->m_width, sizeof(*m->m_cull_row));
+	if ( NULL == m->m_cull_row )
+		goto out_free_tree;
+
+	/* workers are all started by now */
+	m->m_num_caches = job_num_workers();
+	m->m_blocks = calloc(m->m_num_caches * MAP_BLOCK_CACHE,
+				sizeof(*m->m_blocks));
+	if ( NULL == m->m_blocks )
+		goto out_free_row;
+
+	m->m_block_buf = malloc(m->m_num_caches * MAP_BLOCK_CACHE *
+				m->m_chunk * m->m_chunk *
+				sizeof(*m->m_block_buf));
+	if ( NULL == m->m_block_buf )
+		goto out_free_block_list;
+
+	for(i = 0; i < m->m_num_caches * MAP_BLOCK_CACHE; i++) {
+		m->m_blocks[i].b_indices = m->m_block_buf +
+					i * m->m_chunk * m->m_chunk;
 	}
 
-	m->m_indices = (midx_t *)(names + m->m_num_tiles * MAPFILE_NAMELEN);
-	m->m_colliding = calloc(m->m_width * m->m_height, sizeof(*m->m_colliding));
+	m->m_occ = occlude_new(MAP_OCCLUDE_X, MAP_OCCLUDE_Y);
+	if ( NULL == m->m_occ )
+		goto out_free_blocks;
+
+	m->m_budget = 64;
+	m->m_prefetch = 2;
+	m->m_radius = 3;
+	m->m_lookahead = 20;
+	m->m_sweep_seq = 1;
+	m->m_occlude = 1;
+	m->m_occluders = 16;
+	m->m_occluder_height = 20.0;
+	m->m_occluder_shrink = 0.1;
+
+	m->m_cvars = cvar_ns_new("map");
+	if ( NULL == m->m_cvars )
+		goto out_free_occ;
+
+	cvar_register_uint(m->m_cvars, "chunks", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_budget);
+	cvar_register_uint(m->m_cvars, "prefetch", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_prefetch);
+	cvar_register_uint(m->m_cvars, "radius", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_radius);
+	cvar_register_uint(m->m_cvars, "lookahead", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_lookahead);
+	cvar_register_uint(m->m_cvars, "resident", CVAR_FLAG_SAVE_NEVER, &m->m_num_resident);
+	cvar_register_uint(m->m_cvars, "occlude", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_occlude);
+	cvar_register_uint(m->m_cvars, "occluders", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_occluders);
+	cvar_register_float(m->m_cvars, "occluder_height", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_occluder_height);
+	cvar_register_float(m->m_cvars, "occluder_shrink", CVAR_FLAG_SAVE_NOTDEFAULT, &m->m_occluder_shrink);
+	cvar_register_uint(m->m_cvars, "occluded", CVAR_FLAG_SAVE_NEVER, &m->m_num_occ_items);
+	cvar_ns_load(m->m_cvars);
+
+	/* the 3x3 around the focus is always resident */
+	m->m_budget = r_max(m->m_budget, 9);
 
 	/* success */
 	goto out;
 
+out_free_occ:
+	occlude_free(m->m_occ);
+out_free_blocks:
+	free(m->m_block_buf);
+out_free_block_list:
+	free(m->m_blocks);
+out_free_row:
+	free(m->m_cull_row);
+out_free_tree:
+	free(m->m_node_buf);
+	free(m->m_nodes);
+out_free_bounds:
+	free(m->m_tile_bounds);
+out_free_released:
+	free(m->m_released);
+out_free_queued:
+	free(m->m_tile_queued);
+out_free_ref:
+	free(m->m_tile_ref);
 out_free_tiles:
 	free(m->m_tiles);
-out_free_blob:
-	blob_free(m->m_buf, m->m_sz);
+out_free_regions:
+	free(m->m_regions);
+out_free_chunks:
+	free(m->m_chunk_hdr);
+out_free_names:
+	free(m->m_names);
+out_close:
+	fclose(m->m_file);
 out_free_asset:
 	asset_file_close(m->m_assets);
 out_free:
+	pthread_mutex_destroy(&m->m_lock);
 	free(m);
 	m = NULL;
 out:
@@ -499,12 +2091,36 @@ out:
 void map_free(map_t m)
 {
 	if ( m ) {
-		unsigned int i;
-		for(i = 0; i < m->m_num_tiles; i++)
-			tile_put(m->m_tiles[i]);
+		unsigned int x, y;
+		cvar_ns_save(m->m_cvars);
+		cvar_ns_free(m->m_cvars);
+		for(y = 0; y < m->m_chunks_y; y++)
+			for(x = 0; x < m->m_chunks_x; x++)
+				region_unload(m, x, y);
+		map_put_released(m);
+		free(m->m_vis_items);
+		free(m->m_vis_tiles);
+		free(m->m_occ_items);
+		occlude_free(m->m_occ);
+		free(m->m_line_cells);
+		free(m->m_line_sort);
+		free(m->m_lines);
+		free(m->m_cull_row);
+		free(m->m_block_buf);
+		free(m->m_blocks);
+		free(m->m_node_buf);
+		free(m->m_nodes);
+		free(m->m_tile_bounds);
+		free(m->m_released);
+		free(m->m_tile_queued);
+		free(m->m_tile_ref);
 		free(m->m_tiles);
-		blob_free(m->m_buf, m->m_sz);
+		free(m->m_regions);
+		free(m->m_chunk_hdr);
+		free(m->m_names);
+		fclose(m->m_file);
 		asset_file_close(m->m_assets);
+		pthread_mutex_destroy(&m->m_lock);
 		free(m);
 	}
 }
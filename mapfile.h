@@ -5,25 +5,55 @@
 #ifndef _PUNANI_MAPFILE_H
 #define _PUNANI_MAPFILE_H
 
-/* Tile file format:
+/* Map file format:
  * [ hdr ]
  * [ h_num_tiles * tile names ]
- * [ h_x * h_y indices ]
+ * [ h_num_chunks * chunk records ]
+ * [ chunk data ]
+ *
+ * The index grid is split in to h_chunk x h_chunk regions, stored in
+ * row-major order, so that they can be paged in independently. Chunks
+ * on the right and bottom edges are padded out to full size.
 */
 
-#define MAPFILE_MAGIC	0x55d45400
+#define MAPFILE_MAGIC	0x55d45402
 
 #define MAPFILE_NAMELEN 32
 
+#define MAP_IDX_MAX 0xffff
+typedef uint16_t midx_t;
+
+#define MAPFILE_CHUNK	16
+
 struct map_hdr {
 	uint32_t h_num_tiles;
 	uint32_t h_x;
 	uint32_t h_y;
 	uint32_t h_magic;
+	uint32_t h_chunk;
+	uint32_t h_num_chunks;
 }__attribute__((packed));
 
-#define MAP_IDX_MAX 0xffff
-typedef uint16_t midx_t;
+/* chunk encodings, mkmap picks whichever is smallest */
+#define MAPCHUNK_RAW	0 /* h_chunk * h_chunk indices */
+#define MAPCHUNK_RLE	1 /* runs covering the chunk in row-major order */
+#define MAPCHUNK_SPARSE	2 /* dominant index, then patches for the rest */
+
+struct map_run {
+	uint16_t r_len;
+	midx_t r_idx;
+}__attribute__((packed));
+
+struct map_patch {
+	uint16_t p_cell;
+	midx_t p_idx;
+}__attribute__((packed));
+
+struct map_chunk {
+	uint32_t c_off; /* from start of file */
+	uint32_t c_len;
+	uint32_t c_type;
+}__attribute__((packed));
 
 /* in-core data structures */
 #if MAP_INTERNAL
@@ -7,55 +7,60 @@
 #include <punani/renderer.h>
 #include <punani/light.h>
 #include <punani/asset.h>
-#include <punani/missile.h>
 #include <punani/particles.h>
 #include <punani/map.h>
 #include <punani/entity.h>
+#include <punani/missile.h>
 #include <punani/cvar.h>
+#include <punani/prefab.h>
 #include <math.h>
 #include "ent-internal.h"
+#include "hgang.h"
+
+/* missiles per pool slab */
+#define MISSILE_SLAB		64
 
 struct _missile {
 	struct _entity m_ent;
-	asset_file_t m_assets;
-	asset_t m_mesh;
-	particles_t m_trail;
+	vec3_t m_trail_end;
 	float m_velocity;
 	unsigned int m_lifetime;
 };
 
-static void render(struct _entity *ent, renderer_t r, float lerp, light_t l)
-{
-	struct _missile *m = (struct _missile *)ent;
-
-	//renderer_rotate(r, m->m_heading * (180.0 / M_PI), 0, 1, 0);
-	//asset_file_dirty_shadows(c->asset);
-	//asset_file_render_begin(c->asset, r, l);
-	//asset_render(m->m_mesh, r, l);
-	//asset_file_render_end(c->asset);
-
-	particles_emit(m->m_trail, m->m_ent.e_oldlerp, m->m_ent.e_lerp);
-}
+/* Everything a spawn needs is resolved up front by missile_init() so that
+ * firing only ever takes an object from the pool and a slot in the entity
+ * store.
+*/
+static prefab_t hydra;
+static particles_t trail;
+static hgang_t pool;
+static unsigned int num_live;
 
 static void think(struct _entity *ent)
 {
 	struct _missile *m = (struct _missile *)ent;
+	vec3_t next;
 
 	m->m_lifetime--;
-	if ( !m->m_lifetime || m->m_ent.e_origin[1] <= 0.0 ) {
+	if ( !m->m_lifetime || entity_origin(ent)[1] <= 0.0 ) {
 		entity_unlink(&m->m_ent);
 		return;
 	}
+
+	/* the trail is all there is to see, lay it down as far as this
+	 * tick will take us so that render has it to interpolate towards
+	*/
+	v_add(next, entity_origin(ent), entity_move(ent));
+	particles_emit(trail, m->m_trail_end, next);
+	v_copy(m->m_trail_end, next);
 }
 
 static void dtor(struct _entity *ent)
 {
 	struct _missile *m = (struct _missile *)ent;
 
-	asset_put(m->m_mesh);
-	asset_file_close(m->m_assets);
-	particles_unref(m->m_trail);
-	free(m);
+	hgang_return(pool, m);
+	num_live--;
 }
 
 static void collide_world(struct _entity *ent, const vec3_t hit)
@@ -64,34 +69,33 @@ static void collide_world(struct _entity *ent, const vec3_t hit)
 	entity_unlink(&m->m_ent);
 }
 
+static void collide_entity(struct _entity *ent, struct _entity *other)
+{
+	struct _missile *m = (struct _missile *)ent;
+	entity_unlink(&m->m_ent);
+}
+
 static const struct entity_ops ops = {
 	.e_flags = ENT_PROJECTILE,
-	.e_render = render,
 	.e_think = think,
 	.e_collide_world = collide_world,
+	.e_collide_entity = collide_entity,
 	.e_dtor = dtor,
 };
 
-missile_t missile_spawn(const vec3_t origin, const vec3_t angles)
+missile_t missile_spawn(entity_t owner, const vec3_t origin,
+				const vec3_t angles)
 {
 	struct _missile *m;
+	float *move;
 	vec3_t a;
 
-	m = calloc(1, sizeof(*m));
-	if ( NULL == m )
+	if ( NULL == pool )
 		return NULL;
 
-	m->m_assets = asset_file_open("data/missiles.db");
-	if ( NULL == m->m_assets )
-		goto err_free;
-
-	m->m_mesh = asset_file_get(m->m_assets, "AGR_71_Hydra.g");
-	if ( NULL == m->m_mesh )
-		goto err_free_assets;
-
-	m->m_trail = particles_new(1024);
-	if ( NULL == m->m_trail )
-		goto err_free_mesh;
+	m = hgang_alloc0(pool);
+	if ( NULL == m )
+		return NULL;
 
 	m->m_lifetime = 100;
 	m->m_velocity = 12;
@@ -100,28 +104,82 @@ missile_t missile_spawn(const vec3_t origin, const vec3_t angles)
 	a[1] = angles[1];
 	a[2] = angles[2];
 
-	entity_spawn(&m->m_ent, &ops, origin, NULL, a);
-	m->m_ent.e_move[0] += sin(m->m_ent.e_angles[1]);
-	m->m_ent.e_move[1] = -sin(m->m_ent.e_angles[0]);
-	m->m_ent.e_move[2] += cos(m->m_ent.e_angles[1]);
-	v_normalize(m->m_ent.e_move);
-	v_scale(m->m_ent.e_move, m->m_velocity);
+	if ( !entity_spawn(&m->m_ent, &ops, origin, NULL, a) )
+		goto err_free;
+	if ( owner )
+		m->m_ent.e_owner = entity_handle(owner);
+	v_copy(m->m_trail_end, origin);
+	move = entity_move(&m->m_ent);
+	move[0] += sin(a[1]);
+	move[1] = -sin(a[0]);
+	move[2] += cos(a[1]);
+	v_normalize(move);
+	v_scale(move, m->m_velocity);
 	entity_link(&m->m_ent);
+	num_live++;
 
 	/* success */
 	//con_printf("Missile away: %f %f %f\n",
-	//	m->m_ent.e_origin[0],
-	//	m->m_ent.e_origin[1],
-	//	m->m_ent.e_origin[2]);
+	//	entity_origin(&m->m_ent)[0],
+	//	entity_origin(&m->m_ent)[1],
+	//	entity_origin(&m->m_ent)[2]);
 	goto out;
 
-err_free_mesh:
-	asset_put(m->m_mesh);
-err_free_assets:
-	asset_file_close(m->m_assets);
 err_free:
-	free(m);
+	hgang_return(pool, m);
 	m = NULL;
 out:
 	return m;
 }
+
+int missile_init(void)
+{
+	hydra = prefab_get("hydra");
+	if ( NULL == hydra )
+		goto err;
+
+	trail = particles_new(prefab_sprite(hydra), PARTICLES_PRIO_NORMAL);
+	if ( NULL == trail )
+		goto err_put;
+
+	if ( NULL == pool ) {
+		pool = hgang_new(sizeof(struct _missile), MISSILE_SLAB, 0);
+		if ( NULL == pool )
+			goto err_unref;
+		hgang_set_name(pool, "missiles");
+	}
+
+	return 1;
+
+err_unref:
+	particles_unref(trail);
+	trail = NULL;
+err_put:
+	prefab_put(hydra);
+	hydra = NULL;
+err:
+	return 0;
+}
+
+void missile_exit(void)
+{
+	unsigned int i;
+
+	/* walk backwards so swap-removal only moves visited entries */
+	for(i = entities.s_num; i--; ) {
+		struct _entity *ent = entities.s_owner[i];
+		if ( ent->e_ops == &ops )
+			entity_unlink(ent);
+	}
+
+	/* someone may still hold a reference, the pool is reused next time */
+	if ( !num_live ) {
+		hgang_free(pool);
+		pool = NULL;
+	}
+
+	particles_unref(trail);
+	trail = NULL;
+	prefab_put(hydra);
+	hydra = NULL;
+}
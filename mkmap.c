@@ -164,25 +164,165 @@ out:
 	return ret;
 }
 
-static int map_dump(struct map *m, const char *fn)
+/* copy out one chunk of the index grid, padding with the tile of the
+ * nearest cell inside the map
+*/
+static void get_chunk(struct map *m, unsigned int cx, unsigned int cy,
+			midx_t *out)
+{
+	unsigned int x, y;
+
+	for(y = 0; y < MAPFILE_CHUNK; y++) {
+		unsigned int my = cy * MAPFILE_CHUNK + y;
+
+		if ( my >= m->m_y )
+			my = m->m_y - 1;
+
+		for(x = 0; x < MAPFILE_CHUNK; x++) {
+			unsigned int mx = cx * MAPFILE_CHUNK + x;
+
+			if ( mx >= m->m_x )
+				mx = m->m_x - 1;
+
+			out[y * MAPFILE_CHUNK + x] = m->m_indices[my * m->m_x + mx];
+		}
+	}
+}
+
+static size_t encode_raw(const midx_t *idx, unsigned int num, uint8_t *out)
+{
+	memcpy(out, idx, num * sizeof(*idx));
+	return num * sizeof(*idx);
+}
+
+static size_t encode_rle(const midx_t *idx, unsigned int num, uint8_t *out)
 {
+	struct map_run *run = (struct map_run *)out;
+	unsigned int i, n = 0;
+
+	for(i = 0; i < num; i++) {
+		if ( n && run[n - 1].r_idx == idx[i] &&
+				run[n - 1].r_len < 0xffff ) {
+			run[n - 1].r_len++;
+			continue;
+		}
+		run[n].r_len = 1;
+		run[n].r_idx = idx[i];
+		n++;
+	}
+
+	return n * sizeof(*run);
+}
+
+static size_t encode_sparse(const midx_t *idx, unsigned int num, uint8_t *out)
+{
+	struct map_patch *patch;
+	unsigned int i, j, best = 0, cnt = 0, n = 0;
+	midx_t dom = idx[0];
+
+	/* find the most common tile, chunks are small */
+	for(i = 0; i < num; i++) {
+		for(cnt = 0, j = 0; j < num; j++)
+			if ( idx[j] == idx[i] )
+				cnt++;
+		if ( cnt > best ) {
+			best = cnt;
+			dom = idx[i];
+		}
+	}
+
+	memcpy(out, &dom, sizeof(dom));
+	patch = (struct map_patch *)(out + sizeof(dom));
+	for(i = 0; i < num; i++) {
+		if ( idx[i] == dom )
+			continue;
+		patch[n].p_cell = i;
+		patch[n].p_idx = idx[i];
+		n++;
+	}
+
+	return sizeof(dom) + n * sizeof(*patch);
+}
+
+static size_t (*const encoders[])(const midx_t *, unsigned int, uint8_t *) = {
+	[MAPCHUNK_RAW] = encode_raw,
+	[MAPCHUNK_RLE] = encode_rle,
+	[MAPCHUNK_SPARSE] = encode_sparse,
+};
+#define NUM_ENCODERS (sizeof(encoders)/sizeof(*encoders))
+
+/* worst case for any of the encoders */
+#define CHUNK_MAX (MAPFILE_CHUNK * MAPFILE_CHUNK * sizeof(struct map_patch) + \
+			sizeof(midx_t))
+
+/* encode a chunk in whichever format is smallest */
+static size_t encode_chunk(const midx_t *idx, uint8_t *out, uint32_t *type)
+{
+	unsigned int num = MAPFILE_CHUNK * MAPFILE_CHUNK;
+	uint8_t buf[CHUNK_MAX];
+	size_t ret = 0, sz;
 	unsigned int i;
+
+	*type = MAPCHUNK_RAW;
+	for(i = 0; i < NUM_ENCODERS; i++) {
+		sz = (*encoders[i])(idx, num, buf);
+		if ( !i || sz < ret ) {
+			memcpy(out, buf, sz);
+			*type = i;
+			ret = sz;
+		}
+	}
+
+	return ret;
+}
+
+static int map_dump(struct map *m, const char *fn)
+{
+	midx_t buf[MAPFILE_CHUNK * MAPFILE_CHUNK];
+	unsigned int i, cw, ch, off, total;
+	struct map_chunk *c = NULL;
+	uint8_t *data = NULL;
 	struct map_hdr hdr;
 	FILE *fout;
 
 	if ( !indexify(m) )
 		goto err;
 
+	cw = (m->m_x + MAPFILE_CHUNK - 1) / MAPFILE_CHUNK;
+	ch = (m->m_y + MAPFILE_CHUNK - 1) / MAPFILE_CHUNK;
+
 	hdr.h_num_tiles = m->m_num_uniq;
 	hdr.h_magic = MAPFILE_MAGIC;
 	hdr.h_x = m->m_x;
 	hdr.h_y = m->m_y;
+	hdr.h_chunk = MAPFILE_CHUNK;
+	hdr.h_num_chunks = cw * ch;
+
+	c = calloc(hdr.h_num_chunks, sizeof(*c));
+	if ( NULL == c )
+		goto err;
+
+	data = malloc(hdr.h_num_chunks * CHUNK_MAX);
+	if ( NULL == data )
+		goto err;
+
+	off = sizeof(hdr) + m->m_num_uniq * MAPFILE_NAMELEN +
+		hdr.h_num_chunks * sizeof(*c);
+	for(total = 0, i = 0; i < hdr.h_num_chunks; i++) {
+		uint32_t type;
+
+		get_chunk(m, i % cw, i / cw, buf);
+		c[i].c_off = off + total;
+		c[i].c_len = encode_chunk(buf, data + total, &type);
+		c[i].c_type = type;
+		total += c[i].c_len;
+	}
 
 	fout = fopen(fn, "wb");
 	if ( NULL == fout ) {
 		fprintf(stderr, "%s: %s: %s\n",
 			cmd, fn, strerror(errno));
-		return 0;
+		goto err;
 	}
 
 	printf("Writing %ld byte header\n", sizeof(hdr));
@@ -199,17 +339,27 @@ static int map_dump(struct map *m, const char *fn)
 			goto err_close;
 	}
 
-	printf("Writing %ld byte matrix (%u x %u)\n",
-		m->m_x * m->m_y * sizeof(midx_t), m->m_x, m->m_y);
-	if ( fwrite(m->m_indices, sizeof(*m->m_indices),
-			m->m_x * m->m_y, fout) != m->m_x * m->m_y )
+	printf("Writing %u chunk records (%u x %u)\n",
+		hdr.h_num_chunks, cw, ch);
+	if ( fwrite(c, sizeof(*c), hdr.h_num_chunks, fout) !=
+			hdr.h_num_chunks )
 		goto err_close;
+
+	printf("Writing %u bytes of chunks (%ld uncompressed)\n",
+		total, hdr.h_num_chunks * sizeof(buf));
+	if ( total && fwrite(data, total, 1, fout) != 1 )
+		goto err_close;
+
 	fclose(fout);
+	free(data);
+	free(c);
 	return 1;
 err_close:
 	fclose(fout);
 	unlink(fn);
 err:
+	free(data);
+	free(c);
 	return 0;
 }
 
@@ -0,0 +1,299 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/vec.h>
+#include <punani/occlude.h>
+
+#include "simd.h"
+
+/* anything this close to the eye, or behind it, is not rasterized */
+#define OCCLUDE_NEAR	1.0f
+
+struct _occlude {
+	float *o_depth;
+	void *o_buf;
+	unsigned int o_w;
+	unsigned int o_h;
+	mat4_t o_mvp;
+};
+
+/* a batch of triangles, set up four at a time */
+struct tri4 {
+	float e[3][3][4]; /* edge a, b, c */
+	float z[3][4]; /* depth plane */
+	float mins[2][4];
+	float maxs[2][4];
+	float area[4];
+};
+
+/* box faces, counter-clockwise from outside */
+static const uint8_t box_tris[12][3] = {
+	{0, 4, 6}, {0, 6, 2},
+	{1, 3, 7}, {1, 7, 5},
+	{0, 1, 5}, {0, 5, 4},
+	{2, 6, 7}, {2, 7, 3},
+	{0, 2, 3}, {0, 3, 1},
+	{4, 5, 7}, {4, 7, 6},
+};
+
+occlude_t occlude_new(unsigned int w, unsigned int h)
+{
+	struct _occlude *o;
+
+	/* rows are processed four pixels at a time */
+	w = (w + 3) & ~3U;
+
+	o = calloc(1, sizeof(*o));
+	if ( NULL == o )
+		goto out;
+
+	o->o_buf = malloc(w * h * sizeof(*o->o_depth) + 15);
+	if ( NULL == o->o_buf )
+		goto out_free;
+
+	o->o_depth = (float *)(((uintptr_t)o->o_buf + 15) & ~(uintptr_t)15);
+	o->o_w = w;
+	o->o_h = h;
+
+	/* success */
+	goto out;
+
+out_free:
+	free(o);
+	o = NULL;
+out:
+	return o;
+}
+
+void occlude_free(occlude_t o)
+{
+	if ( o ) {
+		free(o->o_buf);
+		free(o);
+	}
+}
+
+void occlude_begin(occlude_t o, const mat4_t mvp)
+{
+	unsigned int i;
+
+	memcpy(o->o_mvp, mvp, sizeof(o->o_mvp));
+	for(i = 0; i < o->o_w * o->o_h; i++)
+		o->o_depth[i] = 1.0;
+}
+
+/* clip space w, ie. distance from the eye along the view direction */
+float occlude_distance(occlude_t o, const vec3_t p)
+{
+	const float (*m)[4] = (const float (*)[4])o->o_mvp;
+
+	return m[0][3] * p[0] + m[1][3] * p[1] + m[2][3] * p[2] + m[3][3];
+}
+
+/* project box corners to buffer coordinates, fails if any are too near */
+static int project_box(occlude_t o, const vec3_t mins, const vec3_t maxs,
+			float v[8][3])
+{
+	const float (*m)[4] = (const float (*)[4])o->o_mvp;
+	unsigned int i;
+
+	for(i = 0; i < 8; i++) {
+		float p[3], c[4], inv;
+		unsigned int j;
+
+		p[0] = (i & 1) ? maxs[0] : mins[0];
+		p[1] = (i & 2) ? maxs[1] : mins[1];
+		p[2] = (i & 4) ? maxs[2] : mins[2];
+
+		for(j = 0; j < 4; j++) {
+			c[j] = m[0][j] * p[0] + m[1][j] * p[1] +
+				m[2][j] * p[2] + m[3][j];
+		}
+
+		if ( c[3] < OCCLUDE_NEAR )
+			return 0;
+
+		inv = 1.0 / c[3];
+		v[i][0] = (c[0] * inv * 0.5 + 0.5) * o->o_w;
+		v[i][1] = (c[1] * inv * 0.5 + 0.5) * o->o_h;
+		v[i][2] = c[2] * inv;
+	}
+
+	return 1;
+}
+
+/* edge functions, depth planes and bounds for four triangles at once */
+static void setup_tri4(struct tri4 *t, float v[8][3],
+			const uint8_t (*tris)[3])
+{
+	v4_t x[3], y[3], z[3], area, inv, dx1, dy1, dx2, dy2, dz1, dz2;
+	v4_t za, zb;
+	unsigned int i;
+
+	for(i = 0; i < 3; i++) {
+		x[i] = v4_set(v[tris[0][i]][0], v[tris[1][i]][0],
+				v[tris[2][i]][0], v[tris[3][i]][0]);
+		y[i] = v4_set(v[tris[0][i]][1], v[tris[1][i]][1],
+				v[tris[2][i]][1], v[tris[3][i]][1]);
+		z[i] = v4_set(v[tris[0][i]][2], v[tris[1][i]][2],
+				v[tris[2][i]][2], v[tris[3][i]][2]);
+	}
+
+	dx1 = v4_sub(x[1], x[0]);
+	dy1 = v4_sub(y[1], y[0]);
+	dx2 = v4_sub(x[2], x[0]);
+	dy2 = v4_sub(y[2], y[0]);
+	dz1 = v4_sub(z[1], z[0]);
+	dz2 = v4_sub(z[2], z[0]);
+
+	area = v4_sub(v4_mul(dx1, dy2), v4_mul(dx2, dy1));
+	v4_store(t->area, area);
+
+	/* back faces and slivers get area <= 0 and are skipped later */
+	inv = v4_div(v4_set1(1.0), v4_max(area, v4_set1(1e-6)));
+
+	/* E(p) = a * px + b * py + c, positive to the left of each edge */
+	for(i = 0; i < 3; i++) {
+		unsigned int j = (i + 1) % 3;
+		v4_t a, b, c;
+
+		a = v4_sub(y[i], y[j]);
+		b = v4_sub(x[j], x[i]);
+		c = v4_sub(v4_set1(0.0),
+			v4_add(v4_mul(a, x[i]), v4_mul(b, y[i])));
+		v4_store(t->e[i][0], a);
+		v4_store(t->e[i][1], b);
+		v4_store(t->e[i][2], c);
+	}
+
+	za = v4_mul(v4_sub(v4_mul(dz1, dy2), v4_mul(dz2, dy1)), inv);
+	zb = v4_mul(v4_sub(v4_mul(dx1, dz2), v4_mul(dx2, dz1)), inv);
+	v4_store(t->z[0], za);
+	v4_store(t->z[1], zb);
+	v4_store(t->z[2], v4_sub(z[0], v4_add(v4_mul(za, x[0]),
+						v4_mul(zb, y[0]))));
+
+	v4_store(t->mins[0], v4_min(v4_min(x[0], x[1]), x[2]));
+	v4_store(t->mins[1], v4_min(v4_min(y[0], y[1]), y[2]));
+	v4_store(t->maxs[0], v4_max(v4_max(x[0], x[1]), x[2]));
+	v4_store(t->maxs[1], v4_max(v4_max(y[0], y[1]), y[2]));
+}
+
+static int clamp_int(float f, int lo, int hi)
+{
+	int ret = (int)floor(f);
+	return r_min(r_max(ret, lo), hi);
+}
+
+static void raster_tri(occlude_t o, const struct tri4 *t, unsigned int k)
+{
+	int x0, y0, x1, y1, x, y;
+	v4_t step[3], dz, ofs;
+	unsigned int i;
+
+	x0 = clamp_int(t->mins[0][k], 0, o->o_w) & ~3;
+	y0 = clamp_int(t->mins[1][k], 0, o->o_h);
+	x1 = clamp_int(t->maxs[0][k] + 1.0, 0, o->o_w);
+	y1 = clamp_int(t->maxs[1][k] + 1.0, 0, o->o_h);
+
+	ofs = v4_set(0.5, 1.5, 2.5, 3.5);
+	for(i = 0; i < 3; i++)
+		step[i] = v4_set1(t->e[i][0][k] * 4.0);
+	dz = v4_set1(t->z[0][k] * 4.0);
+
+	for(y = y0; y < y1; y++) {
+		float *row = o->o_depth + y * o->o_w;
+		float py = y + 0.5;
+		v4_t e[3], z, px;
+
+		px = v4_add(v4_set1(x0), ofs);
+		for(i = 0; i < 3; i++) {
+			e[i] = v4_add(v4_mul(v4_set1(t->e[i][0][k]), px),
+				v4_set1(t->e[i][1][k] * py + t->e[i][2][k]));
+		}
+		z = v4_add(v4_mul(v4_set1(t->z[0][k]), px),
+				v4_set1(t->z[1][k] * py + t->z[2][k]));
+
+		for(x = x0; x < x1; x += 4) {
+			v4_t in, d;
+
+			in = v4_and(v4_cmpge(e[0], v4_set1(0.0)),
+				v4_and(v4_cmpge(e[1], v4_set1(0.0)),
+					v4_cmpge(e[2], v4_set1(0.0))));
+			if ( v4_mask(in) ) {
+				d = v4_load(row + x);
+				v4_store(row + x,
+					v4_select(in, v4_min(d, z), d));
+			}
+
+			for(i = 0; i < 3; i++)
+				e[i] = v4_add(e[i], step[i]);
+			z = v4_add(z, dz);
+		}
+	}
+}
+
+/* draw a box as an occluder, only its front faces are needed */
+void occlude_box(occlude_t o, const vec3_t mins, const vec3_t maxs)
+{
+	float v[8][3];
+	unsigned int i, k;
+
+	/* dropping an occluder is always safe */
+	if ( !project_box(o, mins, maxs, v) )
+		return;
+
+	for(i = 0; i < 12; i += 4) {
+		struct tri4 t;
+
+		setup_tri4(&t, v, box_tris + i);
+		for(k = 0; k < 4; k++) {
+			if ( t.area[k] > 0.0 )
+				raster_tri(o, &t, k);
+		}
+	}
+}
+
+/* returns non-zero if any part of the box may be visible */
+int occlude_test(occlude_t o, const vec3_t mins, const vec3_t maxs)
+{
+	float v[8][3], bmins[3], bmaxs[3];
+	int x0, y0, x1, y1, x, y;
+	unsigned int i, j;
+	v4_t zmin;
+
+	if ( !project_box(o, mins, maxs, v) )
+		return 1;
+
+	for(j = 0; j < 3; j++)
+		bmins[j] = bmaxs[j] = v[0][j];
+	for(i = 1; i < 8; i++) {
+		for(j = 0; j < 3; j++) {
+			bmins[j] = f_min(bmins[j], v[i][j]);
+			bmaxs[j] = f_max(bmaxs[j], v[i][j]);
+		}
+	}
+
+	x0 = clamp_int(bmins[0], 0, o->o_w) & ~3;
+	y0 = clamp_int(bmins[1], 0, o->o_h);
+	x1 = clamp_int(bmaxs[0] + 1.0, 0, o->o_w);
+	y1 = clamp_int(bmaxs[1] + 1.0, 0, o->o_h);
+
+	/* frustum culling deals with anything off-screen */
+	if ( x0 >= x1 || y0 >= y1 )
+		return 1;
+
+	zmin = v4_set1(bmins[2]);
+	for(y = y0; y < y1; y++) {
+		const float *row = o->o_depth + y * o->o_w;
+
+		for(x = x0; x < x1; x += 4) {
+			if ( v4_mask(v4_cmpge(v4_load(row + x), zmin)) )
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PARTICLES_INTERNAL_H
+#define _PARTICLES_INTERNAL_H
+
+#include "list.h"
+
+/* A particle system is just an emitter, its particles live in a pool
+ * shared by all of them which is kept under particles_max by evicting
+ * those of lower priority, then the oldest. A system is freed once it
+ * has no references and no live particles.
+*/
+#define PARTICLES_DEFAULT_MAX	(1U << 17)
+
+struct _particles {
+	texture_t p_sprite;
+	struct list_head p_list;
+	unsigned int p_prio;
+	unsigned int p_num; /* live particles in the pool */
+	unsigned int p_ref;
+	unsigned int p_group; /* scratch for particles_snap() */
+};
+
+extern unsigned int particles_max;
+
+/* every live particle system */
+extern struct list_head particles;
+
+/* What the render thread gets of each particle, and of each group of
+ * systems sharing a sprite. One system in the group is referenced to keep
+ * the sprite, the group's particles are a range of s_part.
+*/
+struct particle_view {
+	vec3_t pos; /* as of the last tick */
+	vec3_t velocity;
+	vec4_t color;
+};
+
+struct particles_view {
+	struct _particles *v_sys;
+	unsigned int v_first;
+	unsigned int v_num;
+};
+
+struct _particles_snap {
+	struct particles_view *s_sys;
+	struct particle_view *s_part;
+	unsigned int s_num_sys;
+	unsigned int s_max_sys;
+	unsigned int s_num_part;
+	unsigned int s_max_part;
+};
+
+#endif /* _PARTICLES_INTERNAL_H */
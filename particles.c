@@ -5,40 +5,104 @@
 #include <punani/punani.h>
 #include <punani/renderer.h>
 #include <punani/vec.h>
-#include <punani/punani_gl.h>
 #include <punani/particles.h>
-#include <punani/cvar.h>
-#include "list.h"
-#include "hgang.h"
+#include <punani/rng.h>
+#include "tex-internal.h"
+#include "particles-internal.h"
+#include "simd.h"
 
-struct plerp {
-	vec3_t pos;
-	vec4_t color;
-};
+#include <stddef.h>
+
+LIST_HEAD(particles);
 
-struct particle {
-	struct particle *next;
-	struct plerp cur;
-	struct plerp old;
-	vec3_t velocity;
-	unsigned int lifetime;
+unsigned int particles_max = PARTICLES_DEFAULT_MAX;
+
+/* Every particle of every system lives in the one pool, as one array per
+ * component so the tick kernel can work four particles at a time. Arrays
+ * are padded to a multiple of four and 16 byte aligned, dead particles
+ * are swapped with the last.
+*/
+struct particle_pool {
+	void *pp_buf;
+	float *pp_pos[3];
+	float *pp_old[3];
+	float *pp_vel[3];
+	float *pp_color[3];
+	float *pp_alpha;
+	float *pp_life; /* ticks to go, whole numbers */
+	struct _particles **pp_owner;
+	unsigned int pp_num;
+	unsigned int pp_max;
 };
 
-/* particles system */
-struct _particles {
-	texture_t p_sprite;
-	struct list_head p_list;
-	struct particle *p_active;
-	hgang_t p_mem;
-	unsigned int p_ref;
+static struct particle_pool pool;
+
+/* every per-particle float array, for growing and moving particles */
+static const size_t comp_off[] = {
+	offsetof(struct particle_pool, pp_pos[0]),
+	offsetof(struct particle_pool, pp_pos[1]),
+	offsetof(struct particle_pool, pp_pos[2]),
+	offsetof(struct particle_pool, pp_old[0]),
+	offsetof(struct particle_pool, pp_old[1]),
+	offsetof(struct particle_pool, pp_old[2]),
+	offsetof(struct particle_pool, pp_vel[0]),
+	offsetof(struct particle_pool, pp_vel[1]),
+	offsetof(struct particle_pool, pp_vel[2]),
+	offsetof(struct particle_pool, pp_color[0]),
+	offsetof(struct particle_pool, pp_color[1]),
+	offsetof(struct particle_pool, pp_color[2]),
+	offsetof(struct particle_pool, pp_alpha),
+	offsetof(struct particle_pool, pp_life),
 };
+#define NUM_COMP	(sizeof(comp_off)/sizeof(*comp_off))
+#define COMP(p, i)	(*(float **)((uint8_t *)(p) + comp_off[i]))
 
-static LIST_HEAD(particles);
+/* Arrays are spaced a cache line further apart than they need be. With
+ * the power of two sizes the pool grows by, they'd otherwise all map to
+ * the same cache sets.
+*/
+#define POOL_PAD	16
 
-static unsigned int var_points = 1;
-static unsigned int var_point_sprites = 1;
+/* eviction sorts by remaining life in to this many buckets */
+#define EVICT_BUCKETS	64
 
-particles_t particles_new(unsigned int max)
+static int pool_grow(unsigned int max)
+{
+	struct particle_pool tmp;
+	unsigned int i, stride;
+	float *buf;
+
+	/* the kernel always loads four particles at a time */
+	max = (max + 3) & ~3U;
+	stride = max + POOL_PAD;
+
+	tmp.pp_buf = calloc(1, NUM_COMP * stride * sizeof(*buf) +
+				max * sizeof(*tmp.pp_owner) + 15);
+	if ( NULL == tmp.pp_buf )
+		return 0;
+
+	buf = (float *)(((uintptr_t)tmp.pp_buf + 15) & ~(uintptr_t)15);
+	for(i = 0; i < NUM_COMP; i++) {
+		COMP(&tmp, i) = buf + i * stride;
+		if ( pool.pp_num )
+			memcpy(COMP(&tmp, i), COMP(&pool, i),
+				pool.pp_num * sizeof(*buf));
+		COMP(&pool, i) = COMP(&tmp, i);
+	}
+
+	tmp.pp_owner = (struct _particles **)(buf + NUM_COMP * stride);
+	if ( pool.pp_num )
+		memcpy(tmp.pp_owner, pool.pp_owner,
+			pool.pp_num * sizeof(*tmp.pp_owner));
+	pool.pp_owner = tmp.pp_owner;
+
+	free(pool.pp_buf);
+	pool.pp_buf = tmp.pp_buf;
+	pool.pp_max = max;
+	return 1;
+}
+
+particles_t particles_new(texture_t sprite, unsigned int prio)
 {
 	struct _particles *p;
 
@@ -46,148 +110,155 @@ particles_t particles_new(unsigned int max)
 	if ( NULL == p )
 		goto out;
 
-	p->p_mem = hgang_new(sizeof(*p->p_active), max);
-	if ( NULL == p->p_mem )
-		goto out_free;
-
-	p->p_sprite = png_get_by_name("data/smoke.png");
-	if ( NULL == p->p_sprite )
-		goto out_free_mem;
+	tex_get(sprite);
+	p->p_sprite = sprite;
+	p->p_prio = prio;
 
 	/* success */
 	list_add_tail(&p->p_list, &particles);
 	p->p_ref = 1;
-	goto out;
-
-out_free_mem:
-	hgang_free(p->p_mem);
-out_free:
-	free(p);
-	p = NULL;
 out:
 	return p;
 }
 
-static void particle_tick(struct particle *pp)
+static void particle_tick(unsigned int i)
 {
-	v_copy(pp->old.pos, pp->cur.pos);
-	v_add(pp->cur.pos, pp->cur.pos, pp->velocity);
-	pp->cur.color[3] *= 0.950;
+	unsigned int j;
+
+	for(j = 0; j < 3; j++) {
+		pool.pp_old[j][i] = pool.pp_pos[j][i];
+		pool.pp_pos[j][i] += pool.pp_vel[j][i];
+	}
+	pool.pp_alpha[i] *= 0.950;
 }
 
-void particles_think(particles_t p)
+/* A system goes once it has no references and no live particles */
+static void particles_put(struct _particles *p)
 {
-	struct particle *arr, *tmp, *pp;
-
-	if ( NULL == p->p_active )
-		return;
+	if ( !p->p_ref && !p->p_num )
+		particles_free(p);
+}
 
-	arr = p->p_active;
-	p->p_active = NULL;
-
-	for(pp = arr, tmp = pp->next; pp; pp = tmp, tmp = (pp) ? pp->next : NULL) {
-		if ( !pp->lifetime ) {
-			hgang_return(p->p_mem, pp);
-			p->p_ref--;
-			continue;
-		}else{
-			pp->next = p->p_active;
-			p->p_active = pp;
-			pp->lifetime--;
-			particle_tick(pp);
-		}
+/* Safe from the top down, anything swapped in has already been visited */
+static void particle_remove(unsigned int i)
+{
+	struct _particles *p = pool.pp_owner[i];
+	unsigned int last, j;
+
+	last = --pool.pp_num;
+	if ( i != last ) {
+		for(j = 0; j < NUM_COMP; j++)
+			COMP(&pool, j)[i] = COMP(&pool, j)[last];
+		pool.pp_owner[i] = pool.pp_owner[last];
 	}
 
-	if ( !p->p_ref )
-		particles_free(p);
+	p->p_num--;
+	particles_put(p);
 }
 
-static void particles_render(particles_t p, renderer_t r, float lerp)
+static unsigned int life_bucket(float life)
 {
-	struct particle *pp;
-	float scale = 2.0;
-
-	glDepthMask(GL_FALSE);
-	glEnable(GL_BLEND);
-	glDisable(GL_LIGHTING);
+	if ( life <= 0.0 )
+		return 0;
+	if ( life >= EVICT_BUCKETS - 1 )
+		return EVICT_BUCKETS - 1;
+	return life;
+}
 
-	if ( !var_points || var_point_sprites ) {
-		glEnable(GL_TEXTURE_2D);
-		texture_bind(p->p_sprite);
-		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-	}
+/* Free up to need slots from particles of priority no higher than prio.
+ * Lowest priority goes first and, within that, those nearest the end of
+ * their life.
+*/
+static unsigned int evict(unsigned int need, unsigned int prio)
+{
+	unsigned int hist[EVICT_BUCKETS];
+	unsigned int pr, i, b, cut, at_cut, acc, freed = 0;
+
+	for(pr = 0; pr <= prio && freed < need; pr++) {
+		memset(hist, 0, sizeof(hist));
+		for(i = 0; i < pool.pp_num; i++) {
+			if ( pool.pp_owner[i]->p_prio == pr )
+				hist[life_bucket(pool.pp_life[i])]++;
+		}
 
-	if ( var_points ) {
-		if ( var_point_sprites ) {
-			glTexEnvi(GL_POINT_SPRITE,
-					GL_COORD_REPLACE, GL_TRUE);
-			glEnable(GL_POINT_SPRITE);
-			glPointSize(16.0);
-		}else{
-			glPointSize(4.0);
+		/* everything below cut goes, and at_cut of those in it */
+		for(acc = 0, cut = 0; cut < EVICT_BUCKETS; cut++) {
+			if ( acc + hist[cut] >= need - freed )
+				break;
+			acc += hist[cut];
+		}
+		at_cut = (cut < EVICT_BUCKETS) ? need - freed - acc : 0;
+
+		for(i = pool.pp_num; i--; ) {
+			if ( pool.pp_owner[i]->p_prio != pr )
+				continue;
+			b = life_bucket(pool.pp_life[i]);
+			if ( b > cut || (b == cut && !at_cut) )
+				continue;
+			if ( b == cut )
+				at_cut--;
+			particle_remove(i);
+			freed++;
 		}
-		glBegin(GL_POINTS);
 	}
 
-	for(pp = p->p_active; pp; pp = pp->next) {
-		if ( var_points ) {
-			vec3_t pos;
-
-			pos[0] = pp->old.pos[0] + pp->velocity[0] * lerp;
-			pos[1] = pp->old.pos[1] + pp->velocity[1] * lerp;
-			pos[2] = pp->old.pos[2] + pp->velocity[2] * lerp;
-
-			glColor4fv((GLfloat *)pp->cur.color);
-			glVertex3fv((GLfloat *)pos);
-		}else{
-			vec3_t pos, angles;
+	return freed;
+}
 
-			pos[0] = pp->old.pos[0] + pp->velocity[0] * lerp;
-			pos[1] = pp->old.pos[1] + pp->velocity[1] * lerp;
-			pos[2] = pp->old.pos[2] + pp->velocity[2] * lerp;
+/* Four at a time, from the top down, so that dead particles can be
+ * swap-removed in the same pass.
+*/
+void particles_think_all(void)
+{
+	const v4_t fade = v4_set1(0.950), one = v4_set1(1.0);
+	const v4_t zero = v4_set1(0.0);
+	unsigned int base, i, j;
+	int dead;
 
-			glPushMatrix();
-			renderer_translate(r, pos[0], pos[1], pos[2]);
-			renderer_get_viewangles(r, angles);
-			renderer_rotate(r, -angles[0], 1.0, 0.0, 0.0);
-			renderer_rotate(r, -angles[1], 0.0, 1.0, 0.0);
-			renderer_rotate(r, -angles[2], 0.0, 0.0, 1.0);
-			glBegin(GL_QUADS);
-			glColor4fv((GLfloat *)pp->cur.color);
+	/* the budget may have been turned down */
+	if ( pool.pp_num > particles_max )
+		evict(pool.pp_num - particles_max, PARTICLES_PRIO_MAX);
 
-			glTexCoord2f(0.0, 0.0);
-			glVertex3f(-scale, -scale, 0.0);
+	if ( !pool.pp_num )
+		return;
 
-			glTexCoord2f(1.0, 0.0);
-			glVertex3f(scale, -scale, 0.0);
+	base = (pool.pp_num - 1) & ~3U;
+	for(;;) {
+		v4_t life;
 
-			glTexCoord2f(1.0, 1.0);
-			glVertex3f(scale, scale, 0.0);
+		for(j = 0; j < 3; j++) {
+			v4_t pos = v4_load(pool.pp_pos[j] + base);
+			v4_store(pool.pp_old[j] + base, pos);
+			v4_store(pool.pp_pos[j] + base,
+				v4_add(pos, v4_load(pool.pp_vel[j] + base)));
+		}
+		v4_store(pool.pp_alpha + base,
+			v4_mul(v4_load(pool.pp_alpha + base), fade));
 
-			glTexCoord2f(0.0, 1.0);
-			glVertex3f(-scale, scale, 0.0);
+		life = v4_load(pool.pp_life + base);
+		dead = v4_mask(v4_cmple(life, zero));
+		v4_store(pool.pp_life + base, v4_sub(life, one));
 
-			glEnd();
-			glPopMatrix();
+		for(i = 4; dead && i--; ) {
+			if ( (dead & (1 << i)) && base + i < pool.pp_num )
+				particle_remove(base + i);
 		}
-	}
 
-	if ( var_points ) {
-		glEnd();
-		glDisable(GL_POINT_SPRITE);
+		if ( !base )
+			break;
+		base -= 4;
 	}
+}
 
-	glEnable(GL_LIGHTING);
-	glDepthMask(GL_TRUE);
-	glDisable(GL_BLEND);
-	glDisable(GL_TEXTURE_2D);
+unsigned int particles_count(particles_t p)
+{
+	return p->p_num;
 }
 
 void particles_free(particles_t p)
 {
 	if ( p ) {
 		list_del(&p->p_list);
-		hgang_free(p->p_mem);
 		texture_put(p->p_sprite);
 		free(p);
 	}
@@ -196,68 +267,164 @@ void particles_free(particles_t p)
 void particles_unref(particles_t p)
 {
 	p->p_ref--;
-	if ( !p->p_ref ) {
+	particles_put(p);
+}
+
+void particles_free_all(void)
+{
+	struct _particles *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &particles, p_list) {
 		particles_free(p);
 	}
+
+	free(pool.pp_buf);
+	memset(&pool, 0, sizeof(pool));
 }
 
-void particles_render_all(renderer_t r, float lerp)
+particles_snap_t particles_snap_new(void)
 {
-	struct _particles *p;
+	return calloc(1, sizeof(struct _particles_snap));
+}
 
-	list_for_each_entry(p, &particles, p_list) {
-		particles_render(p, r, lerp);
-	}
+static void snap_release(struct _particles_snap *s)
+{
+	unsigned int i;
+
+	for(i = 0; i < s->s_num_sys; i++)
+		particles_unref(s->s_sys[i].v_sys);
+
+	s->s_num_sys = 0;
+	s->s_num_part = 0;
 }
 
-void particles_free_all(void)
+static int snap_reserve(struct _particles_snap *s, unsigned int num)
 {
-	struct _particles *p, *tmp;
+	if ( num > s->s_max_part ) {
+		struct particle_view *new;
+		unsigned int max;
 
-	list_for_each_entry_safe(p, tmp, &particles, p_list) {
-		particles_free(p);
+		for(max = (s->s_max_part) ? s->s_max_part : 256; max < num; )
+			max *= 2;
+
+		new = realloc(s->s_part, max * sizeof(*new));
+		if ( NULL == new )
+			return 0;
+
+		s->s_part = new;
+		s->s_max_part = max;
 	}
-}
 
-static cvar_ns_t cvars;
+	return 1;
+}
 
-void particles_init(void)
+static struct particles_view *snap_sys(struct _particles_snap *s)
 {
-	cvars = cvar_ns_new("particles");
-	cvar_register_uint(cvars, "points", CVAR_FLAG_SAVE_NOTDEFAULT, &var_points);
-	cvar_register_uint(cvars, "sprites", CVAR_FLAG_SAVE_NOTDEFAULT, &var_point_sprites);
+	if ( s->s_num_sys >= s->s_max_sys ) {
+		struct particles_view *new;
+		unsigned int max;
+
+		max = (s->s_max_sys) ? s->s_max_sys * 2 : 8;
+		new = realloc(s->s_sys, max * sizeof(*new));
+		if ( NULL == new )
+			return NULL;
+
+		s->s_sys = new;
+		s->s_max_sys = max;
+	}
 
-	cvar_ns_load(cvars);
+	return &s->s_sys[s->s_num_sys++];
 }
 
-void particles_exit(void)
+/* the group of systems sharing p's sprite, starting one if need be */
+static int snap_group(struct _particles_snap *s, struct _particles *p)
 {
-	if ( NULL != cvars ) {
-		cvar_ns_save(cvars);
-		cvar_ns_free(cvars);
-		cvars = NULL;
+	struct particles_view *v;
+	unsigned int i;
+
+	for(i = 0; i < s->s_num_sys; i++) {
+		if ( s->s_sys[i].v_sys->p_sprite == p->p_sprite )
+			break;
 	}
+
+	if ( i == s->s_num_sys ) {
+		v = snap_sys(s);
+		if ( NULL == v )
+			return 0;
+
+		/* one system keeps the sprite alive for all of them */
+		p->p_ref++;
+		v->v_sys = p;
+		v->v_num = 0;
+	}
+
+	s->s_sys[i].v_num += p->p_num;
+	p->p_group = i;
+	return 1;
 }
 
-void particles_think_all(void)
+/* Copy out every live particle, grouped by sprite so each sprite can be
+ * drawn in one go. The snapshot holds a reference to one system in each
+ * group, dropped the next time it's taken.
+*/
+void particles_snap(particles_snap_t s)
 {
-	struct _particles *p, *tmp;
+	struct _particles *p;
+	unsigned int i, j;
 
-	list_for_each_entry_safe(p, tmp, &particles, p_list) {
-		particles_think(p);
+	snap_release(s);
+
+	if ( !snap_reserve(s, pool.pp_num) )
+		return;
+
+	list_for_each_entry(p, &particles, p_list) {
+		if ( p->p_num && !snap_group(s, p) ) {
+			snap_release(s);
+			return;
+		}
+	}
+
+	for(i = 0; i < s->s_num_sys; i++) {
+		s->s_sys[i].v_first = s->s_num_part;
+		s->s_num_part += s->s_sys[i].v_num;
+		s->s_sys[i].v_num = 0;
+	}
+
+	for(i = 0; i < pool.pp_num; i++) {
+		struct particles_view *v;
+		struct particle_view *pv;
+
+		v = &s->s_sys[pool.pp_owner[i]->p_group];
+		pv = &s->s_part[v->v_first + v->v_num++];
+
+		for(j = 0; j < 3; j++) {
+			pv->pos[j] = pool.pp_old[j][i];
+			pv->velocity[j] = pool.pp_vel[j][i];
+			pv->color[j] = pool.pp_color[j][i];
+		}
+		pv->color[3] = pool.pp_alpha[i];
+	}
+}
+
+void particles_snap_free(particles_snap_t s)
+{
+	if ( s ) {
+		snap_release(s);
+		free(s->s_sys);
+		free(s->s_part);
+		free(s);
 	}
 }
 
 static float crand(void)
 {
-	return (rand() & 32767) * (2.0/32767) - 1;
+	return (rng_next() & 32767) * (2.0/32767) - 1;
 }
 
 /* shamelessly ripped from quake2 */
 void particles_emit(particles_t p, const vec3_t begin, const vec3_t end)
 {
-	struct particle *pp;
-	unsigned int i;
+	unsigned int i, n, need;
 	vec3_t move;
 	vec3_t vec;
 	float len, dec;
@@ -269,30 +436,38 @@ void particles_emit(particles_t p, const vec3_t begin, const vec3_t end)
 	dec = 0.3;
 	v_scale(vec, dec);
 
+	/* over budget, make room for the whole trail up front */
+	need = (len > 0) ? ceil(len / dec) : 0;
+	if ( pool.pp_num + need > particles_max )
+		evict(pool.pp_num + need - particles_max, p->p_prio);
+
 	while(len > 0) {
 		float shade;
 		len -= dec;
 
-		pp = hgang_alloc0(p->p_mem);
-		if ( NULL == pp )
+		if ( pool.pp_num >= particles_max )
+			return;
+		if ( pool.pp_num >= pool.pp_max &&
+				!pool_grow(r_min(r_max(pool.pp_max * 2, 1024),
+						particles_max)) )
 			return;
 
-		pp->next = p->p_active;
-		p->p_active = pp;
-		p->p_ref++;
+		n = pool.pp_num++;
+		pool.pp_owner[n] = p;
+		p->p_num++;
 
-		pp->lifetime = 40;
+		pool.pp_life[n] = 40;
 		shade = crand() * 0.4;
-		pp->cur.color[0] = 0.6 + shade;
-		pp->cur.color[1] = 0.6 + shade;
-		pp->cur.color[2] = 0.6 + shade;
-		pp->cur.color[3] = 0.2;
+		pool.pp_color[0][n] = 0.6 + shade;
+		pool.pp_color[1][n] = 0.6 + shade;
+		pool.pp_color[2][n] = 0.6 + shade;
+		pool.pp_alpha[n] = 0.2;
 
 		for(i = 0; i < 3; i++) {
-			pp->cur.pos[i] = move[i] + crand();
-			pp->velocity[i] = crand() * 0.2;
+			pool.pp_pos[i][n] = move[i] + crand();
+			pool.pp_vel[i][n] = crand() * 0.2;
 		}
-		particle_tick(pp);
+		particle_tick(n);
 		v_add(move, move, vec);
 	}
 }
@@ -0,0 +1,258 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/renderer.h>
+#include <punani/vec.h>
+#include <punani/punani_gl.h>
+#include <punani/particles.h>
+#include <punani/cvar.h>
+#include "particles-internal.h"
+
+#include <stddef.h>
+#include <math.h>
+
+static unsigned int var_points = 1;
+static unsigned int var_point_sprites = 1;
+
+/* Every particle of every system is written in to one buffer each frame
+ * and each system drawn as a range of it. The buffer is orphaned before
+ * it's filled so the driver needn't wait on last frame's draws.
+*/
+struct pvert {
+	GLfloat pos[3];
+	GLfloat color[4];
+	GLfloat tc[2];
+};
+
+static struct pvert *verts;
+static unsigned int max_verts;
+static GLuint vbo;
+static GLsizeiptr vbo_size;
+
+static struct pvert *verts_reserve(unsigned int num)
+{
+	if ( num > max_verts ) {
+		struct pvert *new;
+		unsigned int max;
+
+		for(max = (max_verts) ? max_verts : 1024; max < num; max *= 2)
+			/* nothing */;
+
+		new = realloc(verts, max * sizeof(*new));
+		if ( NULL == new )
+			return NULL;
+
+		verts = new;
+		max_verts = max;
+	}
+
+	return verts;
+}
+
+/* rotate v about one axis, the same way as glRotatef() */
+static void rot_axis(vec3_t v, unsigned int a, unsigned int b, float deg)
+{
+	float rad = deg * (M_PI / 180.0), s = sin(rad), c = cos(rad);
+	float va = v[a], vb = v[b];
+
+	v[a] = va * c - vb * s;
+	v[b] = va * s + vb * c;
+}
+
+/* undo the view rotation to get the screen axes in world space */
+static void view_basis(renderer_t r, vec3_t right, vec3_t up)
+{
+	vec3_t angles;
+
+	renderer_get_viewangles(r, angles);
+
+	right[0] = 1.0;
+	right[1] = right[2] = 0.0;
+	up[1] = 1.0;
+	up[0] = up[2] = 0.0;
+
+	rot_axis(right, 1, 2, -angles[0]);
+	rot_axis(right, 2, 0, -angles[1]);
+	rot_axis(right, 0, 1, -angles[2]);
+	rot_axis(up, 1, 2, -angles[0]);
+	rot_axis(up, 2, 0, -angles[1]);
+	rot_axis(up, 0, 1, -angles[2]);
+}
+
+static void build_points(const struct _particles_snap *s,
+				struct pvert *pv, float lerp)
+{
+	const struct particle_view *p = s->s_part;
+	unsigned int i, j;
+
+	for(i = 0; i < s->s_num_part; i++, p++, pv++) {
+		for(j = 0; j < 3; j++)
+			pv->pos[j] = p->pos[j] + p->velocity[j] * lerp;
+		memcpy(pv->color, p->color, sizeof(pv->color));
+	}
+}
+
+static void build_quads(const struct _particles_snap *s,
+				struct pvert *pv, float lerp,
+				const vec3_t right, const vec3_t up)
+{
+	static const float corner[4][2] = {
+		{0.0, 0.0}, {1.0, 0.0}, {1.0, 1.0}, {0.0, 1.0},
+	};
+	const struct particle_view *p = s->s_part;
+	const float scale = 2.0;
+	unsigned int i, j, k;
+
+	for(i = 0; i < s->s_num_part; i++, p++) {
+		vec3_t pos;
+
+		for(j = 0; j < 3; j++)
+			pos[j] = p->pos[j] + p->velocity[j] * lerp;
+
+		for(k = 0; k < 4; k++, pv++) {
+			float x = (corner[k][0] * 2.0 - 1.0) * scale;
+			float y = (corner[k][1] * 2.0 - 1.0) * scale;
+
+			for(j = 0; j < 3; j++)
+				pv->pos[j] = pos[j] + right[j] * x + up[j] * y;
+			memcpy(pv->color, p->color, sizeof(pv->color));
+			pv->tc[0] = corner[k][0];
+			pv->tc[1] = corner[k][1];
+		}
+	}
+}
+
+/* returns what to hand gl*Pointer(), an offset in to the buffer or the
+ * client side copy if there are no buffer objects
+*/
+static const uint8_t *upload(unsigned int num)
+{
+	GLsizeiptr sz = num * sizeof(*verts);
+
+	if ( !vbo )
+		glGenBuffers(1, &vbo);
+	if ( !vbo )
+		return (const uint8_t *)verts;
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	if ( sz > vbo_size ) {
+		for(vbo_size = (vbo_size) ? vbo_size : 65536; vbo_size < sz; )
+			vbo_size *= 2;
+	}
+	glBufferData(GL_ARRAY_BUFFER, vbo_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sz, verts);
+	return NULL;
+}
+
+void particles_render_all(particles_snap_t s, renderer_t r, float lerp)
+{
+	const uint8_t *base;
+	unsigned int i, per, num;
+	vec3_t right, up;
+	GLenum mode;
+
+	if ( !s->s_num_part )
+		return;
+
+	per = (var_points) ? 1 : 4;
+	num = s->s_num_part * per;
+	if ( NULL == verts_reserve(num) )
+		return;
+
+	if ( var_points ) {
+		build_points(s, verts, lerp);
+		mode = GL_POINTS;
+	}else{
+		view_basis(r, right, up);
+		build_quads(s, verts, lerp, right, up);
+		mode = GL_QUADS;
+	}
+
+	base = upload(num);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	glDisable(GL_LIGHTING);
+
+	if ( !var_points || var_point_sprites ) {
+		glEnable(GL_TEXTURE_2D);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	}
+
+	if ( var_points ) {
+		if ( var_point_sprites ) {
+			glTexEnvi(GL_POINT_SPRITE,
+					GL_COORD_REPLACE, GL_TRUE);
+			glEnable(GL_POINT_SPRITE);
+			glPointSize(16.0);
+		}else{
+			glPointSize(4.0);
+		}
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(*verts),
+			base + offsetof(struct pvert, pos));
+	glColorPointer(4, GL_FLOAT, sizeof(*verts),
+			base + offsetof(struct pvert, color));
+	if ( !var_points ) {
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(*verts),
+				base + offsetof(struct pvert, tc));
+	}
+
+	for(i = 0; i < s->s_num_sys; i++) {
+		const struct particles_view *v = &s->s_sys[i];
+
+		if ( !var_points || var_point_sprites )
+			texture_bind(v->v_sys->p_sprite);
+		glDrawArrays(mode, v->v_first * per, v->v_num * per);
+	}
+
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	if ( vbo )
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if ( var_points )
+		glDisable(GL_POINT_SPRITE);
+
+	glEnable(GL_LIGHTING);
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+	glDisable(GL_TEXTURE_2D);
+}
+
+static cvar_ns_t cvars;
+
+void particles_init(void)
+{
+	cvars = cvar_ns_new("particles");
+	cvar_register_uint(cvars, "points", CVAR_FLAG_SAVE_NOTDEFAULT, &var_points);
+	cvar_register_uint(cvars, "sprites", CVAR_FLAG_SAVE_NOTDEFAULT, &var_point_sprites);
+	cvar_register_uint(cvars, "max", CVAR_FLAG_SAVE_NOTDEFAULT, &particles_max);
+
+	cvar_ns_load(cvars);
+}
+
+void particles_exit(void)
+{
+	if ( vbo ) {
+		glDeleteBuffers(1, &vbo);
+		vbo = 0;
+		vbo_size = 0;
+	}
+	free(verts);
+	verts = NULL;
+	max_verts = 0;
+
+	if ( NULL != cvars ) {
+		cvar_ns_save(cvars);
+		cvar_ns_free(cvars);
+		cvars = NULL;
+	}
+}
@@ -0,0 +1,77 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/renderer.h>
+#include <punani/tex.h>
+#include <punani/prefab.h>
+
+struct _prefab {
+	const char *pf_name;
+	const char *pf_sprite;
+
+	texture_t pf_tex;
+	unsigned int pf_ref;
+};
+
+static struct _prefab prefabs[] = {
+	{
+		.pf_name = "hydra",
+		.pf_sprite = "data/smoke.png",
+	},
+};
+
+#define NUM_PREFABS (sizeof(prefabs)/sizeof(*prefabs))
+
+static int load(struct _prefab *pf)
+{
+	if ( pf->pf_sprite ) {
+		pf->pf_tex = png_get_by_name(pf->pf_sprite);
+		if ( NULL == pf->pf_tex )
+			goto err;
+	}
+
+	return 1;
+
+err:
+	con_printf("prefab: %s: failed to load\n", pf->pf_name);
+	return 0;
+}
+
+prefab_t prefab_get(const char *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < NUM_PREFABS; i++) {
+		struct _prefab *pf = prefabs + i;
+
+		if ( strcmp(name, pf->pf_name) )
+			continue;
+
+		if ( !pf->pf_ref && !load(pf) )
+			return NULL;
+
+		pf->pf_ref++;
+		return pf;
+	}
+
+	con_printf("prefab: %s: not found\n", name);
+	return NULL;
+}
+
+void prefab_put(prefab_t pf)
+{
+	if ( pf ) {
+		pf->pf_ref--;
+		if ( !pf->pf_ref ) {
+			texture_put(pf->pf_tex);
+			pf->pf_tex = NULL;
+		}
+	}
+}
+
+texture_t prefab_sprite(prefab_t pf)
+{
+	return pf->pf_tex;
+}
@@ -12,9 +12,13 @@
 #include <punani/punani_gl.h>
 #include <punani/cvar.h>
 #include <punani/tex.h>
+#include <punani/timer.h>
+#include <punani/console.h>
 
 #include <SDL.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
 
 #define RENDER_LIGHTS 1
 #include "render-internal.h"
@@ -32,6 +36,30 @@ struct _renderer {
 	float fps;
 	unsigned int vid_wireframe;
 	unsigned int vid_aa;
+
+	/* game ticks per second, everything in the game is tuned to 10 */
+	unsigned int tick_rate;
+	/* most ticks to run in one go before dropping time on the floor */
+	unsigned int tick_max;
+
+	/* timing stats, last tick and frame and running total of drops */
+	unsigned int tick_usec;
+	unsigned int frame_usec;
+	unsigned int ticks_dropped;
+
+	/* run ticks on their own thread, where the game mode allows */
+	unsigned int sim_thread;
+
+	/* when the next tick falls due, only touched by whoever is ticking */
+	uint64_t next_tick;
+
+	/* sim_run is under sim_lock, sim_running is for the main thread */
+	pthread_t sim;
+	pthread_mutex_t sim_lock;
+	pthread_cond_t sim_wake;
+	int sim_run;
+	int sim_running;
+
 	cvar_ns_t cvars;
 };
 
@@ -112,6 +140,16 @@ void renderer_unproject(renderer_t r, vec3_t out,
 	out[2] = a[2] - (d[2] * t);
 }
 
+/* current modelview-projection, column-major like GL */
+void renderer_get_mvp(renderer_t r, mat4_t mvp)
+{
+	mat4_t mv, proj;
+
+	glGetFloatv(GL_MODELVIEW_MATRIX, (GLfloat *)mv);
+	glGetFloatv(GL_PROJECTION_MATRIX, (GLfloat *)proj);
+	mat4_mult(mvp, mv, proj);
+}
+
 /* get trapezoid shape defined by frustums intersection with plane
  * parallel to ground at 'h' in current object coords.
 */
@@ -231,6 +269,16 @@ void renderer_translate(renderer_t r, float x, float y, float z)
 	glTranslatef(x, y, z);
 }
 
+void renderer_push_matrix(renderer_t r)
+{
+	glPushMatrix();
+}
+
+void renderer_pop_matrix(renderer_t r)
+{
+	glPopMatrix();
+}
+
 void renderer_viewangles(renderer_t r, float pitch, float roll, float yaw)
 {
 	r->viewangles[0] = pitch;
@@ -377,15 +425,113 @@ static void render_end(void)
 	SDL_GL_SwapBuffers();
 }
 
+static uint64_t tick_step(struct _renderer *r)
+{
+	return 1000000 / ((r->tick_rate) ? r->tick_rate : 1);
+}
+
+/* Run any ticks which have fallen due, catching up on any we're behind
+ * by, and return how long until the next one.
+*/
+static uint64_t run_ticks(struct _renderer *r)
+{
+	game_t g = r->game;
+	uint64_t now, step, begin, behind;
+	unsigned int n;
+
+	game_lock(g);
+
+	/* cvars may have changed since the last tick */
+	if ( !r->tick_max )
+		r->tick_max = 1;
+	step = tick_step(r);
+
+	now = timer_usec();
+	for(n = 0; now >= r->next_tick; n++) {
+		if ( n >= r->tick_max ) {
+			behind = (now - r->next_tick) / step;
+			r->ticks_dropped += behind;
+			r->next_tick += behind * step;
+			break;
+		}
+		begin = timer_usec();
+		game_tick(g, r->next_tick);
+		r->tick_usec = timer_usec() - begin;
+		r->next_tick += step;
+	}
+
+	game_unlock(g);
+
+	return (r->next_tick > now) ? r->next_tick - now : 0;
+}
+
+static void *sim_main(void *priv)
+{
+	struct _renderer *r = priv;
+	struct timespec ts;
+	uint64_t wait;
+
+	pthread_mutex_lock(&r->sim_lock);
+	while( r->sim_run ) {
+		pthread_mutex_unlock(&r->sim_lock);
+		wait = run_ticks(r);
+		pthread_mutex_lock(&r->sim_lock);
+
+		if ( !r->sim_run || !wait )
+			continue;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wait += ts.tv_nsec / 1000;
+		ts.tv_sec += wait / 1000000;
+		ts.tv_nsec = (wait % 1000000) * 1000;
+		pthread_cond_timedwait(&r->sim_wake, &r->sim_lock, &ts);
+	}
+	pthread_mutex_unlock(&r->sim_lock);
+
+	return NULL;
+}
+
+static void sim_start(struct _renderer *r)
+{
+	if ( r->sim_running )
+		return;
+
+	game_set_threaded(r->game, 1);
+	r->sim_run = 1;
+	if ( pthread_create(&r->sim, NULL, sim_main, r) ) {
+		con_printf("render: unable to start simulation thread\n");
+		game_set_threaded(r->game, 0);
+		r->sim_thread = 0;
+		return;
+	}
+
+	r->sim_running = 1;
+}
+
+static void sim_stop(struct _renderer *r)
+{
+	if ( !r->sim_running )
+		return;
+
+	pthread_mutex_lock(&r->sim_lock);
+	r->sim_run = 0;
+	pthread_cond_signal(&r->sim_wake);
+	pthread_mutex_unlock(&r->sim_lock);
+
+	pthread_join(r->sim, NULL);
+	r->sim_running = 0;
+	game_set_threaded(r->game, 0);
+}
+
 int renderer_main(renderer_t r)
 {
 	SDL_Event e;
-	uint32_t now, nextframe = 0, gl_frames = 0;
-	uint32_t ctr;
-	float lerp;
+	uint64_t now, ctr, begin;
+	uint32_t gl_frames = 0;
 	game_t g = r->game;
 
-	now = ctr = SDL_GetTicks();
+	/* run the first tick straight away */
+	r->next_tick = ctr = timer_usec();
 
 	while( game_state(g) != GAME_STATE_STOPPED ) {
 		/* poll for client input events */
@@ -408,6 +554,7 @@ int renderer_main(renderer_t r)
 					(e.type == SDL_MOUSEBUTTONDOWN));
 				break;
 			case SDL_QUIT:
+				sim_stop(r);
 				game_exit(g);
 				break;
 			default:
@@ -415,33 +562,40 @@ int renderer_main(renderer_t r)
 			}
 		}
 
-		now = SDL_GetTicks();
+		/* modes only change with nothing running in them */
+		if ( game_exit_pending(g) ) {
+			sim_stop(r);
+			game_exit_finish(g);
+			if ( game_state(g) == GAME_STATE_STOPPED )
+				break;
+		}
 
-		/* Run client frames */
-		if ( now >= nextframe ) {
-			nextframe = now + 100;
-			lerp = 0;
-			game_new_frame(g);
+		/* Run client frames here, unless they're on their own thread */
+		if ( r->sim_thread && game_can_thread(g) ) {
+			sim_start(r);
 		}else{
-			lerp = 1.0f - ((float)nextframe - now)/100.0f;
-			if ( lerp > 1.0 )
-				lerp = 1.0;
+			sim_stop(r);
+			run_ticks(r);
 		}
 
 		/* Render a scene */
+		begin = timer_usec();
 		render_begin();
-		game_render(g, lerp);
+		game_render(g, begin, tick_step(r));
 		render_end();
+		r->frame_usec = timer_usec() - begin;
 		gl_frames++;
 
 		/* Calculate FPS */
 		if ( (gl_frames % 10) == 0 ) {
-			r->fps = 10000.0f / (now - ctr);
+			now = timer_usec();
+			r->fps = 10000000.0f / (now - ctr);
 			ctr = now;
 			//con_printf("%f fps\n", r->fps);
 		}
 	}
 
+	sim_stop(r);
 	game_free(g);
 
 	return EXIT_SUCCESS;
@@ -461,6 +615,8 @@ renderer_t renderer_new(game_t g)
 		return r;
 
 	r->game = g;
+	pthread_mutex_init(&r->sim_lock, NULL);
+	pthread_cond_init(&r->sim_wake, NULL);
 
 	r->cvars = cvar_ns_new("render");
 
@@ -470,6 +626,32 @@ renderer_t renderer_new(game_t g)
 	cvar_register_uint(r->cvars, "aa",
 				CVAR_FLAG_SAVE_NOTDEFAULT,
 				&r->vid_aa);
+
+	r->tick_rate = 10;
+	r->tick_max = 5;
+	cvar_register_uint(r->cvars, "tick_rate",
+				CVAR_FLAG_SAVE_NOTDEFAULT,
+				&r->tick_rate);
+	cvar_register_uint(r->cvars, "tick_max",
+				CVAR_FLAG_SAVE_NOTDEFAULT,
+				&r->tick_max);
+	cvar_register_uint(r->cvars, "tick_usec",
+				CVAR_FLAG_SAVE_NEVER,
+				&r->tick_usec);
+	cvar_register_uint(r->cvars, "frame_usec",
+				CVAR_FLAG_SAVE_NEVER,
+				&r->frame_usec);
+	cvar_register_uint(r->cvars, "ticks_dropped",
+				CVAR_FLAG_SAVE_NEVER,
+				&r->ticks_dropped);
+	cvar_register_float(r->cvars, "fps",
+				CVAR_FLAG_SAVE_NEVER,
+				&r->fps);
+
+	r->sim_thread = 1;
+	cvar_register_uint(r->cvars, "sim_thread",
+				CVAR_FLAG_SAVE_NOTDEFAULT,
+				&r->sim_thread);
 	cvar_ns_load(r->cvars);
 
 	particles_init();
@@ -484,6 +666,8 @@ void renderer_free(renderer_t r)
 		cvar_ns_free(r->cvars);
 		particles_exit();
 		SDL_Quit();
+		pthread_cond_destroy(&r->sim_wake);
+		pthread_mutex_destroy(&r->sim_lock);
 		free(r);
 	}
 }
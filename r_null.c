@@ -0,0 +1,276 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/vec.h>
+#include <punani/renderer.h>
+#include <punani/light.h>
+#include <punani/asset.h>
+#include <punani/tile.h>
+#include <math.h>
+
+#include "list.h"
+#include "assetfile.h"
+#include "tex-internal.h"
+
+/* Null renderer for headless builds. Nothing is drawn, and no window,
+ * GL context or image file is ever touched, but the transforms are kept
+ * on the CPU so that anything culling against the view still works.
+*/
+#define NULL_STACK_DEPTH	32
+
+struct _renderer {
+	mat4_t stack[NULL_STACK_DEPTH];
+	unsigned int depth;
+	vec3_t viewangles;
+	int wireframe;
+};
+
+/* every texture is the same empty one */
+static struct _texture null_tex;
+
+static void identity(mat4_t m)
+{
+	unsigned int i;
+
+	memset(m, 0, sizeof(mat4_t));
+	for(i = 0; i < 4; i++)
+		m[i][i] = 1.0;
+}
+
+renderer_t renderer_new(struct _game *g)
+{
+	struct _renderer *r;
+
+	r = calloc(1, sizeof(*r));
+	if ( NULL == r )
+		return NULL;
+
+	identity(r->stack[0]);
+	return r;
+}
+
+void renderer_free(renderer_t r)
+{
+	free(r);
+}
+
+void renderer_size(renderer_t r, unsigned int *x, unsigned int *y)
+{
+	if ( x )
+		*x = 0;
+	if ( y )
+		*y = 0;
+}
+
+int renderer_mode(renderer_t r, const char *title,
+			unsigned int x, unsigned int y,
+			unsigned int depth, unsigned int fullscreen)
+{
+	return 1;
+}
+
+float renderer_fps(renderer_t r)
+{
+	return 0.0;
+}
+
+void renderer_clear_color(renderer_t x, float r, float g, float b)
+{
+}
+
+/* post-multiply the top of the stack, matrices are column-major like GL */
+static void mult_top(renderer_t r, mat4_t m)
+{
+	mat4_t tmp;
+
+	mat4_mult(tmp, (const float (*)[4])m,
+			(const float (*)[4])r->stack[r->depth]);
+	memcpy(r->stack[r->depth], tmp, sizeof(tmp));
+}
+
+void renderer_rotate(renderer_t r, float deg, float x, float y, float z)
+{
+	float len, s, c, ic, rad;
+	mat4_t m;
+
+	len = sqrt(x * x + y * y + z * z);
+	if ( len <= 0.0 )
+		return;
+	x /= len;
+	y /= len;
+	z /= len;
+
+	rad = deg * (M_PI / 180.0);
+	s = sin(rad);
+	c = cos(rad);
+	ic = 1.0 - c;
+
+	identity(m);
+	m[0][0] = x * x * ic + c;
+	m[0][1] = y * x * ic + z * s;
+	m[0][2] = x * z * ic - y * s;
+	m[1][0] = x * y * ic - z * s;
+	m[1][1] = y * y * ic + c;
+	m[1][2] = y * z * ic + x * s;
+	m[2][0] = x * z * ic + y * s;
+	m[2][1] = y * z * ic - x * s;
+	m[2][2] = z * z * ic + c;
+	mult_top(r, m);
+}
+
+void renderer_translate(renderer_t r, float x, float y, float z)
+{
+	mat4_t m;
+
+	identity(m);
+	m[3][0] = x;
+	m[3][1] = y;
+	m[3][2] = z;
+	mult_top(r, m);
+}
+
+void renderer_push_matrix(renderer_t r)
+{
+	assert(r->depth + 1 < NULL_STACK_DEPTH);
+	memcpy(r->stack[r->depth + 1], r->stack[r->depth],
+		sizeof(r->stack[0]));
+	r->depth++;
+}
+
+void renderer_pop_matrix(renderer_t r)
+{
+	assert(r->depth);
+	r->depth--;
+}
+
+void renderer_render_2d(renderer_t r)
+{
+}
+
+void renderer_blit(renderer_t r, texture_t tex, prect_t *src, prect_t *dst)
+{
+}
+
+void renderer_render_3d(renderer_t r)
+{
+	r->depth = 0;
+	identity(r->stack[0]);
+}
+
+void renderer_wireframe(renderer_t r, int wireframe)
+{
+	r->wireframe = wireframe;
+}
+
+int renderer_is_wireframe(renderer_t r)
+{
+	return r->wireframe;
+}
+
+void renderer_viewangles(renderer_t r, float pitch, float roll, float yaw)
+{
+	r->viewangles[0] = pitch;
+	r->viewangles[1] = roll;
+	r->viewangles[2] = yaw;
+}
+
+void renderer_get_viewangles(renderer_t r, vec3_t angles)
+{
+	v_copy(angles, r->viewangles);
+}
+
+void renderer_xlat_eye_to_obj(renderer_t r, vec3_t out, const vec3_t in)
+{
+	v_copy(out, in);
+}
+
+void renderer_xlat_world_to_obj(renderer_t r, vec3_t out, const vec3_t in)
+{
+	v_copy(out, in);
+}
+
+/* there's no viewport, so nothing is on screen */
+void renderer_unproject(renderer_t r, vec3_t out,
+			unsigned int x, unsigned int y, float h)
+{
+	out[0] = 0.0;
+	out[1] = h;
+	out[2] = 0.0;
+}
+
+void renderer_get_frustum_quad(renderer_t r, float h, vec3_t q[4])
+{
+	unsigned int i;
+
+	for(i = 0; i < 4; i++)
+		renderer_unproject(r, q[i], 0, 0, h);
+}
+
+/* no projection either, so this is just the modelview */
+void renderer_get_mvp(renderer_t r, mat4_t mvp)
+{
+	memcpy(mvp, r->stack[r->depth], sizeof(r->stack[0]));
+}
+
+/* asset and tile rendering */
+void asset_file_render_begin(asset_file_t f, renderer_t r, light_t l)
+{
+}
+
+void asset_file_render_end(asset_file_t f)
+{
+}
+
+void asset_file_render_free(struct _asset_file *f)
+{
+}
+
+void asset_render(asset_t a, renderer_t r, light_t l)
+{
+}
+
+void asset_render_bbox(asset_t a, renderer_t r)
+{
+}
+
+void tile_render(tile_t t, renderer_t r, light_t l)
+{
+}
+
+void tile_render_bbox(tile_t t, renderer_t r)
+{
+}
+
+/* textures */
+void tex_get(struct _texture *tex)
+{
+	tex->t_ref++;
+}
+
+texture_t png_get_by_name(const char *name)
+{
+	tex_get(&null_tex);
+	return &null_tex;
+}
+
+void texture_put(texture_t t)
+{
+	if ( t )
+		t->t_ref--;
+}
+
+unsigned int texture_width(texture_t t)
+{
+	return 0;
+}
+
+unsigned int texture_height(texture_t t)
+{
+	return 0;
+}
+
+void texture_bind(texture_t t)
+{
+}
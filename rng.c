@@ -0,0 +1,34 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/rng.h>
+
+/* xorshift32, zero is the one state it can never leave */
+#define RNG_DEFAULT_SEED	0x2545f491
+
+static uint32_t seed = RNG_DEFAULT_SEED;
+static uint32_t state = RNG_DEFAULT_SEED;
+
+void rng_seed(uint32_t s)
+{
+	seed = s;
+	state = (s) ? s : RNG_DEFAULT_SEED;
+}
+
+uint32_t rng_get_seed(void)
+{
+	return seed;
+}
+
+uint32_t rng_next(void)
+{
+	uint32_t x = state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	state = x;
+	return x;
+}
@@ -0,0 +1,100 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#ifndef _PUNANI_SIMD_H
+#define _PUNANI_SIMD_H
+
+/* four float lanes, comparisons yield a per-lane mask which
+ * v4_mask() turns in to one bit per lane
+*/
+#ifdef __SSE__
+#include <xmmintrin.h>
+
+typedef __m128 v4_t;
+#define v4_set1(a)		_mm_set1_ps(a)
+#define v4_set(a, b, c, d)	_mm_set_ps(d, c, b, a)
+#define v4_load(p)		_mm_load_ps(p)
+#define v4_store(p, a)		_mm_store_ps(p, a)
+#define v4_add(a, b)		_mm_add_ps(a, b)
+#define v4_sub(a, b)		_mm_sub_ps(a, b)
+#define v4_mul(a, b)		_mm_mul_ps(a, b)
+#define v4_div(a, b)		_mm_div_ps(a, b)
+#define v4_min(a, b)		_mm_min_ps(a, b)
+#define v4_max(a, b)		_mm_max_ps(a, b)
+#define v4_cmpge(a, b)		_mm_cmpge_ps(a, b)
+#define v4_cmpgt(a, b)		_mm_cmpgt_ps(a, b)
+#define v4_cmple(a, b)		_mm_cmple_ps(a, b)
+#define v4_and(a, b)		_mm_and_ps(a, b)
+#define v4_or(a, b)		_mm_or_ps(a, b)
+#define v4_select(m, a, b)	_mm_or_ps(_mm_and_ps(m, a), \
+					_mm_andnot_ps(m, b))
+#define v4_mask(a)		_mm_movemask_ps(a)
+#else
+/* plain C stand-ins, masks are 0.0 or 1.0 per lane */
+typedef struct {
+	float f[4];
+} v4_t;
+
+#define V4_OP(name, expr) \
+static inline v4_t name(v4_t a, v4_t b) \
+{ \
+	v4_t r; \
+	unsigned int i; \
+	for(i = 0; i < 4; i++) \
+		r.f[i] = (expr); \
+	return r; \
+}
+V4_OP(v4_add, a.f[i] + b.f[i])
+V4_OP(v4_sub, a.f[i] - b.f[i])
+V4_OP(v4_mul, a.f[i] * b.f[i])
+V4_OP(v4_div, a.f[i] / b.f[i])
+V4_OP(v4_min, (a.f[i] < b.f[i]) ? a.f[i] : b.f[i])
+V4_OP(v4_max, (a.f[i] > b.f[i]) ? a.f[i] : b.f[i])
+V4_OP(v4_cmpge, (a.f[i] >= b.f[i]) ? 1.0 : 0.0)
+V4_OP(v4_cmpgt, (a.f[i] > b.f[i]) ? 1.0 : 0.0)
+V4_OP(v4_cmple, (a.f[i] <= b.f[i]) ? 1.0 : 0.0)
+V4_OP(v4_and, (a.f[i] != 0.0 && b.f[i] != 0.0) ? 1.0 : 0.0)
+V4_OP(v4_or, (a.f[i] != 0.0 || b.f[i] != 0.0) ? 1.0 : 0.0)
+
+static inline v4_t v4_set(float a, float b, float c, float d)
+{
+	v4_t r = {{a, b, c, d}};
+	return r;
+}
+
+static inline v4_t v4_set1(float a)
+{
+	return v4_set(a, a, a, a);
+}
+
+static inline v4_t v4_load(const float *p)
+{
+	return v4_set(p[0], p[1], p[2], p[3]);
+}
+
+static inline void v4_store(float *p, v4_t a)
+{
+	memcpy(p, a.f, sizeof(a.f));
+}
+
+static inline v4_t v4_select(v4_t m, v4_t a, v4_t b)
+{
+	unsigned int i;
+	for(i = 0; i < 4; i++)
+		a.f[i] = (m.f[i] != 0.0) ? a.f[i] : b.f[i];
+	return a;
+}
+
+static inline int v4_mask(v4_t a)
+{
+	unsigned int i;
+	int ret = 0;
+	for(i = 0; i < 4; i++)
+		if ( a.f[i] != 0.0 )
+			ret |= (1 << i);
+	return ret;
+}
+#endif
+
+#endif /* _PUNANI_SIMD_H */
@@ -335,11 +335,11 @@ static struct asset_list *asset_list_new(void)
 	if ( NULL == l )
 		goto out;
 
-	l->l_amem = hgang_new(sizeof(struct asset), 0);
+	l->l_amem = hgang_new(sizeof(struct asset), 0, 0);
 	if ( NULL == l->l_amem )
 		goto out_free;
 
-	l->l_rmem = hgang_new(sizeof(struct rcmd), 0);
+	l->l_rmem = hgang_new(sizeof(struct rcmd), 0, 0);
 	if ( NULL == l->l_rmem )
 		goto out_free_amem;
 
@@ -9,12 +9,14 @@
 #include <punani/asset.h>
 #include <punani/tile.h>
 #include <punani/blob.h>
+#include <float.h>
 
 #include "list.h"
 
 #define TILE_INTERNAL 1
 #include "tilefile.h"
 #include "dessert-stroke.h"
+#include "simd.h"
 
 static LIST_HEAD(tiles);
 
@@ -24,6 +26,50 @@ static struct _tile *tile_ref(struct _tile *t)
 	return t;
 }
 
+static int build_bbox(struct _tile *t)
+{
+	unsigned int i, j, num;
+	float *buf;
+
+	/* kernels always load four items at a time */
+	num = (t->t_num_items + 3) & ~3U;
+
+	t->t_bbox_buf = calloc(1, 6 * num * sizeof(*buf) + 15);
+	if ( NULL == t->t_bbox_buf )
+		return 0;
+
+	buf = (float *)(((uintptr_t)t->t_bbox_buf + 15) & ~(uintptr_t)15);
+	for(j = 0; j < 3; j++) {
+		t->t_mins[j] = buf + j * num;
+		t->t_maxs[j] = buf + (j + 3) * num;
+	}
+
+	for(i = 0; i < t->t_num_items; i++) {
+		struct _item *item = &t->t_items[i];
+		vec3_t mins, maxs, off;
+
+		off[0] = item->x;
+		off[1] = item->y;
+		off[2] = item->z;
+		asset_mins(item->asset, mins);
+		asset_maxs(item->asset, maxs);
+		for(j = 0; j < 3; j++) {
+			t->t_mins[j][i] = mins[j] + off[j];
+			t->t_maxs[j][i] = maxs[j] + off[j];
+		}
+	}
+
+	/* pad lanes are inside out, so they fail every overlap test */
+	for(; i < num; i++) {
+		for(j = 0; j < 3; j++) {
+			t->t_mins[j][i] = FLT_MAX;
+			t->t_maxs[j][i] = -FLT_MAX;
+		}
+	}
+
+	return 1;
+}
+
 static struct _tile *tile_open(asset_file_t f, const char *fn)
 {
 	const struct tile_hdr *hdr;
@@ -88,6 +134,11 @@ static struct _tile *tile_open(asset_file_t f, const char *fn)
 		t->t_num_items++;
 	}
 
+	if ( !build_bbox(t) ) {
+		con_printf("tile_open: %s: calloc: %s\n", fn, strerror(errno));
+		goto out_free_all;
+	}
+
 	/* success */
 	t->t_ref = 1;
 	list_add_tail(&t->t_list, &tiles);
@@ -129,80 +180,137 @@ void tile_put(tile_t t)
 			for(i = 0; i < t->t_num_items; i++) {
 				asset_put(t->t_items[i].asset);
 			}
+			free(t->t_bbox_buf);
 			free(t->t_fn);
 			free(t);
 		}
 	}
 }
 
+unsigned int tile_num_items(tile_t t)
+{
+	return t->t_num_items;
+}
+
+asset_t tile_item(tile_t t, unsigned int i, vec3_t origin)
+{
+	struct _item *item = &t->t_items[i];
+
+	assert(i < t->t_num_items);
+	origin[0] = item->x;
+	origin[1] = item->y;
+	origin[2] = item->z;
+	return item->asset;
+}
+
+/* lanes of the group starting at item i which hold real items */
+static unsigned int lane_mask(const struct _tile *t, unsigned int i)
+{
+	unsigned int left = t->t_num_items - i;
+	return (left < 4) ? (1U << left) - 1 : 0xf;
+}
+
+static void item_hit(const struct _tile *t, unsigned int i,
+			struct tile_hit *hit)
+{
+	const struct _item *item = &t->t_items[i];
+
+	hit->asset = item->asset;
+	hit->origin[0] = item->x;
+	hit->origin[1] = item->y;
+	hit->origin[2] = item->z;
+	hit->index = i;
+}
+
 int tile_collide_line(tile_t t, const vec3_t a, const vec3_t b, vec3_t hit)
 {
-	unsigned int i;
-	int ret = 0;
+	float tt[4] __attribute__((aligned(16)));
+	float best = 2.0;
+	unsigned int i, j, k;
+	vec3_t d;
 
-	for(i = 0; i < t->t_num_items; i++) {
-		struct _item *item = &t->t_items[i];
-		vec3_t start, end, h;
-
-		/* translate line segment to item space */
-		v_copy(start, a);
-		v_copy(end, b);
-		start[0] -= item->x;
-		start[1] -= item->y;
-		start[2] -= item->z;
-		end[0] -= item->x;
-		end[1] -= item->y;
-		end[2] -= item->z;
-
-		if ( asset_collide_line(item->asset, start, end, h) ) {
-			/* translate the hit point back to tile space */
-			h[0] += item->x;
-			h[1] += item->y;
-			h[2] += item->z;
-
-			if ( ret ) {
-				vec3_t tmp;
-				float da, db;
-
-				v_sub(tmp, a, hit);
-				da = fabs(v_len(tmp));
-
-				v_sub(tmp, a, h);
-				db = fabs(v_len(tmp));
-
-				if ( db < da )
-					v_copy(hit, h);
-			}else{
-				v_copy(hit, h);
-				ret = 1;
+	v_sub(d, b, a);
+
+	for(i = 0; i < t->t_num_items; i += 4) {
+		v4_t tmin, tmax, in;
+		unsigned int mask;
+
+		tmin = v4_set1(0.0);
+		tmax = v4_set1(1.0);
+		in = v4_cmple(tmin, tmax);
+
+		/* slab test against four boxes, as in collide_box_line */
+		for(j = 0; j < 3; j++) {
+			v4_t mins, maxs, aj, t1, t2, inv;
+
+			mins = v4_load(t->t_mins[j] + i);
+			maxs = v4_load(t->t_maxs[j] + i);
+			aj = v4_set1(a[j]);
+
+			if ( d[j] == 0.0 ) {
+				in = v4_and(in, v4_and(v4_cmple(mins, aj),
+							v4_cmple(aj, maxs)));
+				continue;
 			}
+
+			inv = v4_set1(1.0 / d[j]);
+			t1 = v4_mul(v4_sub(mins, aj), inv);
+			t2 = v4_mul(v4_sub(maxs, aj), inv);
+			tmin = v4_max(tmin, v4_min(t1, t2));
+			tmax = v4_min(tmax, v4_max(t1, t2));
+		}
+
+		in = v4_and(in, v4_cmple(tmin, tmax));
+		mask = v4_mask(in) & lane_mask(t, i);
+		if ( !mask )
+			continue;
+
+		/* keep the hit nearest to a */
+		v4_store(tt, tmin);
+		for(k = 0; k < 4; k++) {
+			if ( (mask & (1U << k)) && tt[k] < best )
+				best = tt[k];
 		}
 	}
 
-	return ret;
+	if ( best > 1.0 )
+		return 0;
+
+	v_copy(hit, d);
+	v_scale(hit, best);
+	v_add(hit, hit, a);
+	return 1;
 }
 
 int tile_collide_sphere(tile_t t, const vec3_t c, float r,
 			tile_cbfn_t cb, void *priv)
 {
-	unsigned int i;
-
-	for(i = 0; i < t->t_num_items; i++) {
-		struct _item *item = &t->t_items[i];
-		vec3_t c2, off;
-
-		off[0] = item->x;
-		off[1] = item->y;
-		off[2] = item->z;
-		v_sub(c2, c, off);
+	v4_t zero = v4_set1(0.0), r2 = v4_set1(r * r);
+	unsigned int i, j, k;
+
+	for(i = 0; i < t->t_num_items; i += 4) {
+		v4_t dmin = zero;
+		unsigned int mask;
+
+		/* squared distance from c to each box */
+		for(j = 0; j < 3; j++) {
+			v4_t cj = v4_set1(c[j]), e;
+
+			e = v4_add(v4_max(v4_sub(v4_load(t->t_mins[j] + i),
+							cj), zero),
+				v4_max(v4_sub(cj, v4_load(t->t_maxs[j] + i)),
+							zero));
+			dmin = v4_add(dmin, v4_mul(e, e));
+		}
 
-		if ( asset_collide_sphere(item->asset, c2, r) ) {
+		mask = v4_mask(v4_cmple(dmin, r2)) & lane_mask(t, i);
+		for(k = 0; k < 4; k++) {
 			struct tile_hit hit;
 
-			hit.asset = item->asset;
-			v_copy(hit.origin, off);
-			hit.index = i;
+			if ( !(mask & (1U << k)) )
+				continue;
 
+			item_hit(t, i + k, &hit);
 			if ( !(*cb)(&hit, priv) )
 				return 0;
 		}
@@ -211,30 +319,51 @@ int tile_collide_sphere(tile_t t, const vec3_t c, float r,
 	return 1;
 }
 
+static v4_t slab_overlap(const struct _tile *t, unsigned int i,
+				unsigned int j,
+				const vec3_t mins, const vec3_t maxs)
+{
+	return v4_and(v4_cmple(v4_load(t->t_mins[j] + i), v4_set1(maxs[j])),
+			v4_cmple(v4_set1(mins[j]), v4_load(t->t_maxs[j] + i)));
+}
+
 int tile_sweep(tile_t t, const struct obb *sweep,
 			tile_cbfn_t cb, void *priv)
 {
-	unsigned int i;
+	vec3_t smins, smaxs;
+	unsigned int i, j, k;
+
+	/* swept bounds rule out most items before the full SAT test */
+	obb_build_aabb(sweep, smins, smaxs);
+	for(j = 0; j < 3; j++) {
+		if ( sweep->vel[j] < 0.0 )
+			smins[j] += sweep->vel[j];
+		else
+			smaxs[j] += sweep->vel[j];
+	}
 
-	for(i = 0; i < t->t_num_items; i++) {
-		struct _item *item = &t->t_items[i];
-		struct obb obb;
-		vec2_t times;
-		vec3_t off;
+	for(i = 0; i < t->t_num_items; i += 4) {
+		v4_t in;
+		unsigned int mask;
 
-		off[0] = item->x;
-		off[1] = item->y;
-		off[2] = item->z;
-		memcpy(&obb, sweep, sizeof(obb));
-		v_sub(obb.origin, obb.origin, off);
+		in = slab_overlap(t, i, 0, smins, smaxs);
+		for(j = 1; j < 3; j++)
+			in = v4_and(in, slab_overlap(t, i, j, smins, smaxs));
 
-		if ( asset_sweep(item->asset, &obb, times) ) {
+		mask = v4_mask(in) & lane_mask(t, i);
+		for(k = 0; k < 4; k++) {
 			struct tile_hit hit;
+			struct obb obb;
+
+			if ( !(mask & (1U << k)) )
+				continue;
+
+			item_hit(t, i + k, &hit);
+			memcpy(&obb, sweep, sizeof(obb));
+			v_sub(obb.origin, obb.origin, hit.origin);
 
-			hit.asset = item->asset;
-			v_copy(hit.origin, off);
-			memcpy(hit.times, times, sizeof(hit.times));
-			hit.index = i;
+			if ( !asset_sweep(hit.asset, &obb, hit.times) )
+				continue;
 
 			if ( !(*cb)(&hit, priv) )
 				return 0;
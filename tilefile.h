@@ -41,6 +41,15 @@ struct _tile {
 	char *t_fn;
 	unsigned int t_ref;
 	unsigned int t_num_items;
+
+	/* tile space item bounds, one array per axis, padded out
+	 * to a multiple of four with inside out boxes which fail any
+	 * overlap test, the kernels mask those lanes off as well
+	*/
+	float *t_mins[3];
+	float *t_maxs[3];
+	void *t_bbox_buf;
+
 	struct _item t_items[0];
 };
 #endif
@@ -0,0 +1,33 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/timer.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+uint64_t timer_usec(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if ( !freq.QuadPart )
+		QueryPerformanceFrequency(&freq);
+
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((now.QuadPart * 1000000.0) / freq.QuadPart);
+}
+#else
+#include <time.h>
+
+uint64_t timer_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+#endif
@@ -0,0 +1,85 @@
+/* This file is part of punani-strike
+ * Copyright (c) 2012 Gianni Tedesco
+ * Released under the terms of GPLv3
+*/
+#include <punani/punani.h>
+#include <punani/tribuf.h>
+#include <pthread.h>
+
+#define TRIBUF_BACK	0
+#define TRIBUF_READY	1
+#define TRIBUF_FRONT	2
+
+struct _tribuf {
+	pthread_mutex_t t_lock;
+	void *t_buf[3];
+	int t_fresh; /* ready holds something the reader hasn't seen */
+	int t_valid; /* front has been published at least once */
+};
+
+tribuf_t tribuf_new(void *a, void *b, void *c)
+{
+	struct _tribuf *t;
+
+	t = calloc(1, sizeof(*t));
+	if ( NULL == t )
+		return NULL;
+
+	pthread_mutex_init(&t->t_lock, NULL);
+	t->t_buf[TRIBUF_BACK] = a;
+	t->t_buf[TRIBUF_READY] = b;
+	t->t_buf[TRIBUF_FRONT] = c;
+	return t;
+}
+
+/* writer only, the buffer is its own until the next publish */
+void *tribuf_back(tribuf_t t)
+{
+	return t->t_buf[TRIBUF_BACK];
+}
+
+void tribuf_publish(tribuf_t t)
+{
+	void *tmp;
+
+	pthread_mutex_lock(&t->t_lock);
+	tmp = t->t_buf[TRIBUF_READY];
+	t->t_buf[TRIBUF_READY] = t->t_buf[TRIBUF_BACK];
+	t->t_buf[TRIBUF_BACK] = tmp;
+	t->t_fresh = 1;
+	pthread_mutex_unlock(&t->t_lock);
+}
+
+/* reader only, NULL until something is published */
+void *tribuf_front(tribuf_t t)
+{
+	void *tmp;
+
+	pthread_mutex_lock(&t->t_lock);
+	if ( t->t_fresh ) {
+		tmp = t->t_buf[TRIBUF_FRONT];
+		t->t_buf[TRIBUF_FRONT] = t->t_buf[TRIBUF_READY];
+		t->t_buf[TRIBUF_READY] = tmp;
+		t->t_fresh = 0;
+		t->t_valid = 1;
+	}
+	tmp = (t->t_valid) ? t->t_buf[TRIBUF_FRONT] : NULL;
+	pthread_mutex_unlock(&t->t_lock);
+
+	return tmp;
+}
+
+/* all three, in no particular order, for when neither side is running */
+void *tribuf_buf(tribuf_t t, unsigned int i)
+{
+	assert(i < 3);
+	return t->t_buf[i];
+}
+
+void tribuf_free(tribuf_t t)
+{
+	if ( t ) {
+		pthread_mutex_destroy(&t->t_lock);
+		free(t);
+	}
+}
@@ -5,79 +5,44 @@
 #include <punani/punani.h>
 #include <punani/vec.h>
 
-static int intersect(float fDst1, float fDst2,
-			   const vec3_t a, const vec3_t b, vec3_t hit)
+/* slab test, hit is where the segment a->b first enters the box */
+int collide_box_line(const vec3_t mins, const vec3_t maxs,
+			const vec3_t a, const vec3_t b, vec3_t hit)
 {
-	if ((fDst1 * fDst2) >= 0.0f)
-		return 0;
-	if (fDst1 == fDst2)
-		return 0;
+	float tmin = 0.0, tmax = 1.0;
+	unsigned int i;
+	vec3_t d;
 
-	//v_sub(hit, b, a);
-	//v_add(hit, a);
-	v_copy(hit, b);
-	v_scale(hit, (-fDst1 / (fDst2 - fDst1)));
-	return 1;
-}
+	v_sub(d, b, a);
 
-static int in_box(vec3_t hit, const vec3_t mins, const vec3_t maxs,
-		 const int Axis)
-{
-	if (Axis == 1 && hit[2] > mins[2] && hit[2] < maxs[2]
-	    && hit[1] > mins[1]
-	    && hit[1] < maxs[1])
-		return 1;
-	if (Axis == 2 && hit[2] > mins[2] && hit[2] < maxs[2]
-	    && hit[0] > mins[0]
-	    && hit[0] < maxs[0])
-		return 1;
-	if (Axis == 3 && hit[0] > mins[0] && hit[0] < maxs[0]
-	    && hit[1] > mins[1]
-	    && hit[1] < maxs[1])
-		return 1;
-	return 0;
-}
+	for(i = 0; i < 3; i++) {
+		float t1, t2, inv;
 
-int collide_box_line(const vec3_t mins, const vec3_t maxs,
-			const vec3_t a, const vec3_t b, vec3_t hit)
-{
-	/* fast checks, both ends of line on same side of 6 planes */
-	if (b[0] < mins[0] && a[0] < mins[0])
-		return 0;
-	if (b[0] > maxs[0] && a[0] > maxs[0])
-		return 0;
-	if (b[1] < mins[1] && a[1] < mins[1])
-		return 0;
-	if (b[1] > maxs[1] && a[1] > maxs[1])
-		return 0;
-	if (b[2] < mins[2] && a[2] < mins[2])
-		return 0;
-	if (b[2] > maxs[2] && a[2] > maxs[2])
-		return 0;
+		if ( d[i] == 0.0 ) {
+			if ( a[i] < mins[i] || a[i] > maxs[i] )
+				return 0;
+			continue;
+		}
 
-	/* start inside box */
-	if (a[0] > mins[0] && a[0] < maxs[0] &&
-	    a[1] > mins[1] && a[1] < maxs[1] &&
-	    a[2] > mins[2] && a[2] < maxs[2]) {
-		v_copy(hit, a);
-		return 1;
+		inv = 1.0 / d[i];
+		t1 = (mins[i] - a[i]) * inv;
+		t2 = (maxs[i] - a[i]) * inv;
+		if ( t1 > t2 ) {
+			float tmp = t1;
+			t1 = t2;
+			t2 = tmp;
+		}
+
+		tmin = f_max(tmin, t1);
+		tmax = f_min(tmax, t2);
+		if ( tmin > tmax )
+			return 0;
 	}
 
-	if ((intersect(a[0] - mins[0], b[0] - mins[0], a, b, hit)
-	     && in_box(hit, mins, maxs, 1))
-	    || (intersect(a[1] - mins[1], b[1] - mins[1], a, b, hit)
-		&& in_box(hit, mins, maxs, 2))
-	    || (intersect(a[2] - mins[2], b[2] - mins[2], a, b, hit)
-		&& in_box(hit, mins, maxs, 3))
-	    || (intersect(a[0] - maxs[0], b[0] - maxs[0], a, b, hit)
-		&& in_box(hit, mins, maxs, 1))
-	    || (intersect(a[1] - maxs[1], b[1] - maxs[1], a, b, hit)
-		&& in_box(hit, mins, maxs, 2))
-	    || (intersect(a[2] - maxs[2], b[2] - maxs[2], a, b, hit)
-		&& in_box(hit, mins, maxs, 3)))
-		return 1;
-
-	return 0;
+	v_copy(hit, d);
+	v_scale(hit, tmin);
+	v_add(hit, hit, a);
+	return 1;
 }
 
 #define A(row,col)  (a[row][col])
@@ -344,15 +309,42 @@ static const struct cp_plane pcp[] = {
 	},
 };
 
+/* narrow [times[0], times[1]] to when |p + (p2 - p) * t| <= r, fails if
+ * the boxes are separated along this axis for the whole move
+*/
+static int sat_axis(float p, float p2, float r, vec2_t times)
+{
+	float dp = p2 - p, t1, t2;
+
+	if ( dp == 0.0 )
+		return (fabs(p) <= r);
+
+	t1 = (-r - p) / dp;
+	t2 = (r - p) / dp;
+	if ( t1 > t2 ) {
+		float tmp = t1;
+		t1 = t2;
+		t2 = tmp;
+	}
+
+	times[0] = f_max(times[0], t1);
+	times[1] = f_min(times[1], t2);
+	return (times[0] <= times[1]);
+}
+
+/* keeps edge cross products of near-parallel axes from going to zero */
+#define SAT_EPSILON 1e-6
+
 int collide_obb(const struct obb *a, const struct obb *b, vec2_t times)
 {
-	mat3_t D;
+	mat3_t D, AD;
 	vec3_t v, T, w, W;
 	float ra, rb, p, p2;
 	unsigned i, k;
 
+	/* b moves relative to a over the normalized interval [0, 1] */
 	times[0] = 0.0;
-	times[1] = 0.0;
+	times[1] = 1.0;
 
 	/* compute displacement between 2 centres */
 	v_sub(v, b->origin, a->origin);
@@ -377,36 +369,34 @@ int collide_obb(const struct obb *a, const struct obb *b, vec2_t times)
 	for (i = 0; i < 3; i++) {
 		for (k = 0; k < 3; k++) {
 			D[i][k] = v_dot_product(a->rot[i], b->rot[k]);
+			AD[i][k] = fabs(D[i][k]) + SAT_EPSILON;
 		}
 	}
 
 	/* ALGORITHM: Use the separating axis test for all 15 potential
-	 * separating axes. If a separating axis could not be found, the
-	 * twoboxes overlap.
+	 * separating axes. Along each axis the projected distance between
+	 * the centres moves linearly with time, which gives an interval in
+	 * which the projections overlap. The boxes touch when all 15 of
+	 * those intervals overlap, first at times[0] and last at times[1].
 	*/
 
 	/* a's basis vectors */
 	for (i = 0; i < 3; i++) {
 		ra = a->dim[i];
-		rb = b->dim[0] * fabs(D[i][0]) +
-			b->dim[1] * fabs(D[i][1]) +
-			b->dim[2] * fabs(D[i][2]);
+		rb = b->dim[0] * AD[i][0] +
+			b->dim[1] * AD[i][1] +
+			b->dim[2] * AD[i][2];
 		p = T[i];
 		p2 = T[i] + W[i];
-		if (p > ra + rb ) {
-			if ( p2 > ra + rb )
-				return 0;
-		}else if ( p < -(ra + rb) ) {
-			if ( p2 < -(ra + rb) )
-				return 0;
-		}
+		if ( !sat_axis(p, p2, ra + rb, times) )
+			return 0;
 	}
 
 	/* b's basis vectors */
 	for (i = 0; i < 3; i++) {
-		ra = a->dim[0] * fabs(D[0][i]) +
-			a->dim[1] * fabs(D[1][i]) +
-			a->dim[2] * fabs(D[2][i]);
+		ra = a->dim[0] * AD[0][i] +
+			a->dim[1] * AD[1][i] +
+			a->dim[2] * AD[2][i];
 		rb = b->dim[i];
 		p = T[0] * D[0][i] +
 			T[1] * D[1][i] +
@@ -414,56 +404,27 @@ int collide_obb(const struct obb *a, const struct obb *b, vec2_t times)
 		p2 = (T[0] + W[0]) * D[0][i] +
 			(T[1] + W[1]) * D[1][i] +
 			(T[2] + W[2]) * D[2][i];
-		if (p > ra + rb ) {
-			if ( p2 > ra + rb )
-				return 0;
-		}else if ( p < -(ra + rb) ) {
-			if ( p2 < -(ra + rb) )
-				return 0;
-		}
+		if ( !sat_axis(p, p2, ra + rb, times) )
+			return 0;
 	}
 
 	/* 9 cross products */
 	for(i = 0; i < sizeof(pcp)/sizeof(*pcp); i++ ) {
 		const struct cp_plane *cp = &pcp[i];
 
-		ra = a->dim[cp->ad1] * fabs(D[cp->arx1][cp->ary1]) +
-			a->dim[cp->ad2] * fabs(D[cp->arx2][cp->ary2]);
-		rb = b->dim[cp->bd1] * fabs(D[cp->brx1][cp->bry1]) +
-			b->dim[cp->bd2] * fabs(D[cp->brx2][cp->bry2]);
+		ra = a->dim[cp->ad1] * AD[cp->arx1][cp->ary1] +
+			a->dim[cp->ad2] * AD[cp->arx2][cp->ary2];
+		rb = b->dim[cp->bd1] * AD[cp->brx1][cp->bry1] +
+			b->dim[cp->bd2] * AD[cp->brx2][cp->bry2];
 		p = T[cp->td1] * D[cp->tx1][cp->ty1] -
 				T[cp->td2] * D[cp->tx2][cp->ty2];
 		p2 = (T[cp->td1] + W[cp->td1]) * D[cp->tx1][cp->ty1] -
 				(T[cp->td2] + W[cp->td2]) * D[cp->tx2][cp->ty2];
-
-		if (p > ra + rb ) {
-			if ( p2 > ra + rb )
-				return 0;
-		}else if ( p < -(ra + rb) ) {
-			if ( p2 < -(ra + rb) )
-				return 0;
-		}
-	}
-
-	/* TODO: 6 tests for intersection for a subset of the time period */
-	for(i = 0; i < 3; i++) {
+		if ( !sat_axis(p, p2, ra + rb, times) )
+			return 0;
 	}
 
-
 	/* no separating axis found, threfore the two boxes overlap */
-#if 0
-	printf("\n");
-	printf("A = %f,%f,%f %f,%f,%f\n",
-		a->origin[0], a->origin[1], a->origin[2],
-		a->dim[0], a->dim[1], a->dim[2]);
-	printf("B = %f,%f,%f %f,%f,%f\n",
-		b->origin[0], b->origin[1], b->origin[2],
-		b->dim[0], b->dim[1], b->dim[2]);
-	for(i = 0; i < 3; i++)
-		printf("%f %f %f\n", D[i][0], D[i][1], D[i][2]);
-	printf("T = %f %f %f\n", T[0], T[1], T[2]);
-	printf("v = %f %f %f\n", v[0], v[1], v[2]);
-#endif
 	return 1;
 }
 
@@ -488,8 +449,8 @@ void obb_build_aabb(const struct obb *obb, vec3_t mins, vec3_t maxs)
 {
 	unsigned int i;
 
-	v_copy(mins, obb->origin);
-	v_copy(maxs, obb->origin);
+	v_zero(mins);
+	v_zero(maxs);
 
 	for(i = 0; i < 8; i++) {
 		unsigned int j;
@@ -498,15 +459,15 @@ void obb_build_aabb(const struct obb *obb, vec3_t mins, vec3_t maxs)
 		if ( i & 1 )
 			tmp[0] = obb->dim[0];
 		else
-			tmp[0] = obb->dim[0];
+			tmp[0] = -obb->dim[0];
 		if ( i & 2 )
 			tmp[1] = obb->dim[1];
 		else
-			tmp[1] = obb->dim[1];
+			tmp[1] = -obb->dim[1];
 		if ( i & 4 )
 			tmp[2] = obb->dim[2];
 		else
-			tmp[2] = obb->dim[2];
+			tmp[2] = -obb->dim[2];
 
 		basis_transform((const float (*)[3])obb->rot, vec, tmp);
 		for(j = 0; j < 3; j++) {
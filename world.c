@@ -13,10 +13,14 @@
 #include <punani/particles.h>
 #include <punani/console.h>
 #include <punani/entity.h>
+#include <punani/missile.h>
 #include <punani/cvar.h>
+#include <punani/timer.h>
+#include <punani/demo.h>
 
 
 #include "game-modes.h"
+#include "dessert-stroke.h"
 
 #include <SDL/SDL_keysym.h>
 #include <math.h>
@@ -34,10 +38,12 @@ struct _world {
 	renderer_t render;
 	map_t map;
 	chopper_t apache;
+	demo_t demo;
 	cvar_ns_t cvars;
 	light_t light;
 	font_t font;
 	vec3_t lpos;
+	vec3_t lcolor;
 	vec3_t cpos;
 	float lightAngle;
 	float lightRate;
@@ -45,10 +51,38 @@ struct _world {
 	unsigned int w_shadowmode;
 	unsigned int fcnt;
 	unsigned int light_ticks;
+	unsigned int vis_passes;
+	unsigned int vis_usec;
+	unsigned int vis_saved_usec;
+	uint64_t last_render;
 };
 
+/* everything render needs from a tick */
+struct world_snap {
+	entity_snap_t ents;
+	particles_snap_t parts;
+	vec3_t cam_old; /* chopper at the tick, moving by cam_move */
+	vec3_t cam_move;
+	vec3_t lpos;
+	vec3_t lcolor;
+	unsigned int fcnt;
+	int do_shadows;
+};
+
+/* keep the map paged in around the chopper */
+static void page_map(struct _world *world)
+{
+	vec3_t pos, move;
+
+	chopper_get_pos(world->apache, 0.0, move);
+	chopper_get_pos(world->apache, 1.0, pos);
+	v_sub(move, pos, move);
+	map_page(world->map, pos, move);
+}
+
 static void *ctor(renderer_t r, void *common)
 {
+	const struct ds_opts *opts = common;
 	struct _world *world = NULL;
 	vec3_t spawn;
 
@@ -67,9 +101,14 @@ static void *ctor(renderer_t r, void *common)
 	spawn[1] = CHOPPER_HEIGHT;
 	spawn[2] = 0.0;
 
+	if ( !missile_init() )
+		goto out_free_map;
+
 	world->apache = chopper_comanche(spawn, 0.785);
 	if ( NULL == world->apache )
-		goto out_free_map;
+		goto out_free_missiles;
+
+	page_map(world);
 
 	world->light = light_new(r, LIGHT_CAST_SHADOWS);
 	if ( NULL == world->light ) {
@@ -92,21 +131,38 @@ static void *ctor(renderer_t r, void *common)
 	cvar_register_float(world->cvars, "lightRate", CVAR_FLAG_SAVE_NOTDEFAULT, &world->lightRate);
 	cvar_register_uint(world->cvars, "tpf", CVAR_FLAG_SAVE_NOTDEFAULT, &world->light_ticks);
 	cvar_register_uint(world->cvars, "shadowmode", CVAR_FLAG_SAVE_NOTDEFAULT, &world->w_shadowmode);
+	cvar_register_uint(world->cvars, "vis_usec", CVAR_FLAG_SAVE_NEVER, &world->vis_usec);
+	cvar_register_uint(world->cvars, "vis_saved_usec", CVAR_FLAG_SAVE_NEVER, &world->vis_saved_usec);
 
 	cvar_ns_load(world->cvars);
 
 	world->fcnt = (world->lightAngle / (M_PI / world->lightRate));
 	world->fcnt *= world->light_ticks;
 
+	if ( opts && opts->demo_play ) {
+		world->demo = demo_play(opts->demo_play);
+		if ( NULL == world->demo )
+			goto out_free_cvars;
+	}else if ( opts && opts->demo_record ) {
+		world->demo = demo_record(opts->demo_record,
+						(uint32_t)timer_usec());
+		if ( NULL == world->demo )
+			goto out_free_cvars;
+	}
+
 	/* success */
 	goto out;
 
+out_free_cvars:
+	cvar_ns_free(world->cvars);
 out_free_font:
 	font_free(world->font);
 out_free_light:
 	light_free(world->light);
 out_free_chopper:
 	chopper_free(world->apache);
+out_free_missiles:
+	missile_exit();
 out_free_map:
 	map_free(world->map);
 out_free:
@@ -123,6 +179,13 @@ static void get_screen_centre(renderer_t r, float h, vec3_t out)
 	renderer_unproject(r, out, x / 2, y / 2, h);
 }
 
+static void cam_pos(const struct world_snap *s, float lerp, vec3_t out)
+{
+	out[0] = s->cam_old[0] + s->cam_move[0] * lerp;
+	out[1] = s->cam_old[1] + s->cam_move[1] * lerp;
+	out[2] = s->cam_old[2] + s->cam_move[2] * lerp;
+}
+
 static void view_transform(world_t w)
 {
 	renderer_t r = w->render;
@@ -130,31 +193,54 @@ static void view_transform(world_t w)
 	get_screen_centre(r, CHOPPER_HEIGHT, w->cpos);
 }
 
-static void do_render(world_t w, float lerp, light_t l)
+static void do_render(world_t w, struct world_snap *s, float lerp, light_t l)
 {
 	renderer_t r = w->render;
 	vec3_t cpos;
 
 	if ( w->w_shadowmode == W_SHADOWMODE_BOTH || NULL == l ) {
-		chopper_get_pos(w->apache, lerp, cpos);
+		cam_pos(s, lerp, cpos);
 
 		glPushMatrix();
 		renderer_translate(r, w->cpos[0], w->cpos[1], w->cpos[2]);
 		renderer_translate(r, -cpos[0], -cpos[1], -cpos[2]);
 		map_render(w->map, r, l);
-		entity_render_all(r, lerp, l);
+		entity_render_all(s->ents, r, lerp, l);
 		glPopMatrix();
+		w->vis_passes++;
 	}
 }
 
-static void render_lit(world_t w, float lerp)
+/* work out what's visible once, up front, for all passes */
+static void build_visible(world_t w, struct world_snap *s, float lerp)
+{
+	renderer_t r = w->render;
+	uint64_t begin;
+	vec3_t cpos;
+
+	begin = timer_usec();
+
+	cam_pos(s, lerp, cpos);
+
+	glPushMatrix();
+	renderer_translate(r, w->cpos[0], w->cpos[1], w->cpos[2]);
+	renderer_translate(r, -cpos[0], -cpos[1], -cpos[2]);
+	map_cull(w->map, r);
+	entity_cull_all(s->ents, w->map, lerp);
+	glPopMatrix();
+
+	w->vis_usec = timer_usec() - begin;
+	w->vis_passes = 0;
+}
+
+static void render_lit(world_t w, struct world_snap *s, float lerp)
 {
 	renderer_t r = w->render;
 	vec3_t cpos;
 
 	glEnable(GL_LIGHT0);
 
-	if ( w->do_shadows ) {
+	if ( s->do_shadows ) {
 		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 		glDepthMask(GL_TRUE);
 		glStencilFunc(GL_EQUAL, 0x0, 0xff);
@@ -162,33 +248,34 @@ static void render_lit(world_t w, float lerp)
 		glEnable(GL_STENCIL_TEST);
 	}
 
-	do_render(w, lerp, NULL);
+	do_render(w, s, lerp, NULL);
 
-	if ( w->do_shadows ) {
+	if ( s->do_shadows ) {
 		glDisable(GL_STENCIL_TEST);
 	}
 
 	glPushMatrix();
-	chopper_get_pos(w->apache, lerp, cpos);
+	cam_pos(s, lerp, cpos);
 	renderer_translate(r, w->cpos[0], w->cpos[1], w->cpos[2]);
 	renderer_translate(r, -cpos[0], -cpos[1], -cpos[2]);
-	particles_render_all(r, lerp);
+	particles_render_all(s->parts, r, lerp);
 	glPopMatrix();
 }
 
-static void render_shadow_volumes(world_t w, float lerp)
+static void render_shadow_volumes(world_t w, struct world_snap *s,
+					float lerp)
 {
-	if ( !w->do_shadows )
+	if ( !s->do_shadows )
 		return;
-	do_render(w, lerp, w->light);
+	do_render(w, s, lerp, w->light);
 }
 
-static void render_unlit(world_t w, float lerp)
+static void render_unlit(world_t w, struct world_snap *s, float lerp)
 {
-	if ( !w->do_shadows )
+	if ( !s->do_shadows )
 		return;
 	glDisable(GL_LIGHT0);
-	do_render(w, lerp, NULL);
+	do_render(w, s, lerp, NULL);
 }
 
 static void recalc_light(world_t w)
@@ -196,7 +283,7 @@ static void recalc_light(world_t w)
 	static const vec3_t c_noon = {1.0, 0.87, 1.0};
 	static const vec3_t c_dusk = {0.8, 0.4, 0.24};
 	static const vec3_t c_night = {0.05, 0.05, 0.2};
-	vec3_t color;
+	float *color = w->lcolor;
 	float lerp;
 
 	w->lpos[0] = 0.0;
@@ -217,18 +304,38 @@ static void recalc_light(world_t w)
 		color[1] = c_dusk[1] + (c_night[1] - c_dusk[1]) * lerp;
 		color[2] = c_dusk[2] + (c_night[2] - c_dusk[2]) * lerp;
 	}
+}
+
+/* moving the light recalculates every shadow volume, so only on change */
+static void apply_light(world_t w, const struct world_snap *s)
+{
+	vec3_t pos;
 
-	light_set_color(w->light, color[0], color[1], color[2]);
-	light_set_pos(w->light, w->lpos);
+	light_set_color(w->light, s->lcolor[0], s->lcolor[1], s->lcolor[2]);
+	light_get_pos(w->light, pos);
+	if ( memcmp(pos, s->lpos, sizeof(pos)) )
+		light_set_pos(w->light, s->lpos);
 }
 
-static void render(void *priv, float lerp)
+static void render(void *priv, void *snap, float lerp)
 {
 	struct _world *world = priv;
+	struct world_snap *s = snap;
 	renderer_t r = world->render;
 	vec3_t cpos;
+	uint64_t now;
 	int mins;
 
+	if ( world->demo ) {
+		now = timer_usec();
+		if ( world->last_render )
+			demo_frame_time(world->demo, now - world->last_render);
+		world->last_render = now;
+	}
+
+	map_put_released(world->map);
+	apply_light(world, s);
+
 	renderer_render_3d(r);
 	renderer_clear_color(r, 0.8, 0.8, 1.0);
 
@@ -236,40 +343,118 @@ static void render(void *priv, float lerp)
 	view_transform(world);
 	light_render(world->light);
 
-	render_unlit(world, lerp);
-	render_shadow_volumes(world, lerp);
-	render_lit(world, lerp);
+	build_visible(world, s, lerp);
+	render_unlit(world, s, lerp);
+	render_shadow_volumes(world, s, lerp);
+	render_lit(world, s, lerp);
+
+	/* each extra pass would have re-done the culling */
+	if ( world->vis_passes > 1 ) {
+		world->vis_saved_usec = world->vis_usec *
+					(world->vis_passes - 1);
+	}else{
+		world->vis_saved_usec = 0;
+	}
 
 	glPopMatrix();
 
 	renderer_render_2d(r);
-	chopper_get_pos(world->apache, lerp, cpos);
+	cam_pos(s, lerp, cpos);
 	font_printf(world->font, 8, 4, "A madman strikes again! (%.0f fps)",
 			renderer_fps(r));
 	font_printf(world->font, 8, 24, "x: %.3f y: %.3f", cpos[0], cpos[2]);
 
-	mins = (world->fcnt * (M_PI / (world->lightRate * world->light_ticks))) * (1440.0 / (2 * M_PI));
+	mins = (s->fcnt * (M_PI / (world->lightRate * world->light_ticks))) * (1440.0 / (2 * M_PI));
 	mins += 6 * 60;
 	mins %= 1440;
 	font_printf(world->font, 8, 44, "local time: %02d:%02d",
 			mins / 60, mins % 60);
 }
 
+static void *snap_new(void *priv)
+{
+	struct world_snap *s;
+
+	s = calloc(1, sizeof(*s));
+	if ( NULL == s )
+		goto out;
+
+	s->ents = entity_snap_new();
+	if ( NULL == s->ents )
+		goto out_free;
+
+	s->parts = particles_snap_new();
+	if ( NULL == s->parts )
+		goto out_free_ents;
+
+	/* success */
+	goto out;
+
+out_free_ents:
+	entity_snap_free(s->ents);
+out_free:
+	free(s);
+	s = NULL;
+out:
+	return s;
+}
+
+static void snap_free(void *priv, void *snap)
+{
+	struct world_snap *s = snap;
+
+	if ( s ) {
+		particles_snap_free(s->parts);
+		entity_snap_free(s->ents);
+		free(s);
+	}
+}
+
+static void snapshot(void *priv, void *snap)
+{
+	struct _world *world = priv;
+	struct world_snap *s = snap;
+
+	entity_snap(s->ents);
+	particles_snap(s->parts);
+
+	chopper_get_pos(world->apache, 0.0, s->cam_old);
+	chopper_get_pos(world->apache, 1.0, s->cam_move);
+	v_sub(s->cam_move, s->cam_move, s->cam_old);
+
+	v_copy(s->lpos, world->lpos);
+	v_copy(s->lcolor, world->lcolor);
+	s->fcnt = world->fcnt;
+	s->do_shadows = world->do_shadows;
+}
+
 static void dtor(void *priv)
 {
 	struct _world *world = priv;
+	demo_close(world->demo);
 	cvar_ns_save(world->cvars);
 	cvar_ns_free(world->cvars);
 	light_free(world->light);
 	chopper_free(world->apache);
+	missile_exit();
 	map_free(world->map);
 	particles_free_all();
 	free(world);
 }
 
+/* nobody else gets to fly the chopper during playback */
+static int demo_flying(struct _world *world)
+{
+	return world->demo && demo_playing(world->demo);
+}
+
 static void keypress(void *priv, int key, int down)
 {
 	struct _world *world = priv;
+
+	if ( demo_flying(world) && key != SDLK_ESCAPE && key != SDLK_1 )
+		return;
+
 	switch(key) {
 	case SDLK_a:
 	case SDLK_LEFT:
@@ -312,8 +497,11 @@ static void keypress(void *priv, int key, int down)
 		break;
 
 	case SDLK_SPACE:
-		if ( down )
+		if ( down ) {
 			chopper_fire(world->apache, world->fcnt);
+			if ( world->demo )
+				demo_fire(world->demo);
+		}
 		break;
 
 	case SDLK_1:
@@ -329,13 +517,22 @@ static void keypress(void *priv, int key, int down)
 static void grabbed(void *priv)
 {
 	struct _world *world = priv;
-	chopper_control_release_all(world->apache);
+	if ( !demo_flying(world) )
+		chopper_control_release_all(world->apache);
 }
 
 static void frame(void *priv)
 {
 	struct _world *world = priv;
 
+	if ( world->demo && !demo_tick(world->demo, world->apache, world->fcnt) ) {
+		renderer_exit(world->render, GAME_MODE_COMPLETE);
+		return;
+	}
+
+	/* collisions only see what's paged in, so the tick decides that */
+	page_map(world);
+
 	if ( (world->fcnt % world->light_ticks) == 0 ) {
 		world->lightAngle += M_PI / world->lightRate;
 		recalc_light(world);
@@ -351,6 +548,9 @@ const struct game_ops world_ops = {
 	.dtor = dtor,
 	.new_frame = frame,
 	.render = render,
+	.snap_new = snap_new,
+	.snap_free = snap_free,
+	.snapshot = snapshot,
 	.grabbed = grabbed,
 	.keypress = keypress,
 };